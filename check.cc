@@ -0,0 +1,187 @@
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "sqlight.hpp"
+
+// behavior checks against mock.cc: placeholder binding, cursor fetches, binlog decoding and fan-out merges.
+// every check prints ok or FAIL; the exit code is the number of failures, so scripts can gate on it.
+//   ./mock -P 33070 & ./check -P 33070
+
+namespace {
+
+    // keeps every value of a stream as text, NULLs apart, and counts the calls a writer gets
+    struct recorder : sq::writer {
+        std::vector<std::string> names, values;
+        std::vector<bool> nulls;
+        unsigned fields = 0, columns_calls = 0, rows = 0, sets = 1, dones = 0;
+
+        void field( int, const char *name, int, int ) { names.push_back( name ), fields++; }
+        void columns( const sq::schema & ) { columns_calls++; }
+        void value( int, const char *data, size_t len, int ) {
+            values.push_back( data ? std::string( data, len ) : std::string() );
+            nulls.push_back( !data );
+        }
+        void row() { rows++; }
+        void next() { sets++; }
+        void done() { dones++; }
+    };
+
+    struct grid {
+        int w = 0, h = 0;
+        std::vector<std::string> cells;
+    };
+
+    void OnGrid( void *userdata, int w, int h, const char **map ) {
+        grid &g = *(grid *)userdata;
+        g.w = w, g.h = h, g.cells.assign( map, map + w * h );
+    }
+
+    struct events {
+        std::vector<sq::binlog::event> list;
+        std::vector< std::vector<std::string> > cells; // copies: event cells only live during the callback
+    };
+
+    void OnEvent( void *userdata, const sq::binlog::event &ev ) {
+        events &e = *(events *)userdata;
+        e.list.push_back( ev );
+        e.cells.push_back( std::vector<std::string>() );
+        for( int n = 0; n < ev.w * ev.h; ++n )
+            e.cells.back().push_back( ev.cells[n] ? std::string( ev.cells[n], ev.lens[n] ) : std::string( "NULL" ) );
+    }
+}
+
+int main( int argc, const char **argv )
+{
+    std::string host = "127.0.0.1", port = "33060", user = "root", pass = "root";
+
+    auto usage = [&]() {
+        std::cerr << "usage: " << argv[0] << " [options]" << std::endl;
+        std::cerr << "  -h host        mock server, or its unix socket path (127.0.0.1)" << std::endl;
+        std::cerr << "  -P port        (33060)" << std::endl;
+        std::cerr << "  -u user        (root)" << std::endl;
+        std::cerr << "  -p pass        (root)" << std::endl;
+        return 1;
+    };
+
+    for( int i = 1; i < argc; ++i ) {
+        std::string opt = argv[i];
+        if( opt.size() != 2 || opt[0] != '-' || i + 1 >= argc )
+            return usage();
+        std::string arg = argv[++i];
+        /**/ if( opt == "-h" ) host = arg;
+        else if( opt == "-P" ) port = arg;
+        else if( opt == "-u" ) user = arg;
+        else if( opt == "-p" ) pass = arg;
+        else return usage();
+    }
+
+    int failed = 0;
+    auto check = [&]( const std::string &name, bool ok, const std::string &detail = std::string() ) {
+        std::cout << ( ok ? "ok   " : "FAIL " ) << name;
+        if( !ok && !detail.empty() ) std::cout << ": " << detail;
+        std::cout << std::endl;
+        failed += !ok;
+    };
+
+    sq::light sql;
+    if( !sql.connect( host, port, user, pass ) )
+        return std::cerr << "error: connection to mock failed" << std::endl, 1;
+
+    // placeholders: strings quoted and escaped, chars as strings, NULLs, numbers as is, quoted '?' left alone
+    {
+        recorder out;
+        bool ok = sql.exec( out, "echo ?,?,?,?,?,?,?,'?'", "it's \\ \"q\"\n", 'c', nullptr, (const char *)0, -7, 2.5, true );
+        std::string expected = "'it\\'s \\\\ \\\"q\\\"\\n','c',NULL,NULL,-7,2.5,1,'?'";
+        check( "bind quoting and NULL", ok && out.values.size() == 1 && out.values[0] == expected, out.values.empty() ? "no row" : out.values[0] );
+
+        recorder none;
+        check( "bind count mismatch", !sql.exec( none, "echo ?, ?", 1 ) && sql.last_error().message.find( "mismatch" ) != std::string::npos );
+
+        // a long generated format (ie, a big IN list) is counted in a loop, not one recursion per character
+        std::string list = "echo ?";
+        for( int n = 0; n < 100000; ++n ) list += ",1";
+        recorder many;
+        bool long_ok = sql.exec( many, list.c_str(), "x" ) && many.values.size() == 1 && many.values[0].compare( 0, 6, "'x',1," ) == 0;
+        check( "bind long format", long_ok );
+    }
+
+    // cursor: rows come in chunks of 4, as one result set with a single field()/columns() round
+    {
+        sq::cursor cur( sql, 4 );
+        recorder out;
+        unsigned fetches = 0;
+        bool ok = cur.open( "select 10 rows" );
+        while( ok && !cur.eof() )
+            ok = cur.fetch( out ), fetches++;
+        bool ids = out.values.size() == 30;
+        for( size_t r = 0; ids && r < 10; ++r )
+            ids = out.values[r * 3] == std::to_string( r ) && out.nulls[r * 3 + 2];
+        check( "cursor fetch batching", ok && fetches == 3 && out.rows == 10 && ids, std::to_string( fetches ) + " fetches, " + std::to_string( out.rows ) + " rows" );
+        check( "cursor describes once", out.fields == 3 && out.columns_calls == 1 && out.dones == 1 && out.sets == 1 );
+
+        recorder broken;
+        bool first = cur.open( "select 10 rows failing" ) && cur.fetch( broken );
+        bool second = cur.fetch( broken );
+        grid g;
+        sql.exec( "select statements", OnGrid, &g );
+        check( "cursor error closes statement", first && !second && g.h == 2 && g.cells[1] == "0", g.h == 2 ? g.cells[1] + " statements left" : "no answer" );
+        check( "cursor reopens after error", cur.open( "select 3 rows" ) && cur.fetch( out ) && cur.eof() );
+    }
+
+    // binlog: the mock's built-in fixture, one event of every kind and a row of every column type
+    {
+        sq::light side;
+        side.connect( host, port, user, pass );
+        sq::binlog log( side, 777 );
+        events e;
+        bool ok = log.open() && log.poll( OnEvent, &e, 1 );
+        std::string kinds;
+        for( auto &ev : e.list )
+            kinds += "?IUDQC"[ ev.type ];
+        check( "binlog events", ok && kinds == "ICUCDCQ", kinds );
+        if( kinds == "ICUCDCQ" ) {
+            const sq::binlog::event &insert = e.list[0];
+            const std::vector<std::string> &row = e.cells[0];
+            check( "binlog insert image", insert.w == 14 && insert.h == 2 && insert.table == "orders" && insert.db == "shop" &&
+                row[0] == "-5" && row[1] == "h\xe9llo" && row[2] == "-1234.56" && row[3] == "2024-02-29 13:05:09.123" &&
+                row[4] == "18446744073709551615" && row[6] == "NULL" && row[8] == "-26:03:04" && row[13] == "-12345678901234567890.0123456789" );
+            check( "binlog update images", e.list[2].h == 2 && e.cells[2][1] == "old" && e.cells[2][14 + 1] == "new" );
+            check( "binlog delete image", e.list[4].h == 1 && e.cells[4][0] == "9" && e.cells[4][1] == "NULL" );
+            check( "binlog ddl", e.list[6].query == "ALTER TABLE orders ADD x INT" );
+        }
+        check( "binlog position", log.where().file == "binlog.000008" && log.where().offset == 4, log.where().file );
+    }
+
+    // fan-out: three shards of the same mock. folds skip NULLs but keep empty strings
+    {
+        sq::light a, b, c;
+        a.connect( host, port, user, pass ), b.connect( host, port, user, pass ), c.connect( host, port, user, pass );
+        sq::fanout shards;
+        shards.add( a ), shards.add( b ), shards.add( c );
+
+        grid g;
+        bool ok = shards.exec( "select 2 rows", sq::fanout::merge(), OnGrid, &g );
+        check( "fanout concat", ok && g.w == 3 && g.h == 7 );
+
+        ok = shards.exec( "select 3 rows", sq::fanout::merge( sq::fanout::ORDERED, "id" ), OnGrid, &g );
+        std::string ids;
+        for( int r = 1; r < g.h; ++r ) ids += g.cells[r * g.w];
+        check( "fanout ordered", ok && ids == "000111222", ids );
+
+        ok = shards.exec( "select groups", sq::fanout::merge( sq::fanout::SUM, "g" ), OnGrid, &g );
+        check( "fanout sum by group", ok && g.h == 3 && g.cells[3] == "a" && g.cells[5] == "3" && g.cells[6] == "b" && g.cells[8] == "12" );
+
+        ok = shards.exec( "select groups", sq::fanout::merge( sq::fanout::MIN, "g" ), OnGrid, &g );
+        check( "fanout min keeps ''", ok && g.h == 3 && g.cells[4] == "" && g.cells[7] == "x", g.h == 3 ? "'" + g.cells[4] + "' '" + g.cells[7] + "'" : "" );
+
+        ok = shards.exec( "select groups", sq::fanout::merge( sq::fanout::MAX, "g" ), OnGrid, &g );
+        check( "fanout max skips NULL", ok && g.h == 3 && g.cells[4] == "y" && g.cells[7] == "x" );
+
+        ok = shards.exec( "select 1", sq::fanout::merge( sq::fanout::COUNT ), OnGrid, &g );
+        check( "fanout count", ok && g.h == 2 && g.cells[1] == "3" );
+    }
+
+    std::cout << ( failed ? std::to_string( failed ) + " check(s) failed" : std::string( "all checks passed" ) ) << std::endl;
+    return failed;
+}
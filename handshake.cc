@@ -0,0 +1,76 @@
+#include <ctime>
+#include <iostream>
+#include <string>
+
+#include "sqlight.hpp"
+
+// handshake microbenchmark: connection setup, over and over, against one server.
+// "connect" builds a new sq::light every time (buffers, scramble hashes from scratch); "reconnect" reuses one,
+// keeping its buffers and cached password hashes, as a pool recovering from a server restart would.
+// client cpu per handshake is what the library spends; the rest of the wall time is network and server.
+
+int main( int argc, const char **argv )
+{
+    std::string host = "127.0.0.1", port = "3306", user = "root", pass = "root";
+    unsigned count = 1000;
+
+    auto usage = [&]() {
+        std::cerr << "usage: " << argv[0] << " [options]" << std::endl;
+        std::cerr << "  -h host        server, or unix socket path (127.0.0.1)" << std::endl;
+        std::cerr << "  -P port        (3306)" << std::endl;
+        std::cerr << "  -u user        (root)" << std::endl;
+        std::cerr << "  -p pass        (root)" << std::endl;
+        std::cerr << "  -n count       handshakes per mode (1000)" << std::endl;
+        return 1;
+    };
+
+    for( int i = 1; i < argc; ++i ) {
+        std::string opt = argv[i];
+        if( opt.size() != 2 || opt[0] != '-' || i + 1 >= argc )
+            return usage();
+        std::string arg = argv[++i];
+        /**/ if( opt == "-h" ) host = arg;
+        else if( opt == "-P" ) port = arg;
+        else if( opt == "-u" ) user = arg;
+        else if( opt == "-p" ) pass = arg;
+        else if( opt == "-n" ) count = std::stoul(arg);
+        else return usage();
+    }
+    if( !count )
+        return usage();
+
+    sq::metrics::reset();
+
+    // fresh connection objects
+    unsigned failed = 0;
+    std::clock_t cpu = std::clock();
+    for( unsigned n = 0; n < count; ++n ) {
+        sq::light sql;
+        sq::metrics m( "connect" );
+        if( !sql.connect( host, port, user, pass ) )
+            m.cancel(), failed++;
+    }
+    double connect_cpu = double( std::clock() - cpu ) / CLOCKS_PER_SEC / count;
+
+    // one connection, reconnected
+    sq::light sql;
+    if( !sql.connect( host, port, user, pass ) )
+        return std::cerr << "error: connection to database failed" << std::endl, 1;
+    cpu = std::clock();
+    for( unsigned n = 0; n < count; ++n ) {
+        sq::metrics m( "reconnect" );
+        if( !sql.reconnect() )
+            m.cancel(), failed++;
+    }
+    double reconnect_cpu = double( std::clock() - cpu ) / CLOCKS_PER_SEC / count;
+
+    std::string format = "{idx} (x{hits}) avg:{avg} p50:{p50} p99:{p99} max:{max}";
+    for( auto &line : sq::metrics::report( format, "{idx}", false ) ) {
+        if( line.compare( 0, 7, "connect" ) == 0 ) std::cout << line << " cpu:" << connect_cpu << std::endl;
+        if( line.compare( 0, 9, "reconnect" ) == 0 ) std::cout << line << " cpu:" << reconnect_cpu << std::endl;
+    }
+    if( failed )
+        std::cout << failed << " handshake(s) failed" << std::endl;
+
+    return failed ? 2 : 0;
+}
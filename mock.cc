@@ -0,0 +1,659 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+// mock server: enough of the MySQL protocol to try sqlight, stress.cc and the benchmarks without a real server.
+// handshake (mysql_native_password or caching_sha2_password fast path), session tracking, a fixed set of queries,
+// prepared statements with cursors, and COM_BINLOG_DUMP replaying either a built-in binlog fixture or a binlog file.
+// posix only. every connection gets a thread of its own.
+
+namespace
+{
+    std::string user = "root", pass = "root", plugin = "mysql_native_password", binlog_file;
+    bool tracking = true;
+    std::atomic<unsigned> ids(100), flaky(0), dropping(0);
+
+    // hashes for checking scrambles. plain and compact: speed is not the point here
+
+    uint32_t rol( uint32_t x, int n ) { return x << n | x >> ( 32 - n ); }
+    uint32_t ror( uint32_t x, int n ) { return x >> n | x << ( 32 - n ); }
+
+    std::string padded( const std::string &in ) {
+        // message, 0x80, zeros, then the bit length big endian: a whole number of 64-byte blocks
+        std::string m = in + '\x80';
+        while( m.size() % 64 != 56 ) m += '\0';
+        uint64_t bits = uint64_t( in.size() ) * 8;
+        for( int i = 7; i >= 0; --i ) m += char( bits >> ( i * 8 ) );
+        return m;
+    }
+
+    uint32_t be32( const std::string &m, size_t at ) {
+        return uint32_t( (unsigned char)m[at] ) << 24 | uint32_t( (unsigned char)m[at+1] ) << 16 | uint32_t( (unsigned char)m[at+2] ) << 8 | (unsigned char)m[at+3];
+    }
+
+    std::string digest( const uint32_t *h, int n ) {
+        std::string out;
+        for( int i = 0; i < n; ++i )
+            for( int j = 3; j >= 0; --j ) out += char( h[i] >> ( j * 8 ) );
+        return out;
+    }
+
+    std::string sha1( const std::string &in ) {
+        uint32_t h[5] = { 0x67452301, 0xEFCDAB89, 0x98BADCFE, 0x10325476, 0xC3D2E1F0 };
+        std::string m = padded( in );
+        for( size_t at = 0; at < m.size(); at += 64 ) {
+            uint32_t w[80];
+            for( int i = 0; i < 16; ++i ) w[i] = be32( m, at + i * 4 );
+            for( int i = 16; i < 80; ++i ) w[i] = rol( w[i-3] ^ w[i-8] ^ w[i-14] ^ w[i-16], 1 );
+            uint32_t a = h[0], b = h[1], c = h[2], d = h[3], e = h[4];
+            for( int i = 0; i < 80; ++i ) {
+                uint32_t f = i < 20 ? ( ( b & c ) | ( ~b & d ) ) + 0x5A827999
+                           : i < 40 ? ( b ^ c ^ d ) + 0x6ED9EBA1
+                           : i < 60 ? ( ( b & c ) | ( b & d ) | ( c & d ) ) + 0x8F1BBCDC
+                           :          ( b ^ c ^ d ) + 0xCA62C1D6;
+                uint32_t t = rol( a, 5 ) + f + e + w[i];
+                e = d, d = c, c = rol( b, 30 ), b = a, a = t;
+            }
+            h[0] += a, h[1] += b, h[2] += c, h[3] += d, h[4] += e;
+        }
+        return digest( h, 5 );
+    }
+
+    std::string sha256( const std::string &in ) {
+        static const uint32_t k[64] = {
+            0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+            0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+            0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+            0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+            0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+            0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+            0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+            0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2 };
+        uint32_t h[8] = { 0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19 };
+        std::string m = padded( in );
+        for( size_t at = 0; at < m.size(); at += 64 ) {
+            uint32_t w[64];
+            for( int i = 0; i < 16; ++i ) w[i] = be32( m, at + i * 4 );
+            for( int i = 16; i < 64; ++i )
+                w[i] = w[i-16] + ( ror( w[i-15], 7 ) ^ ror( w[i-15], 18 ) ^ ( w[i-15] >> 3 ) ) + w[i-7] + ( ror( w[i-2], 17 ) ^ ror( w[i-2], 19 ) ^ ( w[i-2] >> 10 ) );
+            uint32_t v[8];
+            for( int i = 0; i < 8; ++i ) v[i] = h[i];
+            for( int i = 0; i < 64; ++i ) {
+                uint32_t t1 = v[7] + ( ror( v[4], 6 ) ^ ror( v[4], 11 ) ^ ror( v[4], 25 ) ) + ( ( v[4] & v[5] ) ^ ( ~v[4] & v[6] ) ) + k[i] + w[i];
+                uint32_t t2 = ( ror( v[0], 2 ) ^ ror( v[0], 13 ) ^ ror( v[0], 22 ) ) + ( ( v[0] & v[1] ) ^ ( v[0] & v[2] ) ^ ( v[1] & v[2] ) );
+                for( int j = 7; j > 0; --j ) v[j] = v[j-1];
+                v[4] += t1, v[0] = t1 + t2;
+            }
+            for( int i = 0; i < 8; ++i ) h[i] += v[i];
+        }
+        return digest( h, 8 );
+    }
+
+    std::string xored( const std::string &a, const std::string &b ) {
+        std::string out = a;
+        for( size_t i = 0; i < out.size() && i < b.size(); ++i ) out[i] ^= b[i];
+        return out;
+    }
+
+    // wire encoding
+
+    std::string le( uint64_t v, int bytes ) {
+        std::string out;
+        for( int i = 0; i < bytes; ++i ) out += char( v >> ( i * 8 ) );
+        return out;
+    }
+
+    std::string be( uint64_t v, int bytes ) {
+        std::string out;
+        for( int i = bytes - 1; i >= 0; --i ) out += char( v >> ( i * 8 ) );
+        return out;
+    }
+
+    std::string lenenc( uint64_t n ) {
+        if( n < 251 ) return std::string( 1, char(n) );
+        if( n < 1 << 16 ) return '\xfc' + le( n, 2 );
+        if( n < 1 << 24 ) return '\xfd' + le( n, 3 );
+        return '\xfe' + le( n, 8 );
+    }
+
+    std::string lstr( const std::string &s ) {
+        return lenenc( s.size() ) + s;
+    }
+
+    std::string ok( unsigned status = 2, const std::string &state = std::string() ) {
+        // affected rows, insert id, status, warnings, then the session state trailer (if any)
+        if( state.empty() )
+            return std::string( "\x00\x00\x00", 3 ) + le( status, 2 ) + le( 0, 2 );
+        return std::string( "\x00\x00\x00", 3 ) + le( status | 0x4000, 2 ) + le( 0, 2 ) + lstr( "" ) + lstr( state );
+    }
+
+    std::string eof( unsigned status = 2 ) {
+        return '\xfe' + le( 0, 2 ) + le( status, 2 );
+    }
+
+    std::string err( unsigned code, const std::string &message, const std::string &state = "42000" ) {
+        return '\xff' + le( code, 2 ) + '#' + state + message;
+    }
+
+    std::string column( const std::string &name, int type, unsigned flags = 0, unsigned charset = 33 ) {
+        return lstr( "def" ) + lstr( "db" ) + lstr( "t" ) + lstr( "t" ) + lstr( name ) + lstr( name ) +
+            '\x0c' + le( charset, 2 ) + le( 255, 4 ) + char(type) + le( flags, 2 ) + '\0' + std::string( 2, '\0' );
+    }
+
+    // binlog fixture: one INSERT, UPDATE and DELETE transaction each on shop.orders, then a DDL and a rotate.
+    // every column type the decoder knows shows up, with NULLs, negative times and decimals, and unsigned BIGINT max
+
+    std::string decimal( const std::string &text, int precision, int scale ) {
+        static const int bytes[] = { 0, 1, 1, 2, 2, 3, 3, 4, 4, 4 };
+        bool negative = text[0] == '-';
+        std::string v = negative ? text.substr( 1 ) : text;
+        size_t dot = v.find( '.' );
+        std::string ip = v.substr( 0, dot ), fp = dot == std::string::npos ? "" : v.substr( dot + 1 );
+        int intg = precision - scale;
+        fp = ( fp + std::string( scale, '0' ) ).substr( 0, scale );
+        ip = std::string( intg > (int)ip.size() ? intg - ip.size() : 0, '0' ) + ip;
+        std::string out;
+        int lead = intg % 9;
+        if( lead ) out += be( strtoull( ip.substr( 0, lead ).c_str(), 0, 10 ), bytes[lead] );
+        for( int g = 0; g < intg / 9; ++g ) out += be( strtoull( ip.substr( lead + 9 * g, 9 ).c_str(), 0, 10 ), 4 );
+        for( int g = 0; g < scale / 9; ++g ) out += be( strtoull( fp.substr( 9 * g, 9 ).c_str(), 0, 10 ), 4 );
+        if( scale % 9 ) out += be( strtoull( fp.substr( scale / 9 * 9 ).c_str(), 0, 10 ), bytes[scale % 9] );
+        out[0] ^= 0x80;
+        if( negative ) for( auto &ch : out ) ch = ~ch;
+        return out;
+    }
+
+    struct col { const char *name; int type; std::string meta; };
+
+    std::vector<col> cols() {
+        return {
+            { "id", 3, "" }, { "name", 15, le( 200, 2 ) }, { "price", 246, "\x0a\x02" }, { "at", 18, "\x03" },
+            { "big", 8, "" }, { "data", 252, "\x02" }, { "flag", 1, "" }, { "d", 10, "" }, { "t", 19, std::string( 1, '\0' ) },
+            { "ts", 17, "\x06" }, { "code", 254, "\xfe\x0a" }, { "e", 254, "\xf7\x01" }, { "dbl", 5, "\x08" }, { "amt", 246, "\x1e\x0a" } };
+    }
+
+    std::string event( int type, const std::string &body, unsigned pos, unsigned timestamp = 1700000000 ) {
+        // OK byte, header, body and a checksum trailer (not a real CRC: sqlight does not verify it)
+        return '\0' + le( timestamp, 4 ) + char(type) + le( 1, 4 ) + le( 19 + body.size() + 4, 4 ) + le( pos, 4 ) + le( 0, 2 ) + body + "\x5a\x5a\x5a\x5a";
+    }
+
+    std::string table_map() {
+        std::string body = le( 42, 6 ) + le( 1, 2 ) + "\x04shop" + '\0' + "\x06orders" + '\0', meta, names;
+        auto c = cols();
+        body += lenenc( c.size() );
+        for( auto &it : c ) body += char(it.type), meta += it.meta, names += lstr( it.name );
+        body += lstr( meta ) + "\xff\xff";
+        body += '\x01' + lstr( "\x20" ); // signedness: of the numeric columns (id price big flag dbl amt), big is unsigned
+        body += '\x04' + lstr( names );
+        return body;
+    }
+
+    std::string row( int id, const std::string &name, const std::string &price, bool null_flag, bool negative_time, const std::string &amount ) {
+        uint64_t ym = 2024 * 13 + 2;
+        uint64_t at = ( ( ym << 22 ) | ( 29 << 17 ) | ( 13 << 12 ) | ( 5 << 6 ) | 9 ) + 0x8000000000ULL;
+        long t = ( 26 << 12 ) | ( 3 << 6 ) | 4;
+        t = ( negative_time ? -t : t ) + 0x800000;
+        std::string out = le( null_flag ? 1 << 6 : 0, 2 );
+        out += le( (uint32_t)id, 4 ) + char( name.size() ) + name + decimal( price, 10, 2 ) + be( at, 5 ) + be( 1230, 2 );
+        out += le( 18446744073709551615ULL, 8 ) + le( 6, 2 ) + std::string( "\x00\x01\xff" "bin", 6 );
+        if( !null_flag ) out += '\xfd';
+        out += le( ( 1999 << 9 ) | ( 12 << 5 ) | 31, 3 ) + be( t, 3 ) + be( 1700000000, 4 ) + be( 654321, 3 ) + "\x03" "abc" + "\x02";
+        double dbl = 0.1;
+        out += std::string( (const char *)&dbl, 8 ) + decimal( amount, 30, 10 );
+        return out;
+    }
+
+    std::string rows_event( int type, const std::string &images, const std::string &present = "\xff\x3f" ) {
+        std::string body = le( 42, 6 ) + le( 0, 2 ) + le( 2, 2 ) + lenenc( cols().size() ) + present;
+        if( type == 31 ) body += present;
+        return body + images;
+    }
+
+    std::string query_event( const std::string &sql ) {
+        return le( 9, 4 ) + le( 0, 4 ) + char(4) + le( 0, 2 ) + le( 0, 2 ) + "shop" + '\0' + sql;
+    }
+
+    std::string gtid( unsigned gno ) {
+        return '\x01' + std::string( "\x3e\x11\xfa\x47\x71\xca\x11\xe1\x9e\x33\xc8\x0a\xa9\x42\x95\x62", 16 ) + le( gno, 8 ) + std::string( 17, '\0' );
+    }
+
+    std::vector<std::string> fixture() {
+        std::string fde = le( 4, 2 ) + "8.0.99-mock" + std::string( 50 - 11, '\0' ) + le( 0, 4 ) + '\x13' + std::string( 40, '\0' ) + '\x01';
+        return {
+            event( 4, le( 1234, 8 ) + "binlog.000007", 0, 0 ),
+            event( 15, fde, 0 ),
+            event( 33, gtid( 101 ), 1300 ), event( 2, query_event( "BEGIN" ), 1350 ), event( 19, table_map(), 1400 ),
+            event( 30, rows_event( 30, row( -5, "h\xe9llo", "-1234.56", true, true, "-12345678901234567890.0123456789" ) +
+                                       row( 2147483647, "", "0.00", false, false, "0.0000000001" ) ), 1450 ),
+            event( 16, le( 77, 8 ), 1500 ),
+            event( 33, gtid( 102 ), 1600 ), event( 2, query_event( "BEGIN" ), 1650 ), event( 19, table_map(), 1700 ),
+            event( 31, rows_event( 31, row( 1, "old", "1.50", true, false, "1" ) + row( 1, "new", "2.50", false, false, "-0.5" ) ), 1800 ),
+            event( 16, le( 78, 8 ), 2000 ),
+            event( 33, gtid( 103 ), 2100 ), event( 2, query_event( "BEGIN" ), 2150 ), event( 19, table_map(), 2200 ),
+            event( 32, rows_event( 32, '\0' + le( 9, 4 ), std::string( "\x01\x00", 2 ) ), 2300 ),
+            event( 16, le( 79, 8 ), 2500 ),
+            event( 33, gtid( 104 ), 2600 ), event( 2, query_event( "ALTER TABLE orders ADD x INT" ), 2700 ),
+            event( 4, le( 4, 8 ) + "binlog.000008", 2750 ) };
+    }
+
+    // a binlog file as written by the server: magic, then events back to back, each telling its own size
+    bool recorded( const std::string &path, std::vector<std::string> &events, bool &checksum ) {
+        std::ifstream in( path, std::ios::binary );
+        std::string data( (std::istreambuf_iterator<char>( in )), std::istreambuf_iterator<char>() );
+        if( data.compare( 0, 4, "\xfe" "bin" ) )
+            return false;
+        checksum = false;
+        for( size_t at = 4; at + 19 <= data.size(); ) {
+            size_t size = (unsigned char)data[at+9] | (unsigned char)data[at+10] << 8 | (unsigned char)data[at+11] << 16 | (size_t)(unsigned char)data[at+12] << 24;
+            if( size < 19 || at + size > data.size() )
+                return false;
+            if( data[at+4] == 15 ) // format description: checksum algorithm, then its own 4 byte checksum
+                checksum = data[at+size-5] == 1;
+            events.push_back( '\0' + data.substr( at, size ) );
+            at += size;
+        }
+        return true;
+    }
+
+    struct session
+    {
+        int fd;
+        unsigned id;
+        unsigned char seq;
+        bool track;                                     // client takes session state trailers
+        std::string rx;
+        struct statement { std::vector<std::string> columns, rows; size_t fetched; bool failing; };
+        std::map<unsigned, statement> statements;
+
+        explicit session( int fd ) : fd(fd), id(++ids), seq(0), track(false) {}
+
+        bool read( std::string &payload ) {
+            for( ;; ) {
+                if( rx.size() >= 4 ) {
+                    size_t len = (unsigned char)rx[0] | (unsigned char)rx[1] << 8 | (unsigned char)rx[2] << 16;
+                    if( rx.size() >= 4 + len ) {
+                        seq = (unsigned char)rx[3] + 1;
+                        payload = rx.substr( 4, len );
+                        rx.erase( 0, 4 + len );
+                        return true;
+                    }
+                }
+                char chunk[65536];
+                ssize_t n = recv( fd, chunk, sizeof(chunk), 0 );
+                if( n <= 0 ) return false;
+                rx.append( chunk, n );
+            }
+        }
+
+        bool send( const std::string &payload ) {
+            // 16MB and over goes in parts, an empty one closing a payload of exact multiple size
+            size_t at = 0, left = payload.size();
+            for( ;; ) {
+                size_t n = left < 0xffffff ? left : 0xffffff;
+                std::string packet = le( n, 3 ) + char( seq++ ) + payload.substr( at, n );
+                for( size_t sent = 0; sent < packet.size(); ) {
+                    ssize_t w = ::send( fd, packet.data() + sent, packet.size() - sent, MSG_NOSIGNAL );
+                    if( w <= 0 ) return false;
+                    sent += w;
+                }
+                at += n, left -= n;
+                if( n < 0xffffff ) return true;
+            }
+        }
+
+        void results( const std::vector<std::string> &columns, const std::vector<std::string> &rows, unsigned status = 2 ) {
+            send( lenenc( columns.size() ) );
+            for( auto &c : columns ) send( c );
+            send( eof( status ) );
+            for( auto &r : rows ) send( r );
+            send( eof( status ) );
+        }
+
+        bool handshake() {
+            std::string salt;
+            std::mt19937 rng( std::random_device{}() );
+            for( int i = 0; i < 20; ++i ) salt += char( 1 + rng() % 127 );
+
+            // everything but SSL, compression, deprecated EOF and PS multi results. session tracking is optional
+            unsigned caps = 0xffffffff & ~( 1u << 24 ) & ~( 1u << 11 ) & ~( 1u << 5 ) & ~( 1u << 18 );
+            if( !tracking ) caps &= ~( 1u << 23 );
+            seq = 0;
+            send( "\x0a" "8.0.99-mock" + std::string( 1, '\0' ) + le( id, 4 ) + salt.substr( 0, 8 ) + '\0' + le( caps & 0xffff, 2 ) + '\x21' +
+                  le( 2, 2 ) + le( caps >> 16, 2 ) + char(21) + std::string( 10, '\0' ) + salt.substr( 8 ) + '\0' + plugin + '\0' );
+
+            // caps(4) max packet(4) charset(1) filler(23) user, auth response, db, plugin
+            std::string p;
+            if( !read( p ) || p.size() < 33 ) return false;
+            unsigned client = (unsigned char)p[0] | (unsigned char)p[1] << 8 | (unsigned char)p[2] << 16 | (unsigned)(unsigned char)p[3] << 24;
+            size_t at = 32;
+            std::string name = p.c_str() + at;
+            at += name.size() + 1;
+            size_t alen = at < p.size() ? (unsigned char)p[at++] : 0;
+            std::string auth = p.substr( at, alen ), db, method;
+            at += alen;
+            if( client & 8 && at < p.size() ) db = p.c_str() + at, at += db.size() + 1;
+            if( client & ( 1 << 19 ) && at < p.size() ) method = p.c_str() + at;
+            std::cerr << "login user=" << name << " db=" << db << " plugin=" << method << std::endl;
+
+            // client guessed another plugin: switch it to ours, with the same salt
+            if( !method.empty() && method != plugin ) {
+                send( '\xfe' + plugin + '\0' + salt + '\0' );
+                if( !read( auth ) ) return false;
+            }
+
+            bool sha2 = plugin == "caching_sha2_password";
+            std::string expected = pass.empty() ? ""
+                : sha2 ? xored( sha256( pass ), sha256( sha256( sha256( pass ) ) + salt ) )
+                :        xored( sha1( pass ), sha1( salt + sha1( sha1( pass ) ) ) );
+            if( name != user || auth != expected )
+                return send( err( 1045, "Access denied for user '" + name + "'", "28000" ) ), false;
+            if( sha2 && !pass.empty() )
+                send( "\x01\x03" ); // fast auth: the password is in the server cache already
+
+            track = tracking && client & ( 1 << 23 );
+            return send( ok( 2, db.empty() ? "" : tracked( '\x01' + lstr( lstr( db ) ) ) ) );
+        }
+
+        std::string tracked( const std::string &state ) {
+            return track ? state : std::string();
+        }
+
+        bool query( const std::string &q ) {
+            std::string l = q;
+            for( auto &ch : l ) ch = (char)tolower( (unsigned char)ch );
+            auto starts = [&]( const char *prefix ) { return l.compare( 0, strlen( prefix ), prefix ) == 0; };
+
+            /**/ if( starts( "select 1" ) && l.find( "rows" ) == std::string::npos )
+                results( { column( "1", 8 ) }, { lstr( "1" ) } );
+            else if( starts( "select " ) && l.find( " rows" ) != std::string::npos && isdigit( (unsigned char)l[7] ) ) {
+                // id, quoted name with a newline, NULL
+                std::vector<std::string> rows;
+                for( unsigned long r = 0, n = strtoul( l.c_str() + 7, 0, 10 ); r < n; ++r )
+                    rows.push_back( lstr( std::to_string( r ) ) + lstr( "name \"" + std::to_string( r ) + "\"\n" ) + '\xfb' );
+                results( { column( "id", 8, 32 | 1 ), column( "name", 253 ), column( "nul", 6 ) }, rows );
+            }
+            else if( starts( "select sleep(" ) ) {
+                std::this_thread::sleep_for( std::chrono::microseconds( (long long)( atof( l.c_str() + 13 ) * 1e6 ) ) );
+                results( { column( "sleep", 8 ) }, { lstr( "0" ) } );
+            }
+            else if( starts( "select blob" ) )
+                results( { column( "b", 252, 128, 63 ) }, { lstr( std::string( "a\0b\0ca\0b\0ca\0b\0c", 15 ) ) } );
+            else if( starts( "select hugeblob " ) ) {
+                // binary first column of any size, then rows with NULLs around it
+                std::string v( strtoul( l.c_str() + 16, 0, 10 ), '\0' );
+                for( size_t i = 0; i < v.size(); ++i ) v[i] = char( i * 7 );
+                results( { column( "b", 252, 128, 63 ), column( "t", 253 ) },
+                         { lstr( v ) + lstr( "tail" ), '\xfb' + lstr( "t2" ), lstr( std::string( "\0end", 4 ) ) + '\xfb' } );
+            }
+            else if( starts( "multi" ) ) {
+                results( { column( "a", 8 ) }, { lstr( "1" ) }, 10 );
+                results( { column( "b", 253 ), column( "c", 253 ) }, { lstr( "x" ) + '\xfb' }, 10 );
+                send( ok() );
+            }
+            else if( starts( "call" ) ) {
+                results( { column( "a", 8 ) }, { lstr( "7" ) }, 10 );
+                send( ok() );
+            }
+            else if( starts( "types" ) )
+                results( { column( "i", 8 ), column( "neg", 3 ), column( "f", 5 ), column( "d", 246 ), column( "s", 253 ), column( "bin", 252, 128, 63 ) },
+                         { lstr( "300" ) + lstr( "-5" ) + lstr( "1.5" ) + lstr( "3.14" ) + lstr( "a,\"b\"\n" ) + lstr( std::string( "\0\1\xff", 3 ) ),
+                           lstr( "0" ) + '\xfb' + lstr( "-2.25" ) + '\xfb' + lstr( "" ) + '\xfb' } );
+            else if( starts( "echo " ) )
+                results( { column( "q", 253 ) }, { lstr( q.substr( 5 ) ) } );
+            else if( starts( "select groups" ) ) // empty strings next to NULLs, for fan-out folds
+                results( { column( "g", 253 ), column( "s", 253 ), column( "n", 8 ) },
+                         { lstr( "a" ) + lstr( "" ) + lstr( "1" ), lstr( "a" ) + lstr( "y" ) + '\xfb',
+                           lstr( "b" ) + '\xfb' + lstr( "2" ), lstr( "b" ) + lstr( "x" ) + lstr( "2" ) } );
+            else if( starts( "select statements" ) ) // prepared statements this session still holds
+                results( { column( "statements", 8 ) }, { lstr( std::to_string( statements.size() ) ) } );
+            else if( starts( "use " ) ) {
+                std::string db = q.substr( 4 );
+                db.erase( 0, db.find_first_not_of( " `" ) );
+                db.erase( db.find_last_not_of( " `;" ) + 1 );
+                send( ok( 2, tracked( '\x01' + lstr( lstr( db ) ) ) ) );
+            }
+            else if( starts( "set " ) ) {
+                if( l.find( "bogus" ) != std::string::npos )
+                    return send( err( 1193, "Unknown system variable 'bogus'", "HY000" ) );
+                // name=value pairs, reported back as the server would: plain names, unquoted values
+                std::string state, item;
+                std::stringstream ss( q.substr( 4 ) );
+                while( std::getline( ss, item, ',' ) ) {
+                    size_t eq = item.find( '=' );
+                    if( eq == std::string::npos ) continue;
+                    std::string n = item.substr( 0, eq ), v = item.substr( eq + 1 );
+                    for( auto &ch : n ) ch = (char)tolower( (unsigned char)ch );
+                    for( const char *drop : { "@@session.", "session ", ":" } )
+                        for( size_t at; ( at = n.find( drop ) ) != std::string::npos; ) n.erase( at, strlen( drop ) );
+                    n.erase( 0, n.find_first_not_of( " " ) ), n.erase( n.find_last_not_of( " " ) + 1 );
+                    v.erase( 0, v.find_first_not_of( " '\"" ) ), v.erase( v.find_last_not_of( " '\"" ) + 1 );
+                    if( n == "autocommit" ) v = v == "1" || v == "on" || v == "ON" || v == "true" || v == "TRUE" ? "ON" : "OFF";
+                    state += '\0' + lstr( lstr( n ) + lstr( v ) );
+                }
+                send( ok( 2, tracked( state ) ) );
+            }
+            else if( starts( "begin" ) )
+                send( ok( 3 ) );
+            else if( starts( "show binary log status" ) || starts( "show master status" ) ) {
+                std::string file = "binlog.000007", size = "1234";
+                if( !binlog_file.empty() ) {
+                    std::ifstream in( binlog_file, std::ios::binary | std::ios::ate );
+                    file = binlog_file.substr( binlog_file.find_last_of( '/' ) + 1 ), size = std::to_string( (long long)in.tellg() );
+                }
+                results( { column( "File", 253 ), column( "Position", 8 ) }, { lstr( file ) + lstr( size ) } );
+            }
+            else if( starts( "select @@global.binlog_checksum" ) ) {
+                std::vector<std::string> events;
+                bool checksum = true;
+                if( !binlog_file.empty() ) recorded( binlog_file, events, checksum );
+                results( { column( "@@global.binlog_checksum", 253 ) }, { lstr( checksum ? "CRC32" : "NONE" ) } );
+            }
+            else if( starts( "select flaky" ) && ++flaky % 2 )
+                send( err( 1213, "Deadlock found when trying to get lock", "40001" ) );
+            else if( starts( "select dropping" ) && ++dropping % 2 )
+                return false;
+            else if( starts( "fail" ) )
+                send( err( 1064, "You have an error in your SQL syntax" ) );
+            else if( starts( "deadlock" ) )
+                send( err( 1213, "Deadlock found when trying to get lock", "40001" ) );
+            else
+                send( ok() );
+            return true;
+        }
+
+        // prepared statements: "select N rows" and "types", rows in the binary protocol
+
+        bool prepare( const std::string &q ) {
+            std::string l = q;
+            for( auto &ch : l ) ch = (char)tolower( (unsigned char)ch );
+            statement st;
+            st.fetched = 0;
+            st.failing = l.find( " failing" ) != std::string::npos; // cursor fetches fail after the first one
+            auto bitmap = []( std::vector<int> nulls, int n ) {
+                std::string bm( ( n + 7 + 2 ) / 8, '\0' );
+                for( int i : nulls ) bm[ ( i + 2 ) / 8 ] |= char( 1 << ( ( i + 2 ) % 8 ) );
+                return bm;
+            };
+            if( l.compare( 0, 7, "select " ) == 0 && l.find( " rows" ) != std::string::npos ) {
+                st.columns = { column( "id", 8, 32 | 1 ), column( "name", 253 ), column( "nul", 6 ) };
+                for( unsigned long r = 0, n = strtoul( l.c_str() + 7, 0, 10 ); r < n; ++r )
+                    st.rows.push_back( '\0' + bitmap( { 2 }, 3 ) + le( r, 8 ) + lstr( "name " + std::to_string( r ) ) );
+            }
+            else if( l.compare( 0, 5, "types" ) == 0 ) {
+                float f = 1.5f;
+                double d = 0.1;
+                st.columns = { column( "neg", 3 ), column( "u8", 1, 32 ), column( "dbl", 5 ), column( "dt", 12, 0, 63 ), column( "d", 10 ),
+                               column( "tm", 11 ), column( "dec", 246 ), column( "f", 4 ) };
+                st.rows.push_back( '\0' + bitmap( {}, 8 ) + le( (uint32_t)-5, 4 ) + '\xc8' + std::string( (const char *)&d, 8 ) +
+                                   '\x0b' + le( 2024, 2 ) + "\x02\x1d\x0d\x05\x09" + le( 123456, 4 ) + '\x04' + le( 1999, 2 ) + "\x0c\x1f" +
+                                   '\x0c' + '\x01' + le( 1, 4 ) + "\x02\x03\x04" + le( 500000, 4 ) + lstr( "12.50" ) + std::string( (const char *)&f, 4 ) );
+                st.rows.push_back( '\0' + bitmap( { 0, 1, 2, 3, 4, 5, 6, 7 }, 8 ) );
+            }
+            else return send( err( 1064, "mock prepares only 'select N rows' and 'types'" ) );
+
+            unsigned sid = statements.size() + 1, params = std::count( q.begin(), q.end(), '?' );
+            statements[sid] = st;
+            send( '\0' + le( sid, 4 ) + le( st.columns.size(), 2 ) + le( params, 2 ) + '\0' + le( 0, 2 ) );
+            if( params ) {
+                for( unsigned i = 0; i < params; ++i ) send( column( "?", 253 ) );
+                send( eof() );
+            }
+            for( auto &c : st.columns ) send( c );
+            return send( eof() );
+        }
+
+        bool execute( unsigned sid, bool cursor ) {
+            auto found = statements.find( sid );
+            if( found == statements.end() )
+                return send( err( 1243, "Unknown prepared statement handler", "HY000" ) );
+            statement &st = found->second;
+            st.fetched = 0;
+            if( !cursor )
+                return results( st.columns, st.rows ), true;
+            // CURSOR_EXISTS: rows wait for COM_STMT_FETCH
+            send( lenenc( st.columns.size() ) );
+            for( auto &c : st.columns ) send( c );
+            return send( eof( 0x42 ) );
+        }
+
+        bool fetch( unsigned sid, unsigned n ) {
+            auto found = statements.find( sid );
+            if( found == statements.end() )
+                return send( err( 1243, "Unknown prepared statement handler", "HY000" ) );
+            statement &st = found->second;
+            if( st.failing && st.fetched )
+                return send( err( 1317, "Query execution was interrupted", "70100" ) );
+            for( ; n && st.fetched < st.rows.size(); --n )
+                send( st.rows[ st.fetched++ ] );
+            return send( eof( 0x42 | ( st.fetched >= st.rows.size() ? 0x80 : 0 ) ) ); // LAST_ROW_SENT
+        }
+
+        bool dump() {
+            std::vector<std::string> events;
+            bool checksum;
+            if( binlog_file.empty() ) events = fixture();
+            else if( !recorded( binlog_file, events, checksum ) ) return send( err( 1236, "cannot read " + binlog_file, "HY000" ) );
+            for( auto &e : events )
+                if( !send( e ) ) return false;
+            return true; // then idle, as a server with nothing new to send
+        }
+
+        void serve() {
+            if( !handshake() )
+                return;
+            for( std::string p; read( p ) && !p.empty(); ) {
+                unsigned cmd = (unsigned char)p[0];
+                seq = 1;
+                if( cmd == 0x03 ) std::cerr << "query: " << p.substr( 1 ) << std::endl;
+                /**/ if( cmd == 0x01 ) return;                                        // COM_QUIT
+                else if( cmd == 0x03 ) { if( !query( p.substr( 1 ) ) ) return; }
+                else if( cmd == 0x0e ) send( ok() );                                  // COM_PING
+                else if( cmd == 0x02 ) send( ok( 2, tracked( '\x01' + lstr( lstr( p.substr( 1 ) ) ) ) ) ); // COM_INIT_DB
+                else if( cmd == 0x16 ) prepare( p.substr( 1 ) );
+                else if( cmd == 0x17 && p.size() >= 6 ) execute( le32( p, 1 ), p[5] & 1 );
+                else if( cmd == 0x1c && p.size() >= 9 ) fetch( le32( p, 1 ), le32( p, 5 ) );
+                else if( cmd == 0x19 && p.size() >= 5 ) statements.erase( le32( p, 1 ) ); // COM_STMT_CLOSE: no response
+                else if( cmd == 0x15 ) send( ok() );                                  // COM_REGISTER_SLAVE
+                else if( cmd == 0x12 || cmd == 0x1e ) { if( !dump() ) return; }       // COM_BINLOG_DUMP(_GTID)
+                else send( err( 1047, "Unknown command", "08S01" ) );
+            }
+        }
+
+        static unsigned le32( const std::string &p, size_t at ) {
+            return (unsigned char)p[at] | (unsigned char)p[at+1] << 8 | (unsigned char)p[at+2] << 16 | (unsigned)(unsigned char)p[at+3] << 24;
+        }
+    };
+
+    void accepts( int listener, bool tcp ) {
+        for( ;; ) {
+            int fd = accept( listener, 0, 0 );
+            if( fd < 0 ) continue;
+            int one = 1;
+            if( tcp ) setsockopt( fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one) );
+            std::thread( [fd]() {
+                session( fd ).serve();
+                close( fd );
+            } ).detach();
+        }
+    }
+}
+
+int main( int argc, const char **argv )
+{
+    std::string port = "33060", path;
+
+    auto usage = [&]() {
+        std::cerr << "usage: " << argv[0] << " [options]" << std::endl;
+        std::cerr << "  -P port        tcp port on 127.0.0.1 (33060)" << std::endl;
+        std::cerr << "  -s path        also listen on a unix socket" << std::endl;
+        std::cerr << "  -u user        (root)" << std::endl;
+        std::cerr << "  -p pass        (root)" << std::endl;
+        std::cerr << "  -a plugin      mysql_native_password or caching_sha2_password (mysql_native_password)" << std::endl;
+        std::cerr << "  -t on|off      session state tracking (on)" << std::endl;
+        std::cerr << "  -b file        binlog file replayed to COM_BINLOG_DUMP (built-in fixture)" << std::endl;
+        return 1;
+    };
+
+    for( int i = 1; i < argc; ++i ) {
+        std::string opt = argv[i];
+        if( opt.size() != 2 || opt[0] != '-' || i + 1 >= argc )
+            return usage();
+        std::string arg = argv[++i];
+        /**/ if( opt == "-P" ) port = arg;
+        else if( opt == "-s" ) path = arg;
+        else if( opt == "-u" ) user = arg;
+        else if( opt == "-p" ) pass = arg;
+        else if( opt == "-a" ) plugin = arg;
+        else if( opt == "-t" ) tracking = arg != "off";
+        else if( opt == "-b" ) binlog_file = arg;
+        else return usage();
+    }
+    if( plugin != "mysql_native_password" && plugin != "caching_sha2_password" )
+        return usage();
+
+    signal( SIGPIPE, SIG_IGN );
+
+    int tcp = socket( AF_INET, SOCK_STREAM, 0 ), one = 1;
+    sockaddr_in in = sockaddr_in();
+    in.sin_family = AF_INET;
+    in.sin_port = htons( (unsigned short)atoi( port.c_str() ) );
+    in.sin_addr.s_addr = htonl( INADDR_LOOPBACK );
+    setsockopt( tcp, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one) );
+    if( bind( tcp, (sockaddr *)&in, sizeof(in) ) || listen( tcp, 128 ) )
+        return std::cerr << "error: cannot listen on 127.0.0.1:" << port << std::endl, 1;
+
+    if( !path.empty() ) {
+        int unx = socket( AF_UNIX, SOCK_STREAM, 0 );
+        sockaddr_un un = sockaddr_un();
+        un.sun_family = AF_UNIX;
+        if( path.size() >= sizeof(un.sun_path) )
+            return std::cerr << "error: socket path too long" << std::endl, 1;
+        memcpy( un.sun_path, path.c_str(), path.size() + 1 );
+        unlink( path.c_str() );
+        if( bind( unx, (sockaddr *)&un, sizeof(un) ) || listen( unx, 128 ) )
+            return std::cerr << "error: cannot listen on " << path << std::endl, 1;
+        std::thread( accepts, unx, false ).detach();
+    }
+
+    std::cerr << "mock server on 127.0.0.1:" << port << ( path.empty() ? "" : " and " + path ) << ", user " << user << ", " << plugin << std::endl;
+    accepts( tcp, true );
+}
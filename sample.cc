@@ -42,7 +42,7 @@ int main( int argc, const char **argv )
     // metrics report
 
     bool reversed = true;
-    std::string format = "{idx} (x{hits}) total:{total} min:{min} max:{max} avg:{avg}";
+    std::string format = "{idx} (x{hits}) total:{total} min:{min} max:{max} avg:{avg} syscalls:{sys}";
     std::string sorted_by = "{total}";
     auto list = sq::metrics::report( format, sorted_by, reversed );
     for( auto &line : list )
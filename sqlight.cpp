@@ -3,19 +3,44 @@
 
 #include <string.h>
 
+#include <cctype>
+#include <cerrno>
 #include <cstdint>
+#include <cstdio>
+#include <cstdlib>
 #include <cassert>
+#include <cmath>
 
 #include <algorithm>
 #include <chrono>
+#include <condition_variable>
 #include <deque>
+#include <functional>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <map>
 #include <mutex>
+#include <random>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#if defined(__x86_64__) || defined(__i386__) || defined(_M_X64) || defined(_M_IX86)
+#   if defined(_MSC_VER) && !defined(__clang__)
+#       include <intrin.h>
+#       include <immintrin.h>
+#       define SQLIGHT_SHA_NI
+#       define SQLIGHT_TARGET_SHA
+#   elif (defined(__GNUC__) && __GNUC__ >= 5) || defined(__clang__)
+#       include <cpuid.h>
+#       include <immintrin.h>
+#       define SQLIGHT_SHA_NI
+#       define SQLIGHT_TARGET_SHA __attribute__((target("sha,sse4.1,ssse3")))
+#   endif
+#endif
+
 #if defined(_WIN32)
 
 #   include <winsock2.h>
@@ -28,6 +53,8 @@
 #   undef max
 #   endif
 
+#   include <io.h> //_write
+
 #   pragma comment(lib,"ws2_32.lib")
 
 #   define INIT()                   { static WSADATA wsa; WSAStartup(MAKEWORD(1,1),&wsa); }
@@ -37,7 +64,7 @@
 #   define CLOSE(A)                  ::closesocket((A))
 #   define READ(A,B,C)               ::read((A),(B),(C))
 #   define RECV(A,B,C,D)             ::recv((A), (char *)(B), (C), (D))
-#   define SELECT(A,B,C,D,E)         ::select((A),(B),(C),(D),(E))
+#   define POLL(A,B,C)               ::WSAPoll((A),(B),(C))
 #   define SEND(A,B,C,D)             ::send((A), (const char *)(B), (int)(C), (D))
 #   define WRITE(A,B,C)              ::write((A),(B),(C))
 #   define GETSOCKOPT(A,B,C,D,E)     ::getsockopt((A),(B),(C),(char *)(D), (int*)(E))
@@ -49,6 +76,9 @@
 #   define SHUTDOWN_R(A)             ::shutdown((A),0)
 #   define SHUTDOWN_W(A)             ::shutdown((A),1)
 
+#   define AGAIN()                   ( WSAGetLastError() == WSAEWOULDBLOCK )
+#   define INTR()                    ( WSAGetLastError() == WSAEINTR )
+
     namespace
     {
         // fill missing api
@@ -68,7 +98,7 @@
 
             if( mode == F_SETFL ) // set socket status flags
             {
-                u_long iMode = ( value & O_NONBLOCK ? 0 : 1 );
+                u_long iMode = ( value & O_NONBLOCK ? 1 : 0 );
 
                 bool result = ( ioctlsocket( sockfd, FIONBIO, &iMode ) == NO_ERROR );
 
@@ -85,10 +115,19 @@
 #else
 
 #   include <fcntl.h>
+#   include <poll.h>
 #   include <sys/types.h>
 #   include <sys/socket.h>
 #   include <netdb.h>
+#   include <netinet/in.h>
+#   include <netinet/tcp.h> //TCP_KEEPIDLE
+#   include <sys/un.h>    //sockaddr_un
+#   include <sys/mman.h>  //mmap
 #   include <unistd.h>    //close
+#   if defined(__linux__)
+#   include <fcntl.h>     //splice
+#   define SQLIGHT_SPLICE
+#   endif
 
 #   include <arpa/inet.h> //inet_addr
 
@@ -99,7 +138,7 @@
 #   define CLOSE(A)                  ::close((A))
 #   define READ(A,B,C)               ::read((A),(B),(C))
 #   define RECV(A,B,C,D)             ::recv((A), (void *)(B), (C), (D))
-#   define SELECT(A,B,C,D,E)         ::select((A),(B),(C),(D),(E))
+#   define POLL(A,B,C)               ::poll((A),(B),(C))
 #   define SEND(A,B,C,D)             ::send((A), (const std::int8_t *)(B), (C), (D))
 #   define WRITE(A,B,C)              ::write((A),(B),(C))
 #   define GETSOCKOPT(A,B,C,D,E)     ::getsockopt((int)(A),(int)(B),(int)(C),(      void *)(D),(socklen_t *)(E))
@@ -111,6 +150,9 @@
 #   define SHUTDOWN_R(A)             ::shutdown((A),SHUT_RD)
 #   define SHUTDOWN_W(A)             ::shutdown((A),SHUT_WR)
 
+#   define AGAIN()                   ( errno == EAGAIN || errno == EWOULDBLOCK )
+#   define INTR()                    ( errno == EINTR )
+
 #   define $welse(...) __VA_ARGS__
 #   define $windows(...)
 
@@ -118,6 +160,13 @@
 
 #include "sqlight.hpp"
 
+// tracing hooks compile out entirely unless SQLIGHT_TRACE is defined
+#ifdef SQLIGHT_TRACE
+#   define TRACE(EVENT,DATA,LEN)     ( tracing ? tracing( traced, *this, EVENT, (DATA), (LEN) ) : (void)0 )
+#else
+#   define TRACE(EVENT,DATA,LEN)     ((void)0)
+#endif
+
 namespace {
         // knot c&p in the future we must do it right
         enum
@@ -128,51 +177,23 @@ namespace {
     //      TCP_DISCONNECTED = -3,
         };
 
-        timeval as_timeval( double seconds )
-        {
-            timeval tv;
-            tv.tv_sec = (int)(seconds);
-            tv.tv_usec = (int)((seconds - (int)(seconds)) * 1000000.0);
-            return tv;
-        }
-
-        int select( int &sockfd, double timeout )
+        int poll( int &sockfd, double timeout, bool writable = false )
         {
-            // set up the file descriptor set
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(sockfd, &fds);
-
-            // set up the struct timeval for the timeout
-            timeval tv = as_timeval( timeout );
-
-            // wait until timeout or data received
-            // if  tv = {n,m}, then select() waits up to n.m seconds
-            // if  tv = {0,0}, then select() does polling
-            // if &tv =  NULL, then select() waits forever
-            int ret = SELECT(sockfd+1, &fds, NULL, NULL, &tv);
+            // poll() has no FD_SETSIZE ceiling, so descriptors >= 1024 are fine. A single
+            // descriptor is waited on at a time, so epoll would only add a syscall per wait.
+            pollfd pfd;
+            pfd.fd = sockfd;
+            pfd.events = writable ? POLLOUT : POLLIN;
+            pfd.revents = 0;
+
+            // wait until timeout or data received (or room to send, when writable)
+            // if timeout = n.m, then poll() waits up to n.m seconds
+            // if timeout = 0, then poll() does polling
+            // if timeout < 0, then poll() waits forever
+            int ret = POLL(&pfd, 1, timeout < 0 ? -1 : (int)std::ceil(timeout * 1000));
             return ( ret == -1 ? sockfd = -1, TCP_ERROR : ret == 0 ? TCP_TIMEOUT : TCP_OK );
         }
 
-    // We must complete socket functions, timeout socket receptions.
-    // This is just a fix and it will block if count bytes are
-    // never received
-    int recvfixed(int sockfd, void *buffer, size_t count, int flags) {
-        char *_buffer = (char*)buffer;
-        while (count) {
-            if (select(sockfd, 1)!=TCP_OK)
-                return -1;
-            int total = RECV(sockfd, _buffer, count, flags);
-            // Sometimes when the socket is closed it has unexpected behavior
-            if (total<=0)
-                return -1;
-
-            _buffer+=total;
-            count-=total;
-        }
-        return 1;
-    }
-
     std::deque< std::string > tokenize( const std::string &input, const std::string &delimiters ) {
         std::string map( 256, '\0' );
         for( auto &ch : delimiters )
@@ -187,261 +208,444 @@ namespace {
         return tokens;
     }
 
-    typedef uint32_t basetype;
-    typedef std::vector<basetype> hash;
+    // Mostly based on Paul E. Jones' sha1 implementation.
+    // Allocation-free: state lives on the stack, blocks are compressed straight from the input.
 
-    // Mostly based on Paul E. Jones' sha1 implementation
-    static hash SHA1( const void *pMem, basetype iLen, hash &my_hash )
+    void sha1_blocks_scalar( uint32_t H[5], const unsigned char *Message_Block, size_t blocks )
     {
-        // if( pMem == 0 || iLen == 0 ) return my_hash;
-
         struct Process
         {
-            static basetype CircularShift(int bits, basetype word)
+            static uint32_t CircularShift(int bits, uint32_t word)
             {
-                return ((word << bits) & 0xFFFFFFFF) | ((word & 0xFFFFFFFF) >> (32-bits));
+                return (word << bits) | (word >> (32-bits));
             }
+        };
+
+        const uint32_t K[] = {                  // Constants defined for SHA-1
+            0x5A827999,
+            0x6ED9EBA1,
+            0x8F1BBCDC,
+            0xCA62C1D6
+            };
 
-            static void MessageBlock( hash &H, unsigned char *Message_Block, int &Message_Block_Index )
+        for( ; blocks--; Message_Block += 64 )
+        {
+            int         t;                          // Loop counter
+            uint32_t    temp;                       // Temporary word value
+            uint32_t    W[80];                      // Word sequence
+            uint32_t    A, B, C, D, E;              // Word buffers
+
+            /*
+             *  Initialize the first 16 words in the array W
+             */
+            for(t = 0; t < 16; t++)
             {
-                const basetype K[] = {                  // Constants defined for SHA-1
-                    0x5A827999,
-                    0x6ED9EBA1,
-                    0x8F1BBCDC,
-                    0xCA62C1D6
-                    };
-                int     t;                          // Loop counter
-                basetype    temp;                       // Temporary word value
-                basetype    W[80];                      // Word sequence
-                basetype    A, B, C, D, E;              // Word buffers
-
-                /*
-                 *  Initialize the first 16 words in the array W
-                 */
-                for(t = 0; t < 16; t++)
-                {
-                    W[t] = ((basetype) Message_Block[t * 4]) << 24;
-                    W[t] |= ((basetype) Message_Block[t * 4 + 1]) << 16;
-                    W[t] |= ((basetype) Message_Block[t * 4 + 2]) << 8;
-                    W[t] |= ((basetype) Message_Block[t * 4 + 3]);
-                }
+                W[t] = ((uint32_t) Message_Block[t * 4]) << 24;
+                W[t] |= ((uint32_t) Message_Block[t * 4 + 1]) << 16;
+                W[t] |= ((uint32_t) Message_Block[t * 4 + 2]) << 8;
+                W[t] |= ((uint32_t) Message_Block[t * 4 + 3]);
+            }
 
-                for(t = 16; t < 80; t++)
-                {
-                    W[t] = CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
-                }
+            for(t = 16; t < 80; t++)
+            {
+                W[t] = Process::CircularShift(1,W[t-3] ^ W[t-8] ^ W[t-14] ^ W[t-16]);
+            }
 
-                A = H[0];
-                B = H[1];
-                C = H[2];
-                D = H[3];
-                E = H[4];
-
-                for(t = 0; t < 20; t++)
-                {
-                    temp = CircularShift(5,A) + ((B & C) | ((~B) & D)) + E + W[t] + K[0]; //D^(B&(C^D))
-                    temp &= 0xFFFFFFFF;
-                    E = D;
-                    D = C;
-                    C = CircularShift(30,B);
-                    B = A;
-                    A = temp;
-                }
+            A = H[0];
+            B = H[1];
+            C = H[2];
+            D = H[3];
+            E = H[4];
 
-                for(t = 20; t < 40; t++)
-                {
-                    temp = CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[1];
-                    temp &= 0xFFFFFFFF;
-                    E = D;
-                    D = C;
-                    C = CircularShift(30,B);
-                    B = A;
-                    A = temp;
-                }
+            for(t = 0; t < 80; t++)
+            {
+                uint32_t f =
+                    t < 20 ? D ^ (B & (C ^ D)) :            //(B & C) | ((~B) & D)
+                    t < 40 ? B ^ C ^ D :
+                    t < 60 ? (B & C) | (D & (B | C)) :      //(B & C) | (B & D) | (C & D)
+                             B ^ C ^ D;
+                temp = Process::CircularShift(5,A) + f + E + W[t] + K[t / 20];
+                E = D;
+                D = C;
+                C = Process::CircularShift(30,B);
+                B = A;
+                A = temp;
+            }
 
-                for(t = 40; t < 60; t++)
-                {
-                    temp = CircularShift(5,A) +
-                    ((B & C) | (B & D) | (C & D)) + E + W[t] + K[2];         //(B & C) | (D & (B | C))
-                    temp &= 0xFFFFFFFF;
-                    E = D;
-                    D = C;
-                    C = CircularShift(30,B);
-                    B = A;
-                    A = temp;
-                }
+            H[0] += A;
+            H[1] += B;
+            H[2] += C;
+            H[3] += D;
+            H[4] += E;
+        }
+    }
 
-                for(t = 60; t < 80; t++)
-                {
-                    temp = CircularShift(5,A) + (B ^ C ^ D) + E + W[t] + K[3];
-                    temp &= 0xFFFFFFFF;
-                    E = D;
-                    D = C;
-                    C = CircularShift(30,B);
-                    B = A;
-                    A = temp;
-                }
+#ifdef SQLIGHT_SHA_NI
 
-                H[0] = (H[0] + A) & 0xFFFFFFFF;
-                H[1] = (H[1] + B) & 0xFFFFFFFF;
-                H[2] = (H[2] + C) & 0xFFFFFFFF;
-                H[3] = (H[3] + D) & 0xFFFFFFFF;
-                H[4] = (H[4] + E) & 0xFFFFFFFF;
+    // x86 SHA extensions: four rounds per instruction and message schedule done in hardware.
+    // Group g covers rounds 4g..4g+3; M holds the rolling window of 16-byte schedule blocks.
+    // [ref] https://software.intel.com/en-us/articles/intel-sha-extensions
 
-                Message_Block_Index = 0;
-            }
-        };
+    SQLIGHT_TARGET_SHA
+    void sha1_blocks_shani( uint32_t H[5], const unsigned char *data, size_t blocks )
+    {
+        const __m128i MASK = _mm_set_epi64x( 0x0001020304050607ULL, 0x08090a0b0c0d0e0fULL );
+
+        __m128i ABCD = _mm_shuffle_epi32( _mm_loadu_si128( (const __m128i *)H ), 0x1B );
+        __m128i E[2], M[4];
+        E[0] = _mm_set_epi32( (int)H[4], 0, 0, 0 );
+
+#       define SHA1_GROUP(g) \
+            if( g < 4 ) M[g&3] = _mm_shuffle_epi8( _mm_loadu_si128( (const __m128i *)(data + 16 * (g&3)) ), MASK ); \
+            E[g&1] = g ? _mm_sha1nexte_epu32( E[g&1], M[g&3] ) : _mm_add_epi32( E[0], M[0] ); \
+            E[(g+1)&1] = ABCD; \
+            if( g >= 3 && g <= 18 ) M[(g+1)&3] = _mm_sha1msg2_epu32( M[(g+1)&3], M[g&3] ); \
+            ABCD = _mm_sha1rnds4_epu32( ABCD, E[g&1], (g)/5 ); \
+            if( g >= 1 && g <= 16 ) M[(g+3)&3] = _mm_sha1msg1_epu32( M[(g+3)&3], M[g&3] ); \
+            if( g >= 2 && g <= 17 ) M[(g+2)&3] = _mm_xor_si128( M[(g+2)&3], M[g&3] );
+
+        for( ; blocks--; data += 64 ) {
+            __m128i ABCD_SAVE = ABCD, E0_SAVE = E[0];
+
+            SHA1_GROUP(0)  SHA1_GROUP(1)  SHA1_GROUP(2)  SHA1_GROUP(3)  SHA1_GROUP(4)
+            SHA1_GROUP(5)  SHA1_GROUP(6)  SHA1_GROUP(7)  SHA1_GROUP(8)  SHA1_GROUP(9)
+            SHA1_GROUP(10) SHA1_GROUP(11) SHA1_GROUP(12) SHA1_GROUP(13) SHA1_GROUP(14)
+            SHA1_GROUP(15) SHA1_GROUP(16) SHA1_GROUP(17) SHA1_GROUP(18) SHA1_GROUP(19)
+
+            E[0] = _mm_sha1nexte_epu32( E[0], E0_SAVE );
+            ABCD = _mm_add_epi32( ABCD, ABCD_SAVE );
+        }
 
-        // 512-bit message blocks
-        unsigned char Message_Block[64];
-        // Index into message block array
-        int Message_Block_Index = 0;
-        // Message length in bits
-        basetype Length_Low = 0, Length_High = 0;
+#       undef SHA1_GROUP
 
-        if( iLen > 0 )
-        {
-            // Is the message digest corrupted?
-            bool Corrupted = false;
+        _mm_storeu_si128( (__m128i *)H, _mm_shuffle_epi32( ABCD, 0x1B ) );
+        H[4] = (uint32_t)_mm_extract_epi32( E[0], 3 );
+    }
 
-            // Input()
+    bool has_sha_ni() {
+        unsigned r1[4] = {0}, r7[4] = {0}; // eax, ebx, ecx, edx
+#   if defined(_MSC_VER) && !defined(__clang__)
+        int r[4];
+        __cpuid( r, 0 );
+        if( r[0] < 7 ) return false;
+        __cpuidex( r, 7, 0 ); memcpy( r7, r, sizeof(r) );
+        __cpuid( r, 1 );      memcpy( r1, r, sizeof(r) );
+#   else
+        if( __get_cpuid_max( 0, 0 ) < 7 ) return false;
+        __cpuid_count( 7, 0, r7[0], r7[1], r7[2], r7[3] );
+        __cpuid( 1, r1[0], r1[1], r1[2], r1[3] );
+#   endif
+        bool sha = ( r7[1] >> 29 ) & 1, sse41 = ( r1[2] >> 19 ) & 1, ssse3 = ( r1[2] >> 9 ) & 1;
+        return sha && sse41 && ssse3;
+    }
 
-            unsigned char *message_array = (unsigned char *)pMem;
+#endif
 
-            while(iLen-- && !Corrupted)
-            {
-                Message_Block[Message_Block_Index++] = (*message_array & 0xFF);
-
-                Length_Low += 8;
-                Length_Low &= 0xFFFFFFFF;               // Force it to 32 bits
-                if (Length_Low == 0)
-                {
-                    Length_High++;
-                    Length_High &= 0xFFFFFFFF;          // Force it to 32 bits
-                    if (Length_High == 0)
-                    {
-                        Corrupted = true;               // Message is too long
-                    }
-                }
+    void sha1_blocks( uint32_t H[5], const unsigned char *data, size_t blocks ) {
+#ifdef SQLIGHT_SHA_NI
+        static const bool hw = has_sha_ni(); // runtime dispatch, resolved once
+        if( hw ) return sha1_blocks_shani( H, data, blocks );
+#endif
+        sha1_blocks_scalar( H, data, blocks );
+    }
 
-                if (Message_Block_Index == 64)
-                {
-                    Process::MessageBlock( my_hash, Message_Block, Message_Block_Index );
-                }
+    struct sha1
+    {
+        uint32_t H[5];
+        uint64_t length;                        // Message length in bytes
+        unsigned char Message_Block[64];        // 512-bit message blocks
+
+        sha1() : length(0) {
+            H[0] = 0x67452301, H[1] = 0xEFCDAB89,
+            H[2] = 0x98BADCFE, H[3] = 0x10325476,
+            H[4] = 0xC3D2E1F0;
+        }
 
-                message_array++;
+        sha1 &add( const void *pMem, size_t iLen ) {
+            const unsigned char *message_array = (const unsigned char *)pMem;
+            size_t used = length % 64;
+            length += iLen;
+            if( used ) {
+                size_t take = std::min( iLen, 64 - used );
+                memcpy( Message_Block + used, message_array, take );
+                message_array += take, iLen -= take;
+                if( used + take < 64 ) return *this;
+                sha1_blocks( H, Message_Block, 1 );
             }
+            sha1_blocks( H, message_array, iLen / 64 );
+            memcpy( Message_Block, message_array + iLen / 64 * 64, iLen % 64 );
+            return *this;
+        }
 
-            assert( !Corrupted );
+        void digest( unsigned char out[20] ) {
+            /*
+            *  Pad with 0x80 then zeros up to 56 mod 64, and store the message
+            *  length in bits as the last 8 octets (big endian)
+            */
+            uint64_t bits = length * 8;
+            unsigned char pad[72] = { 0x80 };
+            size_t padlen = ( length % 64 < 56 ? 56 : 120 ) - length % 64;
+            for( int i = 0; i < 8; ++i )
+                pad[padlen + i] = (unsigned char)( bits >> ( 56 - 8 * i ) );
+            add( pad, padlen + 8 );
+            for( int i = 0; i < 20; ++i )
+                out[i] = (unsigned char)( H[i / 4] >> ( 24 - 8 * ( i % 4 ) ) );
         }
+    };
 
-        // Result() and PadMessage()
+    // FIPS 180-4 SHA-256, same allocation-free shape as sha1 above. Only used by
+    // caching_sha2_password, so a plain scalar compression is plenty.
 
-        /*
-        *  Check to see if the current message block is too small to hold
-        *  the initial padding bits and length.  If so, we will pad the
-        *  block, process it, and then continue padding into a second block.
-        */
-        if (Message_Block_Index > 55)
-        {
-            Message_Block[Message_Block_Index++] = 0x80;
+    struct sha256
+    {
+        uint32_t H[8];
+        uint64_t length;                        // Message length in bytes
+        unsigned char Message_Block[64];        // 512-bit message blocks
 
-            while(Message_Block_Index < 64)
-            {
-                Message_Block[Message_Block_Index++] = 0;
-            }
+        sha256() : length(0) {
+            H[0] = 0x6a09e667, H[1] = 0xbb67ae85, H[2] = 0x3c6ef372, H[3] = 0xa54ff53a,
+            H[4] = 0x510e527f, H[5] = 0x9b05688c, H[6] = 0x1f83d9ab, H[7] = 0x5be0cd19;
+        }
+
+        static uint32_t ror( uint32_t word, int bits ) {
+            return (word >> bits) | (word << (32-bits));
+        }
+
+        void blocks( const unsigned char *block, size_t count ) {
+            static const uint32_t K[64] = {
+                0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+                0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+                0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+                0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+                0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+                0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+                0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+                0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+            };
 
-            Process::MessageBlock( my_hash, Message_Block, Message_Block_Index );
+            for( ; count--; block += 64 ) {
+                uint32_t W[64], a, b, c, d, e, f, g, h;
 
-            while(Message_Block_Index < 56)
-            {
-                Message_Block[Message_Block_Index++] = 0;
+                for( int t = 0; t < 16; ++t )
+                    W[t] = (uint32_t)block[t*4] << 24 | (uint32_t)block[t*4+1] << 16 | (uint32_t)block[t*4+2] << 8 | block[t*4+3];
+                for( int t = 16; t < 64; ++t )
+                    W[t] = ( ror(W[t-2],17) ^ ror(W[t-2],19) ^ (W[t-2] >> 10) ) + W[t-7] +
+                           ( ror(W[t-15],7) ^ ror(W[t-15],18) ^ (W[t-15] >> 3) ) + W[t-16];
+
+                a = H[0], b = H[1], c = H[2], d = H[3], e = H[4], f = H[5], g = H[6], h = H[7];
+
+                for( int t = 0; t < 64; ++t ) {
+                    uint32_t t1 = h + ( ror(e,6) ^ ror(e,11) ^ ror(e,25) ) + ( g ^ (e & (f ^ g)) ) + K[t] + W[t];
+                    uint32_t t2 = ( ror(a,2) ^ ror(a,13) ^ ror(a,22) ) + ( (a & b) | (c & (a | b)) );
+                    h = g, g = f, f = e, e = d + t1, d = c, c = b, b = a, a = t1 + t2;
+                }
+
+                H[0] += a, H[1] += b, H[2] += c, H[3] += d, H[4] += e, H[5] += f, H[6] += g, H[7] += h;
             }
         }
-        else
-        {
-            Message_Block[Message_Block_Index++] = 0x80;
 
-            while(Message_Block_Index < 56)
-            {
-                Message_Block[Message_Block_Index++] = 0;
-            }
-        }
-
-        /*
-         *  Store the message length as the last 8 octets
-         */
-        Message_Block[56] = (Length_High >> 24) & 0xFF;
-        Message_Block[57] = (Length_High >> 16) & 0xFF;
-        Message_Block[58] = (Length_High >> 8) & 0xFF;
-        Message_Block[59] = (Length_High) & 0xFF;
-        Message_Block[60] = (Length_Low >> 24) & 0xFF;
-        Message_Block[61] = (Length_Low >> 16) & 0xFF;
-        Message_Block[62] = (Length_Low >> 8) & 0xFF;
-        Message_Block[63] = (Length_Low) & 0xFF;
-
-        Process::MessageBlock( my_hash, Message_Block, Message_Block_Index );
-
-        return my_hash;
-    }
-
-    template< typename T >
-    hash SHA1( const T &input ) {
-        hash h(5);
-        h[0] = 0x67452301, h[1] = 0xEFCDAB89,
-        h[2] = 0x98BADCFE, h[3] = 0x10325476,
-        h[4] = 0xC3D2E1F0;
-        hash raw = SHA1( input.data(), input.size() * sizeof( *input.begin() ), h );
-        return raw;
-    }
-
-    hash SHA1( const void *mem, int len ) {
-        hash h(5);
-        h[0] = 0x67452301, h[1] = 0xEFCDAB89,
-        h[2] = 0x98BADCFE, h[3] = 0x10325476,
-        h[4] = 0xC3D2E1F0;
-        hash raw = SHA1( mem, len, h );
-        return raw;
-    }
-
-    std::vector<unsigned char> blob( const hash &raw ) {
-        std::vector<unsigned char> blob;
-        for( std::vector<basetype>::const_iterator it = raw.begin(); it != raw.end(); ++it ) {
-            static int i = 1;
-            static char *low = (char*)&i;
-            static bool is_big = ( *low ? false : true );
-            if( is_big )
-                for( int i = 0; i < sizeof(basetype); ++i )
-                    blob.push_back( ( (*it) >> (i * 8) ) & 0xff );
-            else
-                for( int i = sizeof(basetype) - 1; i >= 0; --i )
-                    blob.push_back( ( (*it) >> (i * 8) ) & 0xff );
+        sha256 &add( const void *pMem, size_t iLen ) {
+            const unsigned char *message_array = (const unsigned char *)pMem;
+            size_t used = length % 64;
+            length += iLen;
+            if( used ) {
+                size_t take = std::min( iLen, 64 - used );
+                memcpy( Message_Block + used, message_array, take );
+                message_array += take, iLen -= take;
+                if( used + take < 64 ) return *this;
+                blocks( Message_Block, 1 );
+            }
+            blocks( message_array, iLen / 64 );
+            memcpy( Message_Block, message_array + iLen / 64 * 64, iLen % 64 );
+            return *this;
         }
-        return blob;
-    }
+
+        void digest( unsigned char out[32] ) {
+            uint64_t bits = length * 8;
+            unsigned char pad[72] = { 0x80 };
+            size_t padlen = ( length % 64 < 56 ? 56 : 120 ) - length % 64;
+            for( int i = 0; i < 8; ++i )
+                pad[padlen + i] = (unsigned char)( bits >> ( 56 - 8 * i ) );
+            add( pad, padlen + 8 );
+            for( int i = 0; i < 32; ++i )
+                out[i] = (unsigned char)( H[i / 4] >> ( 24 - 8 * ( i % 4 ) ) );
+        }
+    };
 }
 
 namespace
 {
-    std::vector<unsigned char> get_mysql_hash( const std::vector<unsigned char> &password, const unsigned char salt[20] )
+    void get_mysql_hash( unsigned char scramble[20], const unsigned char hash1[20], const unsigned char hash2[20], const unsigned char salt[20] )
     {
+        // mysql_native_password
         // [ref] http://dev.mysql.com/doc/internals/en/authentication-method.html#packet-Authentication::Native41
         // SHA1( password ) XOR SHA1( "20-bytes random data from server" <concat> SHA1( SHA1( password ) ) )
+        // hash1 = SHA1( password ) and hash2 = SHA1( hash1 ) are computed once at connect() and
+        // reused on every reconnect, so a handshake costs a single 60-byte digest.
 
-        std::vector<unsigned char> hash1 = password; // blob( SHA1( "password" ) );
-        std::vector<unsigned char> hash2 = blob( SHA1( hash1 ) );
+        sha1().add( salt, 20 ).add( hash2, 20 ).digest( scramble );
 
-        unsigned char concat[40];
-        for( size_t i = 0; i < 40; i++ )
-            concat[i] = ( i < 20 ? salt[i] : hash2[i-20] );
+        for( size_t i = 0; i < 20; ++i )
+            scramble[i] ^= hash1[i];
+    }
 
-        std::vector<unsigned char> hash3 = blob( SHA1( concat, 40 ) );
+    void get_sha2_hash( unsigned char scramble[32], const unsigned char hash1[32], const unsigned char hash2[32], const unsigned char nonce[20] )
+    {
+        // caching_sha2_password (MySQL 8 default)
+        // [ref] https://dev.mysql.com/doc/dev/mysql-server/latest/page_caching_sha2_authentication_exchanges.html
+        // SHA256( password ) XOR SHA256( SHA256( SHA256( password ) ) <concat> "20-bytes nonce from server" )
 
-        for( size_t i = 0; i < 20; ++i )
-            hash3[i] ^= hash1[i];
+        sha256().add( hash2, 32 ).add( nonce, 20 ).digest( scramble );
+
+        for( size_t i = 0; i < 32; ++i )
+            scramble[i] ^= hash1[i];
+    }
+}
+
+namespace
+{
+    typedef std::pair<sockaddr_storage, socklen_t> address;
+
+    // Circuit breakers are shared per endpoint by every connection in the process, so during a
+    // failover only one caller per cooldown pays for a doomed handshake; the rest fail fast.
+    // Like the resolver cache below, they are allocated once and never destroyed: detached kill() and prewarm()
+    // handshakes are not waited for at exit, and may still be using them while static destructors run.
+
+    struct breaker {
+        unsigned failures;
+        std::chrono::steady_clock::time_point until;
+        unsigned samples;
+        double latency;
+        breaker() : failures(0), samples(0), latency(0) {}
+    };
+
+    std::mutex &breakers_mutex = *new std::mutex;
+    std::map< std::string, breaker > &breakers = *new std::map< std::string, breaker >;
+
+    bool breaker_allows( const std::string &endpoint, const sq::light::backoff &policy ) {
+        std::lock_guard<std::mutex> lock(breakers_mutex);
+        breaker &br = breakers[endpoint];
+        if( br.failures < policy.trip )
+            return true; // closed
+        auto now = std::chrono::steady_clock::now();
+        if( now < br.until )
+            return false; // open
+        // half-open: let this caller probe and hold everybody else for another cooldown
+        br.until = now + std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>(policy.cooldown) );
+        return true;
+    }
+
+    void breaker_report( const std::string &endpoint, const sq::light::backoff &policy, bool ok ) {
+        std::lock_guard<std::mutex> lock(breakers_mutex);
+        breaker &br = breakers[endpoint];
+        if( ok )
+            br.failures = 0;
+        else if( ++br.failures >= policy.trip )
+            br.until = std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>(policy.cooldown) );
+    }
+
+    // recent handshake/ping round trip per endpoint (EWMA), so reconnect() can prefer the closest healthy host
+
+    void latency_report( const std::string &endpoint, double seconds ) {
+        std::lock_guard<std::mutex> lock(breakers_mutex);
+        breaker &br = breakers[endpoint];
+        br.latency = br.samples++ ? br.latency * 0.75 + seconds * 0.25 : seconds;
+    }
+
+    double latency_of( const std::string &endpoint ) {
+        std::lock_guard<std::mutex> lock(breakers_mutex);
+        auto it = breakers.find( endpoint );
+        return it == breakers.end() ? 0 : it->second.latency; // unmeasured hosts go first, so they get measured
+    }
 
-        return hash3;
+    // getaddrinfo() results are cached process-wide; a stale entry is still served if the resolver fails
+
+    struct resolved {
+        std::vector<address> addrs;
+        std::chrono::steady_clock::time_point when;
+    };
+
+    std::mutex &resolver_mutex = *new std::mutex;
+    std::map< std::string, resolved > &resolver = *new std::map< std::string, resolved >;
+
+    bool resolve( const std::string &host, const std::string &port, double ttl, std::vector<address> &out ) {
+        const std::string key = host + "|" + port;
+        auto now = std::chrono::steady_clock::now();
+        {
+            std::lock_guard<std::mutex> lock(resolver_mutex);
+            auto it = resolver.find( key );
+            if( it != resolver.end() && std::chrono::duration<double>( now - it->second.when ).count() < ttl ) {
+                out = it->second.addrs;
+                return true;
+            }
+        }
+
+        addrinfo hints, *res = 0;
+        memset(&hints,0,sizeof(hints));
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        hints.ai_protocol = IPPROTO_TCP;
+        if( getaddrinfo( host.c_str(), port.c_str(), &hints, &res ) != 0 || !res ) {
+            std::lock_guard<std::mutex> lock(resolver_mutex);
+            auto it = resolver.find( key );
+            if( it == resolver.end() )
+                return false;
+            out = it->second.addrs;
+            return true;
+        }
+
+        out.clear();
+        for( addrinfo *ai = res; ai; ai = ai->ai_next ) {
+            if( ai->ai_addrlen > sizeof(sockaddr_storage) )
+                continue;
+            out.push_back( address() );
+            memcpy( &out.back().first, ai->ai_addr, ai->ai_addrlen );
+            out.back().second = (socklen_t)ai->ai_addrlen;
+        }
+        freeaddrinfo( res );
+
+        std::lock_guard<std::mutex> lock(resolver_mutex);
+        resolved &entry = resolver[key];
+        entry.addrs = out;
+        entry.when = now;
+        return !out.empty();
+    }
+
+    // "db1,db2:3307,[::1]:3306,/var/run/mysqld/mysqld.sock" -> (host,port) pairs; bare hosts take the default port
+    std::vector< std::pair<std::string,std::string> > split_hosts( const std::string &list, const std::string &port ) {
+        std::vector< std::pair<std::string,std::string> > out;
+        std::stringstream ss( list );
+        std::string item;
+        while( std::getline( ss, item, ',' ) ) {
+            item.erase( 0, item.find_first_not_of(" \t") );
+            item.erase( item.find_last_not_of(" \t") + 1 );
+            if( item.empty() )
+                continue;
+            std::string::size_type colon = item.rfind(':');
+            if( item[0] == '/' )
+                out.push_back( std::make_pair( item, std::string() ) );
+            else if( item[0] == '[' ) {
+                std::string::size_type close = item.find(']');
+                if( close == std::string::npos )
+                    return std::vector< std::pair<std::string,std::string> >();
+                out.push_back( std::make_pair( item.substr(1, close-1), close+1 < item.size() && item[close+1] == ':' ? item.substr(close+2) : port ) );
+            }
+            else if( colon != std::string::npos && item.find(':') == colon )
+                out.push_back( std::make_pair( item.substr(0, colon), item.substr(colon+1) ) );
+            else
+                out.push_back( std::make_pair( item, port ) ); // hostname, IPv4, or bare IPv6 literal
+        }
+        return out;
+    }
+
+    // full jitter: spreads simultaneous reconnects of many threads over the whole window
+    void backoff_sleep( const sq::light::backoff &policy, unsigned attempt ) {
+        static thread_local std::minstd_rand rng( std::random_device{}() );
+        double window = std::min( policy.cap, std::ldexp( policy.base, (int)std::min( attempt, 30u ) ) );
+        std::uniform_real_distribution<double> dist( 0, window > 0 ? window : 0 );
+        std::this_thread::sleep_for( std::chrono::duration<double>( dist(rng) ) );
     }
+
 }
 
 #ifdef _MSC_VER
@@ -449,124 +653,529 @@ namespace
 #   pragma warning( disable : 4996 )
 #endif
 
-sq::light::light() : s(0), connected(false) {
+sq::light::light() : connected(false), inbox(0), ttl(60), s(0), tid(0), status(0), seq(0), syscalls(0), head(0), tail(0), print(0), warming(false), expired(false), keepidle(0), keepintvl(0), keepcnt(0), idle(0), stopping(false), spill(0), tracking(false) {
     INIT();
+#ifdef SQLIGHT_TRACE
+    tracing = 0, traced = 0;
+#endif
 }
 
 sq::light::~light() {
+    keepalive( 0 );
     disconnect();
 }
 
-bool sq::light::acquire() {
-    release();
+bool sq::light::acquire( size_t capacity ) {
+    // buffers survive reconnects; only the first connection pays for the allocation.
+    // both grow on demand: send buffer up to the largest query, read-ahead up to the largest row.
+    if( buf.size() < capacity )
+        buf.resize( capacity );
+    if( rx.size() < capacity )
+        rx.resize( capacity );
 
-    buf.resize( 1 << 24 ); // recv buffer is max row size 16 mb
     b = d = buf.data();
+    head = tail = 0;
 
     return true;
 }
 
 void sq::light::release() {
     buf = std::vector<char>();
+    rx = std::vector<char>();
+    arena = std::vector<char>();
+    offsets = std::vector<size_t>();
+    cells = std::vector<const char *>();
     b = d = 0;
+    head = tail = 0;
 }
 
-bool sq::light::connect( const std::string &host, const std::string &port, const std::string &user, const std::string &pass )
-{
-    unsigned _port;
+bool sq::light::adopt() {
+    // take over a socket handshaked in background by prewarm(), if there is one ready
+    if( !spare.valid() || spare.wait_for( std::chrono::seconds(0) ) != std::future_status::ready )
+        return false;
 
-    if( !(std::stringstream(port) >> _port) )
+    bool ok = spare.get();
+    std::shared_ptr<light> ready;
+    ready.swap( standby );
+    if( !ok )
         return false;
 
-    if( user.empty() || pass.empty() || host.empty() || _port == 0 || _port >= 65536 )
+    s = ready->s, tid = ready->tid, status = ready->status;
+    host = ready->host, port = ready->port;
+    tracking = ready->tracking, used = ready->used, vars = ready->vars;
+    ready->s = 0;
+
+    if( warming )
+        prewarms(); // keep a standby ready for the next reconnect
+
+    return true;
+}
+
+bool sq::light::connect( const std::string &host, const std::string &port, const std::string &user, const std::string &pass, const std::string &db )
+{
+    auto hosts = split_hosts( host, port );
+    hold lock( *this );
+
+    if( user.empty() || pass.empty() || hosts.empty() )
         return false;
 
-    this->host = host;
-    this->port = port;
-    this->user = user;
-    this->pass = blob( SHA1( pass ) );
+    for( auto &h : hosts ) {
+        unsigned _port = 0;
+        if( h.first[0] != '/' && (!(std::stringstream(h.second) >> _port) || _port == 0 || _port >= 65536) )
+            return false;
+    }
 
-    return reconnect();
+    this->hosts = hosts;
+    this->host = hosts[0].first;
+    this->port = hosts[0].second;
+    this->user = user;
+    this->pass.resize( 20 );
+    this->pass2.resize( 20 );
+    sha1().add( pass.data(), pass.size() ).digest( this->pass.data() );
+    sha1().add( this->pass.data(), 20 ).digest( this->pass2.data() );
+    this->pass256.resize( 32 );
+    this->pass2562.resize( 32 );
+    sha256().add( pass.data(), pass.size() ).digest( this->pass256.data() );
+    sha256().add( this->pass256.data(), 32 ).digest( this->pass2562.data() );
+    this->secret = pass;
+    this->db = db;
+
+    // standby socket belongs to previous credentials
+    spare = std::future<bool>();
+    standby.reset();
+
+    return reconnects( true );
 }
 
 bool sq::light::reconnect() {
-    disconnect();
-    release();
+    hold lock( *this );
+    return reconnects();
+}
+
+bool sq::light::reconnects( bool first ) {
+    disconnects();
 
     if( !acquire() )
         return false;
 
-    connected = true;
-    if( !test("SHOW DATABASES") )
-        return connected = false;
+    // a pre-warmed socket may have idled out meanwhile: a COM_PING round-trip settles it
+    if( adopt() ) {
+        connected = true;
+        if( pings() && restores() )
+            return count( &tally::reconnects ), true;
+        disconnects();
+    }
+
+    // a successful handshake already ends with an OK packet, no extra probe query needed.
+    // hosts are tried lowest recent latency first; those behind an open breaker are skipped.
+    std::vector< std::pair<double, size_t> > order;
+    for( size_t n = 0; n < hosts.size(); ++n )
+        order.push_back( std::make_pair( latency_of( hosts[n].first + ":" + hosts[n].second ), n ) );
+    std::sort( order.begin(), order.end() );
+
+    for( unsigned attempt = 0; attempt < policy.attempts; ++attempt ) {
+        if( attempt )
+            backoff_sleep( policy, attempt );
+        bool tried = false;
+        for( auto &o : order ) {
+            host = hosts[o.second].first;
+            port = hosts[o.second].second;
+            const std::string endpoint = host + ":" + port;
+            if( !breaker_allows( endpoint, policy ) )
+                continue;
+            tried = true;
+            auto start = std::chrono::steady_clock::now();
+            bool ok = open();
+            breaker_report( endpoint, policy, ok );
+            if( ok ) {
+                latency_report( endpoint, std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+                if( warming && !spare.valid() )
+                    prewarms();
+                count( first ? &tally::connects : &tally::reconnects );
+                connected = true;
+                if( restores() )
+                    return true;
+                disconnects();
+                return connected = false;
+            }
+            disconnects();
+        }
+        if( !tried )
+            return false;
+    }
+
+    return connected = false;
+}
+
+void sq::light::prewarm() {
+    hold lock( *this );
+    prewarms();
+}
+
+void sq::light::prewarms() {
+    warming = true;
+    if( spare.valid() )
+        return;
+
+    // the task owns a reference too, so dropping ours never leaves it dangling. it runs detached: a destructor
+    // or a new connect() drops the standby without waiting for its handshake, which then closes on its own
+    std::shared_ptr<light> conn = std::make_shared<light>();
+    std::shared_ptr< std::promise<bool> > ready = std::make_shared< std::promise<bool> >();
+    conn->inherit( *this );
+    standby = conn;
+    spare = ready->get_future();
+    std::thread( [conn, ready]() {
+        ready->set_value( conn->acquire( 1 << 16 ) && conn->open() );
+    } ).detach();
+}
+
+void sq::light::inherit( const light &from ) {
+    hosts = from.hosts;
+    host = from.host;
+    port = from.port;
+    ttl = from.ttl;
+    user = from.user;
+    pass = from.pass;
+    pass2 = from.pass2;
+    pass256 = from.pass256;
+    pass2562 = from.pass2562;
+    secret = from.secret;
+    db = from.db;
+    limits = from.limits;
+    keepidle = from.keepidle, keepintvl = from.keepintvl, keepcnt = from.keepcnt;
+}
+
+void sq::light::set_backoff( const backoff &policy ) {
+    hold lock( *this );
+    this->policy = policy;
+}
+
+void sq::light::set_timeouts( const timeouts &defaults ) {
+    hold lock( *this );
+    limits = defaults;
+}
+
+void sq::light::set_dns_ttl( double seconds ) {
+    hold lock( *this );
+    ttl = seconds;
+}
 
-    return connected = true;
+void sq::light::set_spill( size_t bytes ) {
+    hold lock( *this );
+    spill = bytes;
 }
 
 void sq::light::disconnect() {
+    hold lock( *this );
+    disconnects();
+}
+
+void sq::light::disconnects() {
     if( s ) CLOSE( s );
     s = 0;
+    head = tail = 0; // unread bytes belong to the dead socket
     connected = false;
 }
 
-bool sq::light::is_connected() {
-  char buf;
+bool sq::light::is_connected( bool roundtrip ) {
+    if( !connected )
+        return false;
 
-  if (!connected)
-    return false;
+    if( roundtrip )
+        return ping();
 
-  int res = recvfixed(s, &buf, 1, MSG_PEEK | $windows(0) $welse(MSG_DONTWAIT));
-  if (res<0)
-    {
-      // Maybe disconnected or maybe not...
-      if (errno != EAGAIN && errno != EWOULDBLOCK)
-    connected = false;
-    }
-  else if (res==0)
-    {
-      connected = false;
+    // a query in flight owns the socket, and notices a dead peer by itself
+    if( !mutex.try_lock() )
+        return connected;
+
+    // socket is non-blocking, so one peek is the whole probe: an idle healthy socket has nothing
+    // to read and returns EAGAIN. Anything else means either EOF/RST or an unsolicited server
+    // packet (ie, the error sent right before an idle timeout close); both are fatal.
+    char byte;
+    if( RECV(s, &byte, 1, MSG_PEEK) >= 0 || !AGAIN() )
+        connected = false;
+
+    mutex.unlock();
+    return connected;
+}
+
+bool sq::light::ping()
+{
+    if( !connected )
+        return false;
+
+    hold lock( *this );
+
+    return pings();
+}
+
+bool sq::light::pings()
+{
+    // COM_PING: one byte command, answered with a plain OK packet
+    auto start = last = std::chrono::steady_clock::now();
+    arm( limits.recv );
+    d[0]=1; d[1]=d[2]=d[3]=0; d[4]=0x0e;
+    if( !sendall(d,5) || !recvs(0) )
+        return connected = false;
+
+    latency_report( host + ":" + port, std::chrono::duration<double>( std::chrono::steady_clock::now() - start ).count() );
+    return true;
+}
+
+bool sq::light::tcp_keepalive( int idle, int interval, int count )
+{
+    hold lock( *this );
+    keepidle = idle, keepintvl = interval, keepcnt = count;
+    return !s || tune();
+}
+
+bool sq::light::tune()
+{
+    // kernel-side keepalive probes, so half-open sockets get detected without any traffic
+    int on = keepidle > 0;
+    bool ok = SETSOCKOPT(s, SOL_SOCKET, SO_KEEPALIVE, &on, sizeof(on)) == 0;
+    if( !on )
+        return ok;
+#if defined(TCP_KEEPIDLE)
+    ok &= SETSOCKOPT(s, IPPROTO_TCP, TCP_KEEPIDLE, &keepidle, sizeof(keepidle)) == 0;
+#elif defined(TCP_KEEPALIVE)
+    ok &= SETSOCKOPT(s, IPPROTO_TCP, TCP_KEEPALIVE, &keepidle, sizeof(keepidle)) == 0;
+#endif
+#if defined(TCP_KEEPINTVL)
+    if( keepintvl > 0 ) ok &= SETSOCKOPT(s, IPPROTO_TCP, TCP_KEEPINTVL, &keepintvl, sizeof(keepintvl)) == 0;
+#endif
+#if defined(TCP_KEEPCNT)
+    if( keepcnt > 0 ) ok &= SETSOCKOPT(s, IPPROTO_TCP, TCP_KEEPCNT, &keepcnt, sizeof(keepcnt)) == 0;
+#endif
+    return ok;
+}
+
+void sq::light::keepalive( double idle )
+{
+    // background COM_PING on connections idle for longer than 'idle' seconds; 0 stops it
+    if( keeper.joinable() ) {
+        {
+            std::lock_guard<std::mutex> lock(keeper_mutex);
+            stopping = true;
+        }
+        keeper_cv.notify_all();
+        keeper.join();
+        stopping = false;
     }
 
-  return connected;
+    this->idle = idle;
+    if( idle <= 0 )
+        return;
+
+    keeper = std::thread( [this]() {
+        auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>( this->idle / 2 ) );
+        std::unique_lock<std::mutex> wait(keeper_mutex);
+        while( !keeper_cv.wait_for( wait, period, [this]{ return stopping; } ) ) {
+            // a busy connection is not idle: never queue up behind a running query
+            if( !mutex.try_lock() )
+                continue;
+            if( connected && std::chrono::steady_clock::now() - last >= period * 2 )
+                pings();
+            mutex.unlock();
+        }
+    } );
 }
 
-bool sq::light::fail( const char *error, const char *title )
+bool sq::light::fail( const char *error, const char *title, unsigned code )
 {
     //disconnect();
+    failure.code = code;
+    memcpy( failure.sqlstate, "HY000", 6 );
+    failure.message.assign( title ? title : "" ).append( title && error ? ": " : "" ).append( error ? error : "" );
+    failure.timeout = expired;
+
+    count( &tally::errors );
+    for( tally *t : { &io, &all } ) {
+        std::lock_guard<std::mutex> lock( t->mutex );
+        t->codes[code]++;
+    }
     return false;
 }
 
-bool sq::light::open()
+bool sq::light::fails( const char *packet, unsigned len, const char *title )
 {
-    if(!s) {
+    // server error packet: 0xff, error code, '#' and sqlstate (4.1+), message
+    if( len < 3 )
+        return fail( "malformed error packet", title, CR_MALFORMED_PACKET );
+    bool state = len >= 9 && packet[3] == '#';
+    fail( 0, title, (byte)packet[1] | ( (byte)packet[2] << 8 ) );
+    if( state )
+        memcpy( failure.sqlstate, packet + 4, 5 );
+    if( title )
+        failure.message += ": ";
+    failure.message.append( packet + ( state ? 9 : 3 ), len - ( state ? 9 : 3 ) );
+    return false;
+}
+
+bool sq::light::error::retryable() const
+{
+    // a killed query may have been a slow one: running it again would just hit the deadline again
+    if( timeout )
+        return false;
+    switch( code ) {
+        default: return sqlstate[0] == '0' && sqlstate[1] == '8'; // connection exception
+        case 1040: // ER_CON_COUNT_ERROR, too many connections
+        case 1053: // ER_SERVER_SHUTDOWN
+        case 1159: // ER_NET_READ_INTERRUPTED
+        case 1161: // ER_NET_WRITE_INTERRUPTED
+        case 1205: // ER_LOCK_WAIT_TIMEOUT
+        case 1213: // ER_LOCK_DEADLOCK
+        case CR_CONN_HOST_ERROR:
+        case CR_SERVER_GONE_ERROR:
+        case CR_SERVER_LOST:
+            return true;
+    }
+}
+
+bool sq::light::retries( const std::string &query, unsigned attempt )
+{
+    // reads only, and never inside a transaction: a deadlock rolls the whole transaction back, and a reconnect loses it
+    enum { SERVER_STATUS_IN_TRANS = 0x0001 };
+    if( attempt >= again.attempts || !failure.retryable() || ( status & SERVER_STATUS_IN_TRANS ) || !sq::router::is_read( query ) )
+        return false;
+
+    backoff window;
+    window.base = again.base, window.cap = again.cap;
+    backoff_sleep( window, attempt );
+
+    if( !connected || failure.code == CR_SERVER_GONE_ERROR || failure.code == CR_SERVER_LOST )
+        return reconnects();
+    return true;
+}
+
+void sq::light::set_retry( const retry &policy ) {
+    hold lock( *this );
+    again = policy;
+}
+
+sq::light::error sq::light::last_error() {
+    hold lock( *this );
+    return failure;
+}
+
+sq::light::tally &sq::light::all = *new sq::light::tally;
+
+sq::light::tally::tally() :
+    bytes_sent(0), bytes_received(0), packets_sent(0), packets_received(0), queries(0), results(0), rows(0), connects(0), reconnects(0), errors(0) {
+}
+
+sq::light::counters sq::light::tally::snapshot() {
+    counters c;
+    c.bytes_sent = bytes_sent.load( std::memory_order_relaxed );
+    c.bytes_received = bytes_received.load( std::memory_order_relaxed );
+    c.packets_sent = packets_sent.load( std::memory_order_relaxed );
+    c.packets_received = packets_received.load( std::memory_order_relaxed );
+    c.queries = queries.load( std::memory_order_relaxed );
+    c.results = results.load( std::memory_order_relaxed );
+    c.rows = rows.load( std::memory_order_relaxed );
+    c.connects = connects.load( std::memory_order_relaxed );
+    c.reconnects = reconnects.load( std::memory_order_relaxed );
+    c.errors = errors.load( std::memory_order_relaxed );
+    std::lock_guard<std::mutex> lock( mutex );
+    c.codes = codes;
+    return c;
+}
+
+void sq::light::count( std::atomic<unsigned long long> tally::*counter, unsigned long long n ) {
+    // relaxed: counters order nothing, they only have to add up
+    (io.*counter).fetch_add( n, std::memory_order_relaxed );
+    (all.*counter).fetch_add( n, std::memory_order_relaxed );
+}
+
+sq::light::counters sq::light::stats() {
+    return io.snapshot();
+}
 
-        unsigned _port;
-        if( !(std::stringstream(port) >> _port) )
-            return fail("invalid port");
+sq::light::counters sq::light::totals() {
+    return all.snapshot();
+}
 
-        sockaddr_in addr;
-        memset(&addr,0,sizeof(sockaddr_in));
-        addr.sin_family = AF_INET;
-        addr.sin_port = htons(_port);
-        inet_pton(AF_INET, host.c_str(), &addr.sin_addr);
+#ifdef SQLIGHT_TRACE
+void sq::light::trace( tracer fn, void *userdata ) {
+    hold lock( *this );
+    tracing = fn, traced = userdata;
+}
+#endif
 
-        s = socket(AF_INET,SOCK_STREAM,IPPROTO_TCP);
+bool sq::light::open()
+{
+    if(!s) {
 
-        if( CONNECT(s,(sockaddr*)&addr,sizeof(addr)) <  0 )
-            return fail("Connect Failed  ");
+        // host starting with '/' is a unix domain socket path (co-located server); port is ignored then.
+        // anything else goes through the resolver cache: hostnames, IPv4 and IPv6 literals alike.
+        std::vector<address> addrs;
+
+        if( unix_domain() ) {
+$windows(
+            return fail("unix sockets unsupported", 0, CR_CONNECTION_ERROR);
+)
+$welse(
+            addrs.resize(1);
+            sockaddr_un *un = (sockaddr_un *)&addrs[0].first;
+            if( host.size() >= sizeof(un->sun_path) )
+                return fail("socket path too long", 0, CR_CONNECTION_ERROR);
+            un->sun_family = AF_UNIX;
+            memcpy(un->sun_path, host.c_str(), host.size() + 1);
+            addrs[0].second = sizeof(sockaddr_un);
+)
+        } else if( !resolve( host, port, ttl, addrs ) )
+            return fail("cannot resolve host", 0, CR_UNKNOWN_HOST);
+
+        // non-blocking connect, so an unreachable host costs limits.connect rather than the kernel SYN retry budget.
+        // socket stays non-blocking afterwards: reads and writes are tried first and only wait on EAGAIN.
+        // every resolved address is tried in turn within the same deadline.
+        arm( limits.connect );
+        for( size_t n = 0; !s; ++n ) {
+            if( n == addrs.size() || expired )
+                return fail(expired ? "Connect Timeout" : "Connect Failed", 0, CR_CONN_HOST_ERROR);
+            const sockaddr *sa = (const sockaddr *)&addrs[n].first;
+            s = socket(sa->sa_family,SOCK_STREAM,0);
+            if( s < 0 ) {
+                s = 0;
+                continue;
+            }
+            if( sa->sa_family != AF_UNIX )
+                tune();
+            int flags = fcntl(s, F_GETFL, 0);
+            fcntl(s, F_SETFL, flags | O_NONBLOCK);
+            if( CONNECT(s,sa,addrs[n].second) <  0 ) {
+                int err = 0; socklen_t len = sizeof(err);
+                if( $windows(WSAGetLastError() != WSAEWOULDBLOCK) $welse(errno != EINPROGRESS)
+                    || !wait(true) || GETSOCKOPT(s, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err )
+                    disconnects();
+            }
+        }
 
-        i = RECV(s,b,1<<24,0);
-        if (b[4] < 10 ) return fail(b+5,"Need MySql > 4.1");
+        arm( limits.handshake );
+        char *hs = packet(no);
+        if( !hs )
+            return fail(expired ? "Timeout" : "connection lost","Handshake Failed", CR_SERVER_LOST);
+        if( (byte)hs[0] == 0xff ) return fails(hs, no, "Handshake Failed"); // ie, too many connections
+        if (hs[0] < 10 ) return fail(hs+1,"Need MySql > 4.1");
 
-        // Read server auth challenge and calc response by making SHA1 hashes from it and password
+        // Read server greeting: version, connection id, auth challenge in two parts and auth plugin
         // [ref] http://dev.mysql.com/doc/internals/en/connection-phase.html#packet-Protocol::Handshake
 
-        std::vector<unsigned char> hash;
+        byte salt[20 + 12] = {0};
+        std::string plugin = "mysql_native_password";
+        unsigned caps;
 
         {
-            byte *salt = (byte*)b+strlen(b+5)+10;
-            memcpy(salt+8,salt+27,13);
-            hash = get_mysql_hash( pass, salt );
+            const char *p = hs+1+strlen(hs+1)+1, *end = hs+no;
+            tid = *(unsigned*)p;        p+=4;      // connection id, target of KILL QUERY
+            memcpy(salt,p,8);           p+=9;
+            caps = *(dword*)p;          p+=2+1;    // capabilities low, charset
+            status = *(dword*)p;        p+=2;      // status
+            caps |= *(dword*)p << 16;   p+=2;      // capabilities high
+            byte saltlen = *(byte*)p;   p+=1+10;
+            memcpy(salt+8,p,12);        p+=std::max(13, saltlen-8);
+            if( (caps & CLIENT_PLUGIN_AUTH) && p < end )
+                plugin.assign( p, std::find(p, end, '\0') );
         }
 
         // Construct client auth response
@@ -579,342 +1188,3341 @@ bool sq::light::open()
             CLIENT_PROTOCOL_41|
             CLIENT_SECURE_CONNECTION|
             CLIENT_LONG_PASSWORD|
-            CLIENT_MULTI_RESULTS;        // for stored procedures
+            CLIENT_MULTI_RESULTS|        // for stored procedures
+            (caps & CLIENT_PLUGIN_AUTH)|
+            (caps & CLIENT_SESSION_TRACK)|
+            (db.empty() ? 0 : caps & CLIENT_CONNECT_WITH_DB);
+        bool with_db = ( *(int*)d & CLIENT_CONNECT_WITH_DB ) != 0;
+        tracking = ( *(int*)d & CLIENT_SESSION_TRACK ) != 0;
                        d+=4;
 
           *(int*)d = 1<<24;             d+=4;      // max packet size = 16Mb
-               * d = 8;                 d+=24;     // utf8 charset
+               * d = 8;                 d+=1;      // utf8 charset
+          memset(d,0,23);               d+=23;
           strcpy(d,user.c_str());       d+=1 + user.size();
-               * d = 20;                d+=1;  for(i=0;i<20;i++)
-              d[i] = hash[i]^0;         d+=22;     // XOR encrypt response
+               * d = scramble(plugin,salt,(byte*)d+1);
+                                        d+=1 + *(byte*)d;
+          if( with_db ) {
+          strcpy(d,db.c_str());         d+=1 + db.size();
+          }
+          if( caps & CLIENT_PLUGIN_AUTH ) {
+          strcpy(d,plugin.c_str());     d+=1 + plugin.size();
+          }
           *(int*)b = d-b-4 | 1<<24;                // calc final packet size and id
 
-          SEND(s,b,  d-b,0);
+        if( !sendall(b,d-b) )
+            return fail("Timeout","Login Failed", CR_SERVER_LOST);
+
+        // Server answers OK, ERR, an auth switch request or, for caching_sha2_password, a fast/full auth verdict.
+        // Fast auth (server cache hit) is one round trip; full auth needs TLS or an RSA key exchange, except on unix sockets.
+        // [ref] https://dev.mysql.com/doc/dev/mysql-server/latest/page_protocol_connection_phase.html
+
+        for( ;; ) {
+            char *r = packet(no); // in case of login failure server sends us an error text
+            if( !r ) return fail("Timeout","Login Failed", CR_SERVER_LOST);
+            if( r[0] == 0x00 ) {
+                // a fresh session: the database the handshake selected, if any, and server default variables
+                used = with_db ? db : std::string();
+                vars.clear();
+                if( tracking ) tracks( r, r + no );
+                break;
+            }
+            if( (byte)r[0] == 0xff ) return fails(r, no, "Login Failed");
+
+            if( (byte)r[0] == 0xfe ) {
+                // auth switch request: plugin name, then a fresh challenge
+                const char *end = r+no, *p = std::find((const char *)r+1, end, '\0');
+                plugin.assign( (const char *)r+1, p );
+                memset(salt,0,sizeof(salt));
+                if( p < end ) memcpy(salt, p+1, std::min<size_t>(20, end-p-1));
+                unsigned len = scramble(plugin,salt,(byte*)b+4);
+                if( !len )
+                    return fail(plugin.c_str(),"Unsupported auth plugin");
+                *(int*)b = len | (seq+1)<<24;
+                if( !sendall(b,4+len) ) return fail("Timeout","Login Failed", CR_SERVER_LOST);
+                continue;
+            }
+
+            if( r[0] == 0x01 && no >= 2 && r[1] == 3 ) continue; // fast auth ok, OK packet follows
+            if( r[0] == 0x01 && no >= 2 && r[1] == 4 ) {
+                // full auth: cleartext password is only acceptable on a secure transport, ie, a unix socket
+                if( !unix_domain() )
+                    return fail("caching_sha2_password full authentication needs TLS or RSA","Login Failed");
+                d = b+4;
+                memcpy(d,secret.c_str(),secret.size()+1);
+                *(int*)b = unsigned(secret.size()+1) | (seq+1)<<24;
+                if( !sendall(b,4+secret.size()+1) ) return fail("Timeout","Login Failed", CR_SERVER_LOST);
+                continue;
+            }
+
+            return fail("unexpected packet","Login Failed");
+        }
 
-          RECV(s,(char*)&no,4,0); no&=(1<<24)-1;   // in case of login failure server sends us an error text
-        i=RECV(s,b,no,0);        if(i==-1||*b)     return fail(i==-1?"Timeout":b+3,"Login Failed");
+        last = std::chrono::steady_clock::now();
     }
 
     return true;
 }
 
-bool sq::light::sends( const std::string &query )
+bool sq::light::unix_domain() const
 {
-    // Send sql query
+    return !host.empty() && host[0] == '/';
+}
+
+unsigned sq::light::scramble( const std::string &plugin, const byte *salt, byte *out )
+{
+    // auth response for given plugin into out; returns its length (0 if plugin is unsupported)
+    if( plugin == "caching_sha2_password" )
+        return get_sha2_hash( out, pass256.data(), pass2562.data(), salt ), 32;
+    if( plugin == "mysql_native_password" )
+        return get_mysql_hash( out, pass.data(), pass2.data(), salt ), 20;
+    return 0;
+}
+
+bool sq::light::sends( const std::string &query, byte command )
+{
+    // Send sql query (COM_QUERY), or any other command with its binary payload
     // Details at: http://forge.mysql.com/wiki/MySQL_Internals_ClientServer_Protocol#Command_Packet
 
-    d[4]=0x3;
-    strcpy(d+5,(char*)query.c_str());
-    *(int*)d=strlen(d+5)+1;
-    i=SEND(s,d,4+*(int*)d, $windows(0) $welse(MSG_NOSIGNAL));
-    if (i<0)
-        return false;
+    last = std::chrono::steady_clock::now();
+    if( buf.size() < query.size() + 6 )
+        buf.resize( query.size() + 6 );
+    b = d = buf.data();
+    d[4]=command;
+    memcpy(d+5,query.data(),query.size());
+    *(int*)d=int(query.size()+1);
+    if( command == 0x03 ) {
+        count( &tally::queries );
+        TRACE( TRACE_QUERY, query.data(), query.size() );
+    }
+    if( !sendall(d,4+*(int*)d) )
+        return fail(expired ? "timeout" : "server has gone away", 0, expired ? CR_SERVER_LOST : CR_SERVER_GONE_ERROR);
     return true;
 }
 
-bool sq::light::recvs( void *userdata, void* onvalue, void* onfield, void *onsep )
+void sq::light::frame()
 {
-    // Parse and display record set
-    // Details at: http://forge.mysql.com/wiki/MySQL_Internals_ClientServer_Protocol#Result_Set_Header_Packet
-    // [ref] http://dev.mysql.com/doc/internals/en/overview.html#status-flags
+    // start a COM_QUERY in place: header is patched by execs() once the payload is complete
+    if( buf.size() < 6 )
+        buf.resize( 1 << 12 );
+    b = d = buf.data();
+    d[4] = 0x03;
+    d += 5;
+}
 
-    std::vector<char> txtv(65536, 0); // medium blob
-    char *txt = txtv.data();
+char *sq::light::room( size_t count )
+{
+    // grow the send buffer under a payload being written, keeping b/d in place
+    size_t at = d - buf.data();
+    if( buf.size() < at + count + 1 ) {
+        buf.resize( std::max( buf.size() * 2, at + count + 1 ) );
+        b = buf.data(), d = b + at;
+    }
+    return d;
+}
 
-    char *p=b; byte typ[1000]={0}; int fields=0, field=0, value=0, row=0, exit=0, rc=0;
+const char *sq::light::spans( const char *format )
+{
+    // copy format up to its next placeholder (or its end), honoring quotes like placeholders() does
+    const char *p = format;
+    for( char quote = 0; *p && ( quote || *p != '?' ); ++p ) {
+        if( quote && *p == '\\' && p[1] ) ++p;
+        else if( quote ) quote = *p == quote ? 0 : quote;
+        else if( *p == '\'' || *p == '"' || *p == '`' ) quote = *p;
+    }
+    memcpy( room( p - format ), format, p - format );
+    d += p - format;
+    return p;
+}
+
+unsigned sq::light::marks( const char *format )
+{
+    // same walk as spans(), over the whole format
+    unsigned count = 0;
+    for( char quote = 0; *format; ++format ) {
+        if( quote && *format == '\\' && format[1] ) ++format;
+        else if( quote ) quote = *format == quote ? 0 : quote;
+        else if( *format == '\'' || *format == '"' || *format == '`' ) quote = *format;
+        else count += *format == '?';
+    }
+    return count;
+}
+
+void sq::light::put( long long number )
+{
+    if( number < 0 )
+        *room( 1 ) = '-', ++d;
+    put( number < 0 ? 0ULL - (unsigned long long)number : (unsigned long long)number );
+}
+
+void sq::light::put( unsigned long long number )
+{
+    char digits[24], *p = digits + sizeof(digits);
+    do *--p = char( '0' + number % 10 ); while( number /= 10 );
+    size_t len = digits + sizeof(digits) - p;
+    memcpy( room( len ), p, len );
+    d += len;
+}
+
+void sq::light::put( double number )
+{
+    // shortest text that reads back the same double. sql has no nan/inf literals: those go as NULL
+    if( std::isnan( number ) || std::isinf( number ) )
+        return put( nullptr );
+    int len = snprintf( room( 32 ), 32, "%.15g", number );
+    if( strtod( d, 0 ) != number )
+        len = snprintf( d, 32, "%.17g", number );
+    d += len;
+}
+
+void sq::light::put( bool flag )
+{
+    *room( 1 ) = flag ? '1' : '0', ++d;
+}
+
+void sq::light::put( std::nullptr_t )
+{
+    memcpy( room( 4 ), "NULL", 4 );
+    d += 4;
+}
+
+void sq::light::put( const char *text )
+{
+    text ? quote( text, strlen( text ) ) : put( nullptr );
+}
+
+void sq::light::put( const std::string &text )
+{
+    quote( text.data(), text.size() );
+}
+
+void sq::light::quote( const char *text, size_t len )
+{
+    // string literal, escaped like mysql_real_escape_string() does. the connection charset is single byte or utf8,
+    // so no multibyte sequence can hide a quote. with NO_BACKSLASH_ESCAPES set only doubling quotes works.
+    // [ref] https://dev.mysql.com/doc/refman/8.0/en/string-literals.html
+    enum { SERVER_STATUS_NO_BACKSLASH_ESCAPES = 0x0200 };
+
+    char *p = room( len * 2 + 2 );
+    *p++ = '\'';
+    if( status & SERVER_STATUS_NO_BACKSLASH_ESCAPES ) {
+        for( const char *end = text + len; text < end; ++text ) {
+            if( *text == '\'' ) *p++ = '\'';
+            *p++ = *text;
+        }
+    } else {
+        for( const char *end = text + len; text < end; ++text ) {
+            switch( *text ) {
+                default: *p++ = *text; break;
+                case '\0':   *p++ = '\\', *p++ = '0'; break;
+                case '\n':   *p++ = '\\', *p++ = 'n'; break;
+                case '\r':   *p++ = '\\', *p++ = 'r'; break;
+                case '\x1a': *p++ = '\\', *p++ = 'Z'; break;
+                case '\\': case '\'': case '"': *p++ = '\\', *p++ = *text; break;
+            }
+        }
+    }
+    *p++ = '\'';
+    d = p;
+}
+
+void sq::light::arm( double seconds )
+{
+    expired = false;
+    until = seconds > 0
+        ? std::chrono::steady_clock::now() + std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>(seconds) )
+        : std::chrono::steady_clock::time_point::max();
+}
+
+bool sq::light::wait( bool writable )
+{
+    double left = -1; // forever
+    if( until != std::chrono::steady_clock::time_point::max() ) {
+        left = std::chrono::duration<double>( until - std::chrono::steady_clock::now() ).count();
+        if( left <= 0 )
+            return expired = true, false;
+    }
+    int fd = s;
+    int rc = poll( fd, left, writable );
+    ++syscalls;
+    if( rc == TCP_TIMEOUT )
+        expired = true;
+    return rc == TCP_OK;
+}
+
+bool sq::light::sendall( const void *buffer, size_t count )
+{
+    // buffer always holds whole packets: walk their headers to count them
+    const char *p = (const char *)buffer;
+    unsigned packets = 0;
+    for( size_t at = 0; at + 4 <= count; ++packets ) {
+        unsigned len = 0;
+        memcpy( &len, p + at, 3 );
+        at += 4 + len;
+    }
+    this->count( &tally::packets_sent, packets );
+    TRACE( TRACE_SENT, p, count );
+
+    while( count ) {
+        int sent = SEND(s, p, count, $windows(0) $welse(MSG_NOSIGNAL));
+        ++syscalls;
+        if( sent > 0 ) {
+            this->count( &tally::bytes_sent, sent );
+            p += sent;
+            count -= sent;
+        }
+        else if( sent == 0 || !( INTR() || ( AGAIN() && wait(true) ) ) )
+            return false;
+    }
+    return true;
+}
+
+bool sq::light::fill( size_t need )
+{
+    // read-ahead: one recv() pulls in as many packets as the kernel has, so a result set
+    // of small rows costs a syscall per buffer rather than two per row
+    if( tail - head >= need )
+        return true;
+
+    if( rx.size() - head < need + 1 ) {
+        memmove( rx.data(), rx.data() + head, tail - head );
+        tail -= head, head = 0;
+        if( rx.size() < need + 1 ) // +1 slack byte for in-place terminators
+            rx.resize( std::max( need + 1, rx.size() * 2 ) );
+    }
+
+    // read first: data usually is there already, so the wait syscall is only paid on EAGAIN
+    while( tail - head < need ) {
+        int total = RECV(s, rx.data() + tail, rx.size() - tail - 1, 0);
+        ++syscalls;
+        if( total > 0 )
+            tail += total, count( &tally::bytes_received, total );
+        else if( total == 0 || !( INTR() || ( AGAIN() && wait(false) ) ) )
+            return false;
+    }
+    return true;
+}
+
+char *sq::light::packet( unsigned &len )
+{
+    // server may split packets anywhere, including right in the middle of a 4-byte header.
+    // returned payload lives in the read-ahead buffer and is valid until next call.
+    if( !fill(4) )
+        return 0;
+    memcpy( &len, rx.data() + head, 4 );
+    seq = (byte)( len >> 24 );
+    len &= 0xffffff; // mask also helps to skip packet sequence number
+    if( !fill(4 + len) )
+        return 0;
+
+    // payloads of 16MB and more (ie, big blobs) come split: splice the parts together, dropping their headers
+    for( unsigned part = len; part == 0xffffff; ) {
+        if( !fill(4 + len + 4) )
+            return 0;
+        char *next = rx.data() + head + 4 + len;
+        memcpy( &part, next, 4 );
+        seq = (byte)( part >> 24 );
+        part &= 0xffffff;
+        memmove( next, next + 4, tail - ( head + 4 + len + 4 ) );
+        tail -= 4;
+        if( !fill(4 + len + part) )
+            return 0;
+        len += part;
+    }
+
+    char *payload = rx.data() + head + 4;
+    head += 4 + len;
+    count( &tally::packets_received );
+    TRACE( TRACE_RECEIVED, payload, len );
+    return payload;
+}
+
+void sq::light::kill()
+{
+    // server would keep running the statement we gave up on; stop it from a side connection.
+    // connecting and handshaking takes a while, so it happens detached and the expired call returns right away.
+    // the side connection gets a short budget of its own: connect, handshake and KILL at most 1..5s each.
+    // nothing waits for it, exit included: whatever process-wide state it touches is never destroyed.
+    std::shared_ptr<light> side = std::make_shared<light>();
+    side->inherit( *this );
+    double budget = std::max( std::min( limits.handshake, 5.0 ), 1.0 );
+    side->limits.connect = side->limits.handshake = side->limits.send = side->limits.recv = budget;
+    std::stringstream ss;
+    ss << "KILL QUERY " << tid;
+    std::string query = ss.str();
+
+    std::thread( [side, query]() {
+        // sends/recvs rather than test(): a KILL that expires itself must not spawn yet another one
+        if( side->acquire( 1 << 16 ) && side->open() ) {
+            side->arm( side->limits.send );
+            if( side->sends( query ) ) {
+                side->arm( side->limits.recv );
+                side->recvs( 0 );
+            }
+        }
+    } ).detach();
+}
+
+namespace
+{
+    // ~net_field_length() @ libmysql.c
+    template<typename T>
+    size_t lenenc( T *&p ) {
+        unsigned char g=*(const unsigned char*)p++; size_t len=0;
+        switch(g) {
+            default:  return g;
+            case 251: return 0; // NULL_LENGTH
+            case 252: g=2; break;
+            case 253: g=3; break;
+            case 254: g=8; break;
+        }
+        // @todo: beware little/big endianess here!
+        memcpy(&len,p,g); p+=g;
+        return len;
+    }
+
+    // same, for untrusted input: false when the prefix or the length it encodes runs past end
+    template<typename T>
+    bool lenenc( T *&p, T *end, size_t &len ) {
+        if( p >= end ) return false;
+        unsigned char g=*(const unsigned char*)p;
+        size_t prefix = g < 251 ? 1 : g == 252 ? 3 : g == 253 ? 4 : g == 254 ? 9 : 1;
+        if( size_t(end - p) < prefix ) return false;
+        len = lenenc( p );
+        return len <= size_t(end - p);
+    }
+
+    // FNV-1a
+    unsigned long long fnv( const char *data, size_t len, unsigned long long h = 14695981039346656037ULL ) {
+        for( const char *end = data + len; data < end; ++data )
+            h = ( h ^ (unsigned char)*data ) * 1099511628211ULL;
+        return h;
+    }
+
+    // query shape: literals folded into '?', so 'where id=1' and 'where id=2' share their result schema
+    unsigned long long fingerprint( const std::string &query ) {
+        unsigned long long h = 14695981039346656037ULL;
+        for( const char *p = query.c_str(); *p; ) {
+            if( *p == '\'' || *p == '"' ) {
+                for( char quote = *p++; *p && *p != quote; ++p )
+                    if( *p == '\\' && p[1] ) ++p;
+                p += !!*p;
+            }
+            else if( isdigit((unsigned char)*p) && ( p == query.c_str() || !( isalnum((unsigned char)p[-1]) || p[-1] == '_' ) ) )
+                while( isalnum((unsigned char)*p) || *p == '.' ) ++p;
+            else {
+                h = fnv( p++, 1, h );
+                continue;
+            }
+            h = fnv( "?", 1, h );
+        }
+        return h | 1; // 0 is no fingerprint
+    }
+
+    // case insensitive keyword (lowercase), not followed by more of an identifier. skips it and the blanks after
+    bool keyword( const char *&p, const char *word ) {
+        size_t n = strlen( word );
+        for( size_t i = 0; i < n; ++i )
+            if( tolower((unsigned char)p[i]) != word[i] )
+                return false;
+        if( isalnum((unsigned char)p[n]) || p[n] == '_' || p[n] == '$' )
+            return false;
+        for( p += n; isspace((unsigned char)*p); ) ++p;
+        return true;
+    }
+
+    bool identifier( const char *&p, std::string &out ) {
+        out.clear();
+        if( *p == '`' ) {
+            const char *end = strchr( p + 1, '`' );
+            if( !end || end[1] == '`' ) // escaped backquotes: not worth the trouble
+                return false;
+            out.assign( p + 1, end ), p = end + 1;
+        }
+        else while( isalnum((unsigned char)*p) || *p == '_' || *p == '$' )
+            out += *p++;
+        while( isspace((unsigned char)*p) ) ++p;
+        return !out.empty();
+    }
+
+    bool ends( const char *p ) {
+        if( *p == ';' ) ++p;
+        while( isspace((unsigned char)*p) ) ++p;
+        return !*p;
+    }
+
+    // USE db
+    bool uses( const std::string &query, std::string &db ) {
+        const char *p = query.c_str();
+        while( isspace((unsigned char)*p) ) ++p;
+        return keyword( p, "use" ) && identifier( p, db ) && ends( p );
+    }
+
+    // SET [SESSION|LOCAL|@@SESSION.|@@LOCAL.|@@]name = literal, ... with plain literals only: quoted strings, numbers, ON/OFF/TRUE/FALSE.
+    // anything else (expressions, DEFAULT, user variables, GLOBAL, NAMES, TRANSACTION...) is left for the server to judge
+    bool assigns( const std::string &query, std::vector< std::pair<std::string,std::string> > &out ) {
+        const char *p = query.c_str();
+        while( isspace((unsigned char)*p) ) ++p;
+        if( !keyword( p, "set" ) )
+            return false;
+        out.clear();
+        for( ;; ) {
+            if( p[0] == '@' && p[1] == '@' ) {
+                const char *q = p += 2;
+                if( ( keyword( q, "session" ) || keyword( q, "local" ) ) && *q == '.' )
+                    p = q + 1;
+            }
+            else if( !keyword( p, "session" ) )
+                keyword( p, "local" );
+
+            std::string name, value;
+            if( !identifier( p, name ) )
+                return false;
+            if( *p == ':' && p[1] == '=' )
+                ++p;
+            if( *p++ != '=' )
+                return false;
+            while( isspace((unsigned char)*p) ) ++p;
+
+            if( *p == '\'' || *p == '"' ) {
+                const char *end = strchr( p + 1, *p );
+                if( !end || end[1] == *p || std::find( p + 1, end, '\\' ) != end )
+                    return false;
+                value.assign( p + 1, end ), p = end + 1;
+            }
+            else if( isdigit((unsigned char)*p) || ( *p == '-' && isdigit((unsigned char)p[1]) ) ) {
+                const char *start = p++;
+                while( isdigit((unsigned char)*p) || *p == '.' ) ++p;
+                value.assign( start, p );
+            }
+            else {
+                while( isalpha((unsigned char)*p) ) value += (char)tolower((unsigned char)*p++);
+                if( value != "on" && value != "off" && value != "true" && value != "false" )
+                    return false;
+            }
+
+            for( auto &ch : name ) ch = (char)tolower((unsigned char)ch);
+            out.push_back( std::make_pair( name, value ) );
+            while( isspace((unsigned char)*p) ) ++p;
+            if( *p != ',' )
+                return ends( p );
+            for( ++p; isspace((unsigned char)*p); ) ++p;
+        }
+    }
+
+    // value as the server reports it against a literal: exact, except that 1/ON/TRUE and 0/OFF/FALSE spell the same
+    bool same( const std::string &tracked, const std::string &literal ) {
+        auto flag = []( const std::string &value ) {
+            std::string v = value;
+            for( auto &ch : v ) ch = (char)tolower((unsigned char)ch);
+            return v == "1" || v == "on" || v == "true" ? 1 : v == "0" || v == "off" || v == "false" ? 0 : -1;
+        };
+        if( tracked == literal )
+            return true;
+        int a = flag( tracked );
+        return a >= 0 && a == flag( literal );
+    }
+}
+
+void sq::light::tracks( const char *p, const char *end )
+{
+    // session state changes trailing an OK packet: after status and warnings come info, then (type, data) entries
+    // [ref] https://dev.mysql.com/doc/dev/mysql-server/latest/page_protocol_basic_ok_packet.html
+    enum { SERVER_SESSION_STATE_CHANGED = 0x4000 };
+    enum { SESSION_TRACK_SYSTEM_VARIABLES = 0, SESSION_TRACK_SCHEMA = 1 };
+
+    ++p; lenenc(p); lenenc(p); // affected rows, last insert id
+    if( p + 4 > end || !( ( *(byte*)p | ( *(byte*)(p+1) << 8 ) ) & SERVER_SESSION_STATE_CHANGED ) )
+        return;
+    p += 4; // status, warnings
+    size_t len = lenenc(p); // info
+    if( ( p += len ) >= end ) return;
+    len = lenenc(p);
+    for( const char *stop = p + std::min<size_t>( len, end - p ); p < stop; ) {
+        byte type = *p++;
+        size_t size = lenenc(p);
+        const char *q = p;
+        if( ( p += size ) > stop ) return;
+
+        if( type == SESSION_TRACK_SCHEMA ) {
+            size_t n = lenenc(q);
+            used.assign( q, n );
+        }
+        else if( type == SESSION_TRACK_SYSTEM_VARIABLES ) {
+            size_t n = lenenc(q);
+            std::string name( q, n );
+            q += n, n = lenenc(q);
+            for( auto &ch : name ) ch = (char)tolower((unsigned char)ch);
+            if( name == "session_track_system_variables" && std::string( q, n ) != "*" )
+                vars.clear(); // fewer variables tracked from now on: those we knew may change unseen
+            vars[name].assign( q, n );
+        }
+    }
+}
+
+bool sq::light::redundant( const std::string &query )
+{
+    // only USE and SET can be, so anything else costs a single char test. what remember() guessed without
+    // session tracking may be stale (a procedure or trigger can change it unseen), so then nothing is skipped
+    if( !tracking )
+        return false;
+    const char *p = query.c_str();
+    while( isspace((unsigned char)*p) ) ++p;
+    if( tolower((unsigned char)*p) != 'u' && tolower((unsigned char)*p) != 's' )
+        return false;
+
+    std::string name;
+    if( uses( query, name ) )
+        return !used.empty() && used == name;
+
+    std::vector< std::pair<std::string,std::string> > sets;
+    if( !assigns( query, sets ) )
+        return false;
+    for( auto &set : sets ) {
+        auto found = vars.find( set.first );
+        if( found == vars.end() || !same( found->second, set.second ) )
+            return false;
+    }
+    return true;
+}
+
+void sq::light::remember( const std::string &query )
+{
+    // server does not track session state for us: keep what plain USE and SET did, and forget variables after any other SET or CALL
+    if( tracking )
+        return;
+    const char *p = query.c_str();
+    while( isspace((unsigned char)*p) ) ++p;
+    int c = tolower((unsigned char)*p);
+    if( c != 'u' && c != 's' && c != 'c' )
+        return;
+
+    std::string name;
+    std::vector< std::pair<std::string,std::string> > sets;
+    if( uses( query, name ) )
+        used = name;
+    else if( assigns( query, sets ) )
+        for( auto &set : sets ) vars[ set.first ] = set.second;
+    else if( keyword( p, "set" ) || keyword( p, "call" ) )
+        vars.clear();
+}
+
+bool sq::light::restores()
+{
+    // a new session: database (unless the handshake selected it already), then every preset variable in a single SET
+    if( !db.empty() && used != db ) {
+        std::string use = "USE `";
+        for( char ch : db ) use += ch == '`' ? std::string( "``" ) : std::string( 1, ch );
+        if( !tests( use + "`", 0 ) )
+            return false;
+        used = db;
+    }
+    if( presets.empty() )
+        return true;
+
+    // track every variable, so later SETs to the same values can be skipped
+    std::string query = "SET ";
+    if( tracking )
+        query += "session_track_system_variables='*', ";
+    for( auto &set : presets )
+        query += set.first + "=" + set.second + ", ";
+    query.resize( query.size() - 2 );
+    return tests( query, 0 );
+}
+
+bool sq::light::set_session( const std::string &variable, const std::string &value )
+{
+    hold lock( *this );
 
-    char &b0 = b[0];
-    char &b1 = b[1]; // warning count  low byte
-    char &b2 = b[2]; // warning count high byte
-    char &b3 = b[3]; // status  low byte
-    char &b4 = b[4]; // status high byte
+    // only a SET the server took becomes a preset: a rejected one would break every later reconnect
+    if( connected && !tests( "SET " + variable + "=" + value, 0 ) )
+        return false;
+    for( auto &set : presets )
+        if( set.first == variable )
+            return set.second = value, true;
+    presets.push_back( std::make_pair( variable, value ) );
+    return true;
+}
+
+std::string sq::light::database()
+{
+    hold lock( *this );
+    return used;
+}
+
+std::map<std::string, std::string> sq::light::session()
+{
+    hold lock( *this );
+    return vars;
+}
+
+bool sq::light::recvs( sq::writer *out )
+{
+    // Parse record set(s), feeding out straight from the packets
+    // Details at: http://forge.mysql.com/wiki/MySQL_Internals_ClientServer_Protocol#Result_Set_Header_Packet
+    // [ref] http://dev.mysql.com/doc/internals/en/overview.html#status-flags
+
+    enum { SERVER_MORE_RESULTS_EXISTS = 0x0008 };
+
+    char *p; int fields=0, field=0, value=0, row=0, exit=0, sets=0;
+    const sq::schema::column *cols = 0;
+    bool fresh = false; // shape is ours to fill, rather than a cached one being validated
+
+    shape.reset();
 
     while (1) {
-               rc = 0;
-               i= recvfixed(s, (char*)&no, 4, 0);
-               // i=RECV(s,(char*)&no,4,0);
-               no&=0xffffff; // This is a bug. server sometimes don't send those 4 bytes together. will fix it (recvfixed fix the bug)
-               // this also helps to skip packet sequence number: http://mysql.timesoft.cc/doc/internals/en/the-packet-header.html
-               if (i<0)
-                   return fail("connection lost");
+        // packets are parsed in place, straight from the read-ahead buffer
+        char *b = packet(no);
+        if( !b )
+            return connected = false, fail(expired ? "timeout" : "connection lost", 0, CR_SERVER_LOST); // Connection lost, or out of step after a timeout
+
+        p = b;
+
+        // 0. first thing we receive is either OK, an error, or the number of fields of a result set.
+        //    an OK (ie, after a stored procedure result) may still announce more results.
+        if( !fields ) {
+            if( *(byte*)b==0xff ) return fails(b, no); // failure: show server error text
+            if( *(byte*)b==0x00 ) {
+                ++p; lenenc(p); lenenc(p); // affected rows, last insert id
+                int status = this->status = *(byte*)p | ( *(byte*)(p+1) << 8 );
+                if( tracking ) tracks( b, b + no );
+                if( status & SERVER_MORE_RESULTS_EXISTS ) continue;
+                break; // success
+            }
+            fields = field = (int)lenenc(p);
+            count( &tally::results );
+
+            // same query shape as before: reuse its columns as long as every definition hashes the same
+            auto found = print ? schemas.find( print + sets ) : schemas.end();
+            fresh = found == schemas.end() || found->second->columns.size() != size_t(fields);
+            if( fresh ) {
+                shape = std::make_shared<sq::schema>();
+                shape->columns.resize( fields );
+                shape->digests.resize( fields );
+            }
+            else shape = found->second;
+
+            if( sets++ && out ) out->next();
+            exit = 0;
+            continue;
+        }
+
+        // 2. Second info we get are field infos like name type etc. One field per Receive/Packet
+        if( field ) {
+            i = fields - field;
+            unsigned long long digest = fnv( b, no );
+            if( !fresh && shape->digests[i] != digest ) // schema changed under the same query: copy on write
+                shape = std::make_shared<sq::schema>( *shape ), fresh = true;
+
+            sq::schema::column &c = shape->columns[i];
+            if( fresh ) {
+                std::string *text[] = { 0, &c.db, &c.table, &c.org_table, &c.name, &c.org_name }; // catalog is always "def"
+                for( std::string *t : text ) {
+                    size_t len = lenenc(p);
+                    if( t ) t->assign( p, len );
+                    p += len;
+                }
+                lenenc(p); // length of fixed fields
+                c.charset  = *(dword*)p; p+=2;
+                c.length   = *(unsigned*)p; p+=4;
+                c.type     = *(byte*)p; p+=1;
+                c.flags    = *(dword*)p; p+=2;
+                c.decimals = *(byte*)p;
+                shape->digests[i] = digest;
+            }
+
+            if(!--field) value = fields;
+            if( out ) out->field( i, c.name.c_str(), c.type, c.charset );
+            continue;
+        }
+
+        // 3. 5. after receiving last field info, and after the last row, we get an EOF marker
+        if (*(byte*)b==0xfe && no < 9)
+        {
+            if( !exit++ ) { // end of field infos
+                if( fresh ) {
+                    shape->index();
+                    if( print ) {
+                        if( schemas.size() >= 4096 ) schemas.clear();
+                        schemas[ print + sets - 1 ] = shape;
+                    }
+                }
+                cols = shape->columns.data();
+                if( out ) out->columns( *shape );
+                continue;
+            }
+            int status = no >= 5 ? this->status = *(byte*)(b+3) | ( *(byte*)(b+4) << 8 ) : 0;
+            if( !(status & SERVER_MORE_RESULTS_EXISTS) ) break; // end of rows
+            fields = 0;
+            continue;
+        }
+        if( *(byte*)b==0xff ) return fails(b, no); // error amid rows
+
+        // 4. after receiving all field infos we receive row field values. One row per Receive/Packet
+        while( value  ) {
+            i=fields-value;
+            bool null = *(byte*)p == 251;
+            size_t len = lenenc(p);
+
+            // terminate in place: borrow the next length byte (or the buffer slack byte) and restore it
+            char next=p[len]; p[len]=0;
+            if( out ) out->value( i, null ? 0 : p, len, cols[i].type );
+            p[len]=next;
+
+            p+=len;
+            if(!--value) { row++; value=fields; count( &tally::rows ); if( out ) out->row(); break; }
+        }
+    }
+
+    if( out ) out->done();
+    return true;
+}
+
+namespace
+{
+    // exec() grid: every cell is packed back to back into the connection arena, NUL terminated.
+    // offsets rather than pointers, since the arena may move while growing. only the first result set is kept.
+    // past the spill threshold, cells and offsets move on to unlinked temp files in 1MB batches, mapped back at the end.
+    // there is no mapping on windows, so grids always stay in memory there.
+    struct local : public sq::writer {
+        int x, y, sets;
+        std::vector< char > &arena;
+        std::vector< size_t > &offsets;
+        size_t threshold, base;                 // base: bytes already spilled
+        FILE *data, *index;
+        bool failed;
+
+        local( std::vector< char > &arena, std::vector< size_t > &offsets, size_t threshold = 0 ) :
+            x(0), y(0), sets(0), arena(arena), offsets(offsets), threshold( $windows(0) $welse(threshold) ), base(0), data(0), index(0), failed(false) {
+            arena.clear();
+            offsets.clear();
+        }
+
+        ~local() {
+            if( data ) fclose( data );
+            if( index ) fclose( index );
+        }
+
+        void clear() {
+            if( data ) fclose( data ), data = 0;
+            if( index ) fclose( index ), index = 0;
+            x = y = sets = 0, base = 0, failed = false;
+            arena.clear();
+            offsets.clear();
+        }
+
+        void push( const char *txt, size_t len ) {
+            offsets.push_back( base + arena.size() );
+            arena.insert( arena.end(), txt, txt + len );
+            arena.push_back( '\0' );
+            if( threshold && arena.size() >= ( data ? 1 << 20 : threshold ) )
+                spills();
+        }
+
+        void spills() {
+            if( !data ) {
+                data = tmpfile();
+                index = data ? tmpfile() : 0;
+                if( !index ) { // no room for temp files: keep going in memory
+                    if( data ) fclose( data ), data = 0;
+                    threshold = 0;
+                    return;
+                }
+            }
+            failed |= fwrite( arena.data(), 1, arena.size(), data ) != arena.size();
+            failed |= fwrite( offsets.data(), sizeof(size_t), offsets.size(), index ) != offsets.size();
+            base += arena.size();
+            arena.clear();
+            offsets.clear();
+        }
+
+        void field( int /*col*/, const char *name, int /*type*/, int /*charset*/ ) {
+            if( sets ) return;
+            x++;
+            y++;
+            push( name, strlen(name) );
+        }
+        void value( int /*col*/, const char *data, size_t len, int /*type*/ ) {
+            if( sets ) return;
+            y++;
+            push( data ? data : "", data ? len : 0 );
+        }
+        void next() {
+            sets++;
+        }
+    };
+}
+
+bool sq::light::test( const std::string &query, double timeout )
+{
+    if( !connected )
+        return false;
+
+    hold lock( *this );
+
+    for( unsigned attempt = 1; !tests( query, timeout ); ++attempt )
+        if( !retries( query, attempt ) )
+            return false;
+    return true;
+}
+
+bool sq::light::tests( const std::string &query, double timeout )
+{
+    failure.clear();
+    if( redundant( query ) )
+        return true;
+    no = 20;
+    ret = 0;
+    print = fingerprint( query );
+
+    arm( timeout > 0 ? timeout : limits.send );
+
+    if( !query.empty() )
+        if( open() ) // setup
+            if( sends(query) ) { // send
+                if( timeout <= 0 ) arm( limits.recv );
+                if( recvs(0) ) // recv and parse
+                    return remember( query ), TRACE( TRACE_DONE, query.data(), query.size() ), true;
+            }
+
+    if( expired )
+        kill(), disconnects();
+
+    TRACE( TRACE_FAILED, query.data(), query.size() );
+    return false;
+}
+
+namespace {
+    // sq::metrics label of a query: its second word, ie, the column list or table of most statements
+    std::string metric_index( const std::string &sqlcode ) {
+        auto tokens = tokenize(sqlcode," (");
+        return tokens.size() > 1 ? tokens.at(1) : std::string();
+    }
+}
+
+bool sq::light::execs( const std::string &query, sq::writer *out, double timeout, size_t framed )
+{
+    sq::metrics metrics(metric_index(query));
+    unsigned long before = syscalls;
+    print = fingerprint( query );
+    failure.clear();
+
+    // USE and SET that would change nothing never leave the client
+    if( redundant( query ) ) {
+        metrics.cancel();
+        if( out ) out->done();
+        return true;
+    }
+
+        no = 20;
+        ret = 0;
+
+        arm( timeout > 0 ? timeout : limits.send );
+
+        // framed: payload of a COM_QUERY already bound into the send buffer, see frame()
+        if( framed ) {
+            *(int*)b = int(framed), last = std::chrono::steady_clock::now();
+            count( &tally::queries );
+            TRACE( TRACE_QUERY, b + 5, framed - 1 );
+        }
+
+        if( !query.empty() )
+            if( open() ) // setup
+                if( framed ? sendall( b, 4 + framed ) || fail( "server has gone away", 0, CR_SERVER_GONE_ERROR ) : sends(query) ) { // send
+                    if( timeout <= 0 ) arm( limits.recv );
+                    if( recvs( out ) ) { // recv and parse
+                        metrics.syscalls( syscalls - before );
+                        remember( query );
+                        TRACE( TRACE_DONE, query.data(), query.size() );
+                        return true;
+                    }
+                }
+
+    if( expired )
+        kill(), disconnects();
+
+    metrics.cancel();
+    TRACE( TRACE_FAILED, query.data(), query.size() );
+    return false;
+}
+
+bool sq::light::exec( const std::string &query, sq::light::callback3 cb3, void *userdata, double timeout )
+{
+    return grids( query, cb3, 0, userdata, timeout );
+}
+
+bool sq::light::exec( const std::string &query, sq::light::callback4 cb4, void *userdata, double timeout )
+{
+    return grids( query, 0, cb4, userdata, timeout );
+}
+
+namespace {
+    bool mapped( local &l, sq::light::callback3 cb3, sq::light::callback4 cb4, void *userdata ) {
+        // spilled grid: cells mapped back read-only; offsets file grows a lengths half and its offsets become
+        // pointers in place. both are file backed, so the kernel can page them out instead of growing RSS.
+        $windows(
+            return false; // unreachable: local never spills on windows
+        )
+        $welse(
+            static_assert( sizeof(size_t) == sizeof(const char *), "offsets are turned into pointers in place" );
+            l.spills();
+            size_t n = l.y;
+            if( l.failed || fflush( l.data ) || fflush( l.index ) || ftruncate( fileno( l.index ), 2 * n * sizeof(size_t) ) )
+                return false;
+            void *cells = mmap( 0, l.base, PROT_READ, MAP_PRIVATE, fileno( l.data ), 0 );
+            void *index = mmap( 0, 2 * n * sizeof(size_t), PROT_READ | PROT_WRITE, MAP_SHARED, fileno( l.index ), 0 );
+            if( cells != MAP_FAILED && index != MAP_FAILED ) {
+                size_t *offsets = (size_t *)index, *lens = offsets + n;
+                for( size_t i = 0; i < n; ++i )
+                    lens[i] = ( i + 1 < n ? offsets[i+1] : l.base ) - offsets[i] - 1;
+                for( size_t i = 0; i < n; ++i ) {
+                    const char *cell = (const char *)cells + offsets[i];
+                    memcpy( &offsets[i], &cell, sizeof(cell) );
+                }
+                if( cb4 ) (*cb4)( userdata, l.x, l.y / l.x, (const char **)index, lens );
+                else      (*cb3)( userdata, l.x, l.y / l.x, (const char **)index );
+            }
+            if( cells != MAP_FAILED ) munmap( cells, l.base );
+            if( index != MAP_FAILED ) munmap( index, 2 * n * sizeof(size_t) );
+            return cells != MAP_FAILED && index != MAP_FAILED;
+        )
+    }
+}
+
+bool sq::light::grids( const std::string &query, callback3 cb3, callback4 cb4, void *userdata, double timeout )
+{
+    if( !connected )
+        return false;
+
+    hold lock( *this );
+
+    local l( arena, offsets, spill );
+    for( unsigned attempt = 1; !execs( query, &l, timeout ); ++attempt ) {
+        if( !retries( query, attempt ) )
+            return false;
+        l.clear();
+    }
+
+    if( l.data ) {
+        if( !mapped( l, cb3, cb4, userdata ) )
+            return fail( "spill failed" );
+    }
+    else if( l.x > 0 ) {
+        // cells are NUL terminated in the arena, so each length is the distance to the next cell minus one
+        offsets.push_back( arena.size() );
+        cells.resize( offsets.size() - 1 );
+        lengths.resize( offsets.size() - 1 );
+        for( size_t n = 0, end = offsets.size() - 1; n < end; ++n )
+            cells[n] = arena.data() + offsets[n], lengths[n] = offsets[n+1] - offsets[n] - 1;
+        if( cb4 ) (*cb4)( userdata, l.x, l.y / l.x, cells.data(), lengths.data() );
+        else      (*cb3)( userdata, l.x, l.y / l.x, cells.data() );
+    }
+
+    // keep the arena for next queries, unless a huge result left it oversized
+    if( arena.capacity() > (1 << 24) )
+        std::vector< char >().swap( arena ), std::vector< size_t >().swap( offsets ),
+        std::vector< const char * >().swap( cells ), std::vector< size_t >().swap( lengths );
+
+    return true;
+}
+
+bool sq::light::exec( const std::string &query, sq::writer &out, double timeout )
+{
+    if( !connected )
+        return false;
+
+    hold lock( *this );
+
+    return execs( query, &out, timeout );
+}
+
+namespace {
+    bool writes( int fd, const char *data, size_t len ) {
+        while( len ) {
+            auto n = WRITE( fd, data, len );
+            if( n <= 0 && !( n < 0 && errno == EINTR ) )
+                return false;
+            if( n > 0 )
+                data += n, len -= n;
+        }
+        return true;
+    }
+}
+
+bool sq::light::blob( const std::string &query, int fd, double timeout )
+{
+    if( !connected )
+        return false;
+
+    hold lock( *this );
+
+    failure.clear();
+    no = 20;
+    ret = 0;
+
+    arm( timeout > 0 ? timeout : limits.send );
+
+    bool ok = false;
+    if( !query.empty() && open() && sends(query) ) {
+        if( timeout <= 0 ) arm( limits.recv );
+        ok = blobs( fd );
+    }
+
+    if( expired )
+        kill(), disconnects();
+
+    TRACE( ok ? TRACE_DONE : TRACE_FAILED, query.data(), query.size() );
+    return ok;
+}
+
+bool sq::light::blobs( int fd )
+{
+    // like recvs(), but rows are never read whole: the first value of every row goes out while it arrives
+    enum { SERVER_MORE_RESULTS_EXISTS = 0x0008 };
+
+    shape.reset();
+
+    char *p = packet(no);
+    if( !p ) return connected = false, fail(expired ? "timeout" : "connection lost", 0, CR_SERVER_LOST);
+    if( (byte)*p == 0xff ) return fails(p, no);
+    if( *p == 0x00 ) { // no result set, but maybe session changes or more results (ie, CALL) all the same
+        char *b = p++;
+        lenenc(p); lenenc(p); // affected rows, last insert id
+        int status = this->status = *(byte*)p | ( *(byte*)(p+1) << 8 );
+        if( tracking ) tracks( b, b + no );
+        return status & SERVER_MORE_RESULTS_EXISTS ? recvs(0) : true;
+    }
+    count( &tally::results );
+
+    do p = packet(no); // column definitions, up to their EOF
+    while( p && !( (byte)*p == 0xfe && no < 9 ) );
+    if( !p ) return connected = false, fail(expired ? "timeout" : "connection lost", 0, CR_SERVER_LOST);
+
+    for( bool written = true;; ) {
+        unsigned part;
+        if( !fill(4) ) return connected = false, fail(expired ? "timeout" : "connection lost", 0, CR_SERVER_LOST);
+        memcpy( &part, rx.data() + head, 4 );
+        part &= 0xffffff;
+        if( !fill(4 + std::min(part, 9u)) ) return connected = false, fail(expired ? "timeout" : "connection lost", 0, CR_SERVER_LOST);
+
+        byte first = rx[head + 4];
+        if( ( first == 0xfe && part < 9 ) || first == 0xff ) {
+            p = packet(no);
+            if( first == 0xff ) return fails(p, no); // error amid rows
+            int status = no >= 5 ? this->status = *(byte*)(p+3) | ( *(byte*)(p+4) << 8 ) : 0;
+            if( status & SERVER_MORE_RESULTS_EXISTS ) // only the first result set is streamed
+                return recvs(0) && written;
+            return written;
+        }
+
+        // value header, then the value itself across as many 16MB packets as it takes
+        head += 4;
+        char *q = rx.data() + head;
+        size_t want = first == 251 ? ( ++q, 0 ) : lenenc(q), left = part - ( q - ( rx.data() + head ) );
+        head = q - rx.data();
+        for( ;; ) {
+            size_t n = std::min( want, left );
+            if( !drains( fd, n, written ) ) return connected = false, fail(expired ? "timeout" : "connection lost", 0, CR_SERVER_LOST);
+            want -= n, left -= n;
+            if( !want ) break;
+            if( part != 0xffffff || !fill(4) ) return connected = false, fail("malformed row", 0, CR_MALFORMED_PACKET);
+            memcpy( &part, rx.data() + head, 4 );
+            head += 4, left = part &= 0xffffff;
+        }
+
+        // rest of the row (other columns) is skipped
+        for( ;; ) {
+            if( !drains( -1, left, written ) ) return connected = false, fail(expired ? "timeout" : "connection lost", 0, CR_SERVER_LOST);
+            if( part != 0xffffff ) break;
+            if( !fill(4) ) return connected = false, fail(expired ? "timeout" : "connection lost", 0, CR_SERVER_LOST);
+            memcpy( &part, rx.data() + head, 4 );
+            head += 4, left = part &= 0xffffff;
+        }
+        count( &tally::packets_received );
+        count( &tally::rows );
+    }
+}
+
+bool sq::light::drains( int fd, size_t count, bool &written )
+{
+    // move count bytes of the incoming stream into fd (or nowhere, if fd < 0). written turns false
+    // once fd fails, but the stream is still consumed so the connection stays in step.
+    size_t n = std::min( count, tail - head );
+    if( n && fd >= 0 && written )
+        written = writes( fd, rx.data() + head, n );
+    head += n, count -= n;
+
+#ifdef SQLIGHT_SPLICE
+    // rest goes socket -> pipe -> fd in kernel space, never through the read-ahead buffer
+    int pipes[2];
+    if( count && fd >= 0 && written && pipe( pipes ) == 0 ) {
+        while( count && written ) {
+            ssize_t in = splice( s, 0, pipes[1], 0, count, SPLICE_F_MOVE | SPLICE_F_NONBLOCK );
+            ++syscalls;
+            if( in < 0 && ( INTR() || ( AGAIN() && wait(false) ) ) )
+                continue;
+            if( in < 0 && errno == EINVAL ) // socket cannot be spliced from: copy through user space below
+                break;
+            if( in <= 0 ) {
+                CLOSE( pipes[0] ), CLOSE( pipes[1] );
+                return false;
+            }
+            count -= in;
+            this->count( &tally::bytes_received, in );
+            while( in > 0 && written ) {
+                ssize_t out = splice( pipes[0], 0, fd, 0, in, SPLICE_F_MOVE );
+                if( out > 0 ) in -= out;
+                else if( out < 0 && errno == EINVAL ) { // fd cannot be spliced into (ie, O_APPEND files)
+                    char chunk[4096];
+                    out = READ( pipes[0], chunk, std::min<size_t>( in, sizeof(chunk) ) );
+                    if( out > 0 ) written = writes( fd, chunk, out ), in -= out;
+                    else written = false;
+                }
+                else if( !( out < 0 && INTR() ) ) written = false;
+            }
+        }
+        CLOSE( pipes[0] ), CLOSE( pipes[1] );
+    }
+#endif
+
+    while( count ) {
+        if( !fill(1) )
+            return false;
+        n = std::min( count, tail - head );
+        if( fd >= 0 && written )
+            written = writes( fd, rx.data() + head, n );
+        head += n, count -= n;
+    }
+    return true;
+}
+
+std::future<bool> sq::light::submit( const std::string &query, sq::writer *out, double timeout )
+{
+    std::future<bool> result = enqueue( query, out, timeout );
+    drain();
+    return result;
+}
+
+std::vector< std::future<bool> > sq::light::submit( const std::vector<std::string> &queries, sq::writer *out, double timeout )
+{
+    // the whole chain is linked first and pushed with one swap, so no other submitter can split it across batches
+    std::vector< std::future<bool> > results;
+    job *first = 0, *last = 0;
+    for( auto &query : queries ) {
+        if( !connected || query.empty() ) {
+            std::promise<bool> none;
+            none.set_value( false );
+            results.push_back( none.get_future() );
+            continue;
+        }
+        job *j = new job;
+        j->query = query, j->out = out, j->timeout = timeout;
+        results.push_back( j->done.get_future() );
+        j->next = last, last = j;                   // newest on top, as single pushes leave it
+        if( !first ) first = j;
+    }
+    if( !last )
+        return results;
+
+    first->next = inbox.load( std::memory_order_relaxed );
+    while( !inbox.compare_exchange_weak( first->next, last, std::memory_order_release, std::memory_order_relaxed ) )
+        ;
+
+    drain();
+    return results;
+}
+
+std::future<bool> sq::light::enqueue( const std::string &query, sq::writer *out, double timeout )
+{
+    // lock-free submission: push onto the inbox. the caller then waits for the connection unless another submitter took the job
+    if( !connected || query.empty() ) {
+        std::promise<bool> none;
+        none.set_value( false );
+        return none.get_future();
+    }
+
+    job *j = new job;
+    j->query = query, j->out = out, j->timeout = timeout;
+    std::future<bool> result = j->done.get_future();
+
+    j->next = inbox.load( std::memory_order_relaxed );
+    while( !inbox.compare_exchange_weak( j->next, j, std::memory_order_release, std::memory_order_relaxed ) )
+        ;
+    return result;
+}
+
+void sq::light::drain()
+{
+    // flat combining: submitters queue for the connection, and the first one through sends everybody's queries
+    // in one batch. an empty inbox means some lock holder took ours, and answers it before unlocking.
+    // only submit() drains, so writers never run on threads that did not submit anything.
+    if( !inbox.load( std::memory_order_acquire ) )
+        return;
+    std::lock_guard<std::mutex> lock( mutex );
+    job *batch = inbox.exchange( 0, std::memory_order_acquire ), *fifo = 0;
+    while( batch ) {
+        job *n = batch->next;
+        batch->next = fifo, fifo = batch;
+        batch = n;
+    }
+    if( fifo )
+        pipeline( fifo );
+}
+
+void sq::light::pipeline( job *fifo )
+{
+    // every COM_QUERY goes out in one write, then responses are read back in order:
+    // one round trip for the whole batch instead of one per query.
+    // leading USE/SET the session already matches are answered right away, as tests() would. past the first
+    // query that goes out the state is unknown until its response, so the rest of the batch is sent as is
+    while( fifo && connected && redundant( fifo->query ) ) {
+        job *j = fifo;
+        fifo = j->next;
+        TRACE( TRACE_DONE, j->query.data(), j->query.size() );
+        j->done.set_value( true );
+        delete j;
+    }
+    if( !fifo )
+        return;
+
+    size_t total = 0;
+    for( job *j = fifo; j; j = j->next )
+        total += 5 + j->query.size();
+    if( buf.size() < total + 1 )
+        buf.resize( total + 1 );
+    b = d = buf.data();
+    for( job *j = fifo; j; j = j->next ) {
+        unsigned len = unsigned( j->query.size() + 1 ); // sequence id 0 in the top byte
+        memcpy( d, &len, 4 );
+        d[4] = 0x3;
+        memcpy( d + 5, j->query.data(), j->query.size() );
+        d += 5 + j->query.size();
+        count( &tally::queries );
+        TRACE( TRACE_QUERY, j->query.data(), j->query.size() );
+    }
+
+    last = std::chrono::steady_clock::now();
+    arm( limits.send );
+    failure.clear();
+    bool alive = connected && open() && ( sendall( b, total ) || fail( "server has gone away", 0, CR_SERVER_GONE_ERROR ) );
+
+    // responses are timed as exec() times its queries, from the moment each one is awaited
+    job *again = 0, **tail = &again;
+    while( fifo ) {
+        job *j = fifo;
+        fifo = j->next;
+        bool ok = false;
+        sq::metrics metrics( metric_index( j->query ) );
+        unsigned long before = syscalls;
+        if( alive ) {
+            arm( j->timeout > 0 ? j->timeout : limits.recv );
+            print = fingerprint( j->query );
+            ok = recvs( j->out );
+            if( ok ) remember( j->query ), metrics.syscalls( syscalls - before );
+            if( !ok && !connected ) { // server errors keep the stream in step; timeouts and lost connections do not
+                if( expired ) kill();
+                disconnects();
+                alive = false;
+            }
+        }
+        else fail( "server has gone away", 0, CR_SERVER_GONE_ERROR );
+        if( !ok ) {
+            metrics.cancel();
+            if( !j->out && failure.retryable() && !failure.timeout ) { // retried below, once the whole batch is read
+                j->failure = failure, j->next = 0;
+                *tail = j, tail = &j->next;
+                continue;
+            }
+        }
+        TRACE( ok ? TRACE_DONE : TRACE_FAILED, j->query.data(), j->query.size() );
+        j->done.set_value( ok );
+        delete j;
+    }
+
+    // the same retries test() makes: reads outside transactions, reconnecting first if the connection was lost
+    while( again ) {
+        job *j = again;
+        again = j->next;
+        bool ok = false;
+        failure = j->failure;
+        for( unsigned attempt = 1; !ok && retries( j->query, attempt ); ++attempt )
+            ok = execs( j->query, 0, j->timeout );
+        TRACE( ok ? TRACE_DONE : TRACE_FAILED, j->query.data(), j->query.size() );
+        j->done.set_value( ok );
+        delete j;
+    }
+}
+
+namespace {
+    std::string escape( const std::string &text )  {
+        std::string out;
+        for( auto &it : text ) {
+            /**/ if( it == '\\' ) out += "\\\\";
+            else if( it == '\r' ) out += "\\r";
+            else if( it == '\n' ) out += "\\n";
+            else if( it == '\t' ) out += "\\t";
+            else if( it == '\f' ) out += "\\f";
+            else if( it == '\b' ) out += "\\b";
+            else if( it ==  '"' ) out += "\\\"";
+            else if( (unsigned char)it < 0x20 ) { char u[8]; snprintf( u, sizeof(u), "\\u%04x", it ); out += u; }
+            else                  out += it;
+        }
+        return out;
+    }
+    void OnJSONLenCb( void *userdata, int w, int h, const char **map, const size_t *lens ) {
+        std::string &array = *((std::string*)userdata);
+        const char **field = &map[0];
+        const char **value = &map[w];
+        const size_t *len = lens ? &lens[w] : 0;
+        for( int y = 1; y < h; ++y ) {
+            array += "{\n";
+            for( int x = 0; x < w; ++x ) {
+                array += "\"" + escape(std::string(*field++)) + "\": ";
+                array += "\"" + escape(len ? std::string(*value++, *len++) : std::string(*value++)) + "\",\n";
+            }
+            if( w > 0 ) array[array.size()-2] = ' ';
+            array += "},\n";
+
+            field = map;
+        }
+        if( h > 0 && array.size() >= 2 ) array[array.size()-2] = ' ';
+        array = "[\n" + array + "]\n";
+    }
+    void OnJSONCb( void *userdata, int w, int h, const char **map ) {
+        OnJSONLenCb( userdata, w, h, map, 0 );
+    }
+}
+
+bool sq::light::json( const std::string &query, std::string &result, double timeout ) {
+    result = std::string();
+    bool ok = exec(query,OnJSONLenCb,(void *)&result,timeout);
+    if( !ok )
+        result = std::string();
+    return ok;
+}
+
+std::string sq::light::json( const std::string &query, double timeout ) {
+    std::string result;
+    return json(query,result,timeout) ? result : std::string();
+}
+
+bool sq::light::json( const std::string &query, std::string &result, const json_options &options, double timeout ) {
+    // typed output is streamed straight from the packets: no grid, no per-cell copies
+    result = std::string();
+    bool ok;
+    {
+        sq::buffer_sink sink( result );
+        sq::json_writer writer( sink, options );
+        ok = exec(query,writer,timeout);
+    }
+    if( !ok )
+        result = std::string();
+    return ok;
+}
+
+std::string sq::light::json( const std::string &query, const json_options &options, double timeout ) {
+    std::string result;
+    return json(query,result,options,timeout) ? result : std::string();
+}
+
+namespace {
+
+    // replica lag: first cell, unless the lag query is SHOW SLAVE/REPLICA STATUS. empty (NULL) means not replicating
+    void OnLagCb( void *userdata, int w, int h, const char **map ) {
+        double &lag = *((double*)userdata);
+        int col = 0;
+        for( int i = 0; i < w; ++i )
+            if( !strcmp(map[i], "Seconds_Behind_Master") || !strcmp(map[i], "Seconds_Behind_Source") )
+                col = i;
+        lag = h > 1 && map[w+col][0] ? strtod(map[w+col], 0) : HUGE_VAL;
+    }
+
+    // skips blanks and leading comments; a /*primary*/ or /*replica*/ comment is a routing hint
+    const char *skip_comments( const char *p, int &hint ) {
+        for( ;; ) {
+            while( *p && isspace((unsigned char)*p) ) ++p;
+            if( p[0] == '/' && p[1] == '*' ) {
+                const char *end = strstr(p+2, "*/");
+                std::string word;
+                for( const char *c = p+2; c < (end ? end : p+2); ++c )
+                    if( !isspace((unsigned char)*c) ) word += (char)tolower((unsigned char)*c);
+                if( word == "primary" || word == "master" ) hint = +1;
+                if( word == "replica" || word == "slave" ) hint = -1;
+                p = end ? end + 2 : p + strlen(p);
+            }
+            else if( (p[0] == '-' && p[1] == '-') || p[0] == '#' ) {
+                while( *p && *p != '\n' ) ++p;
+            }
+            else return p;
+        }
+    }
+
+    std::string upper( const char *p ) {
+        std::string out( p );
+        for( auto &ch : out ) ch = (char)toupper((unsigned char)ch);
+        return out;
+    }
+
+    // code tokens of a statement, upper-cased and space separated: words, then punctuation one char each.
+    // string literals, backquoted identifiers and comments shrink to a bare quote, so nothing inside them
+    // can pass for a keyword. /*! executable comments */ are code to the server, so they stay.
+    std::string lex( const char *p ) {
+        std::string out = " ";
+        while( *p ) {
+            if( isspace((unsigned char)*p) ) { ++p; continue; }
+            if( p[0] == '/' && p[1] == '*' && p[2] == '!' ) {
+                for( p += 3; isdigit((unsigned char)*p); ) ++p;
+                continue;
+            }
+            if( p[0] == '/' && p[1] == '*' ) {
+                const char *end = strstr(p+2, "*/");
+                p = end ? end + 2 : p + strlen(p);
+                continue;
+            }
+            if( (p[0] == '-' && p[1] == '-' && (!p[2] || isspace((unsigned char)p[2]))) || p[0] == '#' ) {
+                while( *p && *p != '\n' ) ++p;
+                continue;
+            }
+            if( *p == '\'' || *p == '"' || *p == '`' ) {
+                // quote doubled or (not in identifiers) backslash escaped
+                char quote = *p++;
+                for( ; *p; ++p ) {
+                    if( *p == '\\' && quote != '`' && p[1] ) ++p;
+                    else if( *p == quote && p[1] == quote ) ++p;
+                    else if( *p == quote ) { ++p; break; }
+                }
+                out += quote == '`' ? "` " : "' ";
+                continue;
+            }
+            if( isalnum((unsigned char)*p) || *p == '_' || *p == '$' ) {
+                while( isalnum((unsigned char)*p) || *p == '_' || *p == '$' )
+                    out += (char)toupper((unsigned char)*p++);
+            }
+            else out += *p++;
+            out += ' ';
+        }
+        return out;
+    }
+}
+
+namespace {
+
+    enum {
+        COM_STMT_PREPARE = 0x16, COM_STMT_EXECUTE = 0x17, COM_STMT_CLOSE = 0x19, COM_STMT_FETCH = 0x1c,
+        CURSOR_TYPE_READ_ONLY = 1,
+        SERVER_STATUS_CURSOR_EXISTS = 0x0040, SERVER_STATUS_LAST_ROW_SENT = 0x0080,
+        UNSIGNED_FLAG = 32
+    };
+
+    // shortest text that reads back as the same double, as the text protocol would print it
+    void shortest( char *text, double value ) {
+        for( int digits = 15; digits <= 17; ++digits ) {
+            sprintf( text, "%.*g", digits, value );
+            if( strtod( text, 0 ) == value )
+                return;
+        }
+    }
+
+    // binary protocol value -> text protocol form, so writers see the same text either way.
+    // returns the value length; text is either the scratch buffer or points into the packet.
+    size_t binary_value( const char *&p, int type, int flags, int decimals, char *scratch, const char *&text ) {
+        bool sign = !( flags & UNSIGNED_FLAG );
+        text = scratch;
+        switch( type ) {
+            case sq::light::FIELD_TYPE_TINY: {
+                long long v = sign ? (long long)(signed char)p[0] : (long long)(unsigned char)p[0]; p += 1;
+                return sprintf( scratch, "%lld", v );
+            }
+            case sq::light::FIELD_TYPE_SHORT:
+            case sq::light::FIELD_TYPE_YEAR: {
+                short v; memcpy( &v, p, 2 ); p += 2;
+                return sprintf( scratch, "%lld", sign ? (long long)v : (long long)(unsigned short)v );
+            }
+            case sq::light::FIELD_TYPE_INT24:
+            case sq::light::FIELD_TYPE_LONG: {
+                int v; memcpy( &v, p, 4 ); p += 4;
+                return sprintf( scratch, "%lld", sign ? (long long)v : (long long)(unsigned)v );
+            }
+            case sq::light::FIELD_TYPE_LONGLONG: {
+                long long v; memcpy( &v, p, 8 ); p += 8;
+                return sign ? sprintf( scratch, "%lld", v ) : sprintf( scratch, "%llu", (unsigned long long)v );
+            }
+            case sq::light::FIELD_TYPE_FLOAT: {
+                float v; memcpy( &v, p, 4 ); p += 4;
+                return sprintf( scratch, "%.7g", v );
+            }
+            case sq::light::FIELD_TYPE_DOUBLE: {
+                double v; memcpy( &v, p, 8 ); p += 8;
+                shortest( scratch, v );
+                return strlen( scratch );
+            }
+            case sq::light::FIELD_TYPE_DATE:
+            case sq::light::FIELD_TYPE_NEWDATE:
+            case sq::light::FIELD_TYPE_DATETIME:
+            case sq::light::FIELD_TYPE_TIMESTAMP: {
+                // length, then year(2) month day [hour minute second [microseconds(4)]]
+                unsigned char n = *(const unsigned char *)p++, t[7] = {0}; unsigned short year = 0; unsigned micro = 0;
+                if( n >= 4 ) memcpy( &year, p, 2 ), t[1] = p[2], t[2] = p[3];
+                if( n >= 7 ) t[3] = p[4], t[4] = p[5], t[5] = p[6];
+                if( n >= 11 ) memcpy( &micro, p + 7, 4 );
+                p += n;
+                size_t len = sprintf( scratch, "%04u-%02u-%02u", year, t[1], t[2] );
+                if( type == sq::light::FIELD_TYPE_DATE || type == sq::light::FIELD_TYPE_NEWDATE )
+                    return len;
+                len += sprintf( scratch + len, " %02u:%02u:%02u", t[3], t[4], t[5] );
+                if( decimals > 0 && decimals <= 6 )
+                    len += sprintf( scratch + len, ".%06u", micro ) - ( 6 - decimals );
+                scratch[len] = 0;
+                return len;
+            }
+            case sq::light::FIELD_TYPE_TIME: {
+                // length, then negative days(4) hour minute second [microseconds(4)]
+                unsigned char n = *(const unsigned char *)p++; unsigned days = 0, micro = 0; unsigned char neg = 0, h = 0, m = 0, sec = 0;
+                if( n >= 8 ) neg = p[0], memcpy( &days, p + 1, 4 ), h = p[5], m = p[6], sec = p[7];
+                if( n >= 12 ) memcpy( &micro, p + 8, 4 );
+                p += n;
+                size_t len = sprintf( scratch, "%s%02u:%02u:%02u", neg ? "-" : "", days * 24 + h, m, sec );
+                if( decimals > 0 && decimals <= 6 )
+                    len += sprintf( scratch + len, ".%06u", micro ) - ( 6 - decimals );
+                scratch[len] = 0;
+                return len;
+            }
+            default: {
+                // DECIMAL, strings, blobs, BIT, ENUM, SET, JSON and GEOMETRY come as length encoded strings
+                size_t len = lenenc( p );
+                text = p;
+                p += len;
+                return len;
+            }
+        }
+    }
+}
+
+sq::cursor::cursor( sq::light &conn, unsigned rows ) : conn(conn), rows(rows ? rows : 1), stmt(0), opened(false), exhausted(true), streaming(false), described(false) {
+}
+
+sq::cursor::~cursor() {
+    close();
+}
+
+bool sq::cursor::eof() const {
+    return exhausted;
+}
+
+void sq::cursor::close() {
+    sq::light::hold lock( conn );
+    closes();
+}
+
+void sq::cursor::closes() {
+    // COM_STMT_CLOSE gets no response; it also discards whatever the server still buffers for us
+    if( opened && conn.s ) {
+        conn.arm( conn.limits.send );
+        conn.sends( std::string( (const char *)&stmt, 4 ), COM_STMT_CLOSE );
+    }
+    opened = false;
+    exhausted = true;
+}
+
+bool sq::cursor::broken() {
+    // protocol got out of step (timeout, lost connection): nothing left to resume
+    if( conn.expired )
+        conn.kill();
+    conn.disconnects();
+    opened = false;
+    exhausted = true;
+    return false;
+}
+
+bool sq::cursor::open( const std::string &query, double timeout ) {
+    sq::light::hold lock( conn );
+
+    closes();
+    shape = sq::schema();
+    described = streaming = false;
+
+    if( !conn.connected )
+        return false;
+
+    conn.arm( timeout > 0 ? timeout : conn.limits.send );
+    if( !conn.open() || !conn.sends( query, COM_STMT_PREPARE ) )
+        return broken();
+    if( timeout <= 0 )
+        conn.arm( conn.limits.recv );
+
+    // COM_STMT_PREPARE_OK: status, statement id, columns, params, filler, warnings
+    // [ref] https://dev.mysql.com/doc/dev/mysql-server/latest/page_protocol_com_stmt_prepare.html
+    unsigned len;
+    const char *p = conn.packet( len );
+    if( !p )
+        return broken();
+    if( (unsigned char)p[0] == 0xff )
+        return conn.fails( p, len );
+
+    unsigned short columns = 0, params = 0;
+    memcpy( &stmt, p + 1, 4 );
+    memcpy( &columns, p + 5, 2 );
+    memcpy( &params, p + 7, 2 );
+    opened = true;
+
+    // parameter and column definitions follow, each block EOF terminated. EXECUTE describes columns again
+    for( unsigned n = ( params ? params + 1 : 0 ) + ( columns ? columns + 1 : 0 ); n--; )
+        if( !conn.packet( len ) )
+            return broken();
+    if( params ) {
+        closes();
+        return conn.fail( "cursor queries take no placeholders" );
+    }
+
+    // COM_STMT_EXECUTE: statement id, flags, iteration count (always 1)
+    std::string execute( (const char *)&stmt, 4 );
+    execute += char( CURSOR_TYPE_READ_ONLY );
+    execute.append( "\1\0\0\0", 4 );
+    conn.arm( timeout > 0 ? timeout : conn.limits.send );
+    if( !conn.sends( execute, COM_STMT_EXECUTE ) )
+        return broken();
+    if( timeout <= 0 )
+        conn.arm( conn.limits.recv );
+
+    if( !( p = conn.packet( len ) ) )
+        return broken();
+    if( (unsigned char)p[0] == 0xff )
+        return closes(), conn.fails( p, len );
+    if( p[0] == 0x00 )
+        return true; // no result set to walk through
+
+    shape.columns.resize( lenenc( p ) );
+    for( auto &c : shape.columns ) {
+        // column definition: catalog, schema, table, org_table, name, org_name, 0x0c, charset, length, type, flags, decimals
+        if( !( p = conn.packet( len ) ) )
+            return broken();
+        std::string *text[] = { 0, &c.db, &c.table, &c.org_table, &c.name, &c.org_name };
+        for( std::string *t : text ) {
+            size_t size = lenenc( p );
+            if( t ) t->assign( p, size );
+            p += size;
+        }
+        lenenc( p ); // length of fixed fields
+        unsigned short charset, flag;
+        memcpy( &charset, p, 2 );
+        memcpy( &c.length, p + 2, 4 );
+        memcpy( &flag, p + 7, 2 );
+        c.charset = charset, c.type = (unsigned char)p[6], c.flags = flag, c.decimals = (unsigned char)p[9];
+    }
+    shape.index();
+
+    if( !( p = conn.packet( len ) ) )
+        return broken();
+    int status = len >= 5 ? (unsigned char)p[3] | ( (unsigned char)p[4] << 8 ) : 0;
+
+    // without a cursor (some servers refuse one for certain statements) the rows simply follow
+    streaming = !( status & SERVER_STATUS_CURSOR_EXISTS );
+    exhausted = false;
+    return true;
+}
+
+bool sq::cursor::fetch( sq::writer &out, double timeout ) {
+    sq::light::hold lock( conn );
+
+    if( !opened )
+        return false;
+    if( exhausted )
+        return true;
+
+    conn.arm( timeout > 0 ? timeout : conn.limits.send );
+    if( !streaming ) {
+        // COM_STMT_FETCH: statement id, number of rows
+        std::string fetch( (const char *)&stmt, 4 );
+        fetch.append( (const char *)&rows, 4 );
+        if( !conn.sends( fetch, COM_STMT_FETCH ) )
+            return broken();
+    }
+    if( timeout <= 0 )
+        conn.arm( conn.limits.recv );
+
+    if( !described ) {
+        for( size_t col = 0; col < shape.size(); ++col )
+            out.field( (int)col, shape[col].name.c_str(), shape[col].type, shape[col].charset );
+        out.columns( shape );
+        described = true;
+    }
+
+    // binary rows: 0x00, NULL bitmap (offset by 2 bits), then the non-NULL values back to back
+    // [ref] https://dev.mysql.com/doc/dev/mysql-server/latest/page_protocol_binary_resultset.html
+    int cols = (int)shape.size();
+    const sq::schema::column *defs = shape.columns.data();
+    char scratch[64];
+    for( ;; ) {
+        unsigned len;
+        char *p = conn.packet( len );
+        if( !p )
+            return broken();
+        if( (unsigned char)p[0] == 0xff ) // the statement is of no more use: release it, so a later open() leaks nothing
+            return closes(), conn.fails( p, len );
+        if( (unsigned char)p[0] == 0xfe && len < 9 ) {
+            int status = len >= 5 ? (unsigned char)p[3] | ( (unsigned char)p[4] << 8 ) : 0;
+            if( streaming || ( status & SERVER_STATUS_LAST_ROW_SENT ) || !( status & SERVER_STATUS_CURSOR_EXISTS ) ) {
+                exhausted = true;
+                out.done();
+            }
+            return true;
+        }
+
+        const unsigned char *nulls = (const unsigned char *)p + 1;
+        const char *v = p + 1 + ( cols + 7 + 2 ) / 8;
+        for( int col = 0; col < cols; ++col ) {
+            if( nulls[ (col + 2) / 8 ] & ( 1 << ( (col + 2) % 8 ) ) ) {
+                out.value( col, 0, 0, defs[col].type );
+                continue;
+            }
+            const char *text;
+            size_t size = binary_value( v, defs[col].type, defs[col].flags, defs[col].decimals, scratch, text );
+            if( text != scratch ) {
+                // terminate in place, like the text protocol parser does
+                char *end = (char *)text + size, next = *end;
+                *end = 0;
+                out.value( col, text, size, defs[col].type );
+                *end = next;
+            }
+            else out.value( col, text, size, defs[col].type );
+        }
+        out.row();
+    }
+}
+
+namespace {
+
+    // binlog only types, never seen in result sets
+    enum { TYPE_TIMESTAMP2 = 17, TYPE_DATETIME2 = 18, TYPE_TIME2 = 19, TYPE_JSON = 245 };
+
+    // binlog events we care about
+    // [ref] https://dev.mysql.com/doc/dev/mysql-server/latest/page_protocol_replication_binlog_event.html
+    enum {
+        QUERY_EVENT = 2, ROTATE_EVENT = 4, XID_EVENT = 16, TABLE_MAP_EVENT = 19,
+        WRITE_ROWS_EVENTv1 = 23, UPDATE_ROWS_EVENTv1 = 24, DELETE_ROWS_EVENTv1 = 25,
+        WRITE_ROWS_EVENTv2 = 30, UPDATE_ROWS_EVENTv2 = 31, DELETE_ROWS_EVENTv2 = 32, GTID_EVENT = 33
+    };
+
+    unsigned long long le( const unsigned char *p, int n ) {
+        unsigned long long v = 0;
+        while( n-- ) v = v << 8 | p[n];
+        return v;
+    }
+
+    unsigned long long be( const unsigned char *p, int n ) {
+        unsigned long long v = 0;
+        for( int i = 0; i < n; ++i ) v = v << 8 | p[i];
+        return v;
+    }
+
+    // metadata bytes per column in a TABLE_MAP_EVENT
+    int meta_size( int type ) {
+        switch( type ) {
+            default: return 0;
+            case sq::light::FIELD_TYPE_FLOAT: case sq::light::FIELD_TYPE_DOUBLE: case sq::light::FIELD_TYPE_BLOB:
+            case sq::light::FIELD_TYPE_GEOMETRY: case TYPE_JSON: case TYPE_TIMESTAMP2: case TYPE_DATETIME2: case TYPE_TIME2:
+                return 1;
+            case sq::light::FIELD_TYPE_VARCHAR: case sq::light::FIELD_TYPE_VAR_STRING: case sq::light::FIELD_TYPE_BIT:
+            case sq::light::FIELD_TYPE_NEW_DECIMAL: case sq::light::FIELD_TYPE_STRING: case sq::light::FIELD_TYPE_ENUM:
+            case sq::light::FIELD_TYPE_SET:
+                return 2;
+        }
+    }
+
+    bool numeric( int type ) {
+        switch( type ) {
+            default: return false;
+            case sq::light::FIELD_TYPE_TINY: case sq::light::FIELD_TYPE_SHORT: case sq::light::FIELD_TYPE_INT24:
+            case sq::light::FIELD_TYPE_LONG: case sq::light::FIELD_TYPE_LONGLONG: case sq::light::FIELD_TYPE_FLOAT:
+            case sq::light::FIELD_TYPE_DOUBLE: case sq::light::FIELD_TYPE_NEW_DECIMAL:
+                return true;
+        }
+    }
+
+    // fractional seconds of TIME2/DATETIME2/TIMESTAMP2: (fsp+1)/2 big-endian bytes, scaled to microseconds
+    unsigned fraction( const unsigned char *&p, unsigned fsp ) {
+        unsigned n = ( fsp + 1 ) / 2, v = (unsigned)be( p, n );
+        p += n;
+        return n == 1 ? v * 10000 : n == 2 ? v * 100 : v;
+    }
+
+    size_t micros( char *text, unsigned micro, unsigned fsp ) {
+        if( !fsp || fsp > 6 ) return 0;
+        sprintf( text, ".%06u", micro );
+        return 1 + fsp;
+    }
+
+    // one value of a row image, as text. type comes in as logged and goes out as reported (ie, DATETIME2 -> DATETIME)
+    // returns (size_t)-1 on a malformed image
+    // [ref] https://dev.mysql.com/doc/dev/mysql-server/latest/classbinary__log_1_1Rows__event.html
+    size_t binlog_value( const unsigned char *&p, const unsigned char *end, int &type, unsigned meta, bool sign, char *scratch, const char *&text ) {
+        static const int dig2bytes[10] = { 0, 1, 1, 2, 2, 3, 3, 4, 4, 4 };
+        const size_t bad = (size_t)-1;
+        unsigned m0 = meta & 0xff, m1 = meta >> 8;
+        text = scratch;
+
+        // real type and length of CHAR/ENUM/SET columns hide in their metadata
+        if( type == sq::light::FIELD_TYPE_STRING && m0 >= sq::light::FIELD_TYPE_ENUM && m0 <= sq::light::FIELD_TYPE_SET )
+            type = m0;
+
+        size_t width = 0;
+        switch( type ) {
+            default: return bad;
+            case sq::light::FIELD_TYPE_TINY: case sq::light::FIELD_TYPE_YEAR: width = 1; break;
+            case sq::light::FIELD_TYPE_SHORT: width = 2; break;
+            case sq::light::FIELD_TYPE_INT24: case sq::light::FIELD_TYPE_DATE: case sq::light::FIELD_TYPE_TIME: width = 3; break;
+            case sq::light::FIELD_TYPE_LONG: case sq::light::FIELD_TYPE_FLOAT: case sq::light::FIELD_TYPE_TIMESTAMP: width = 4; break;
+            case sq::light::FIELD_TYPE_LONGLONG: case sq::light::FIELD_TYPE_DOUBLE: case sq::light::FIELD_TYPE_DATETIME: width = 8; break;
+            case TYPE_TIMESTAMP2: width = 4 + ( m0 + 1 ) / 2; break;
+            case TYPE_DATETIME2: width = 5 + ( m0 + 1 ) / 2; break;
+            case TYPE_TIME2: width = 3 + ( m0 + 1 ) / 2; break;
+            case sq::light::FIELD_TYPE_BIT: width = m1 + ( m0 ? 1 : 0 ); break;
+            case sq::light::FIELD_TYPE_ENUM: case sq::light::FIELD_TYPE_SET: width = m1; break;
+            case sq::light::FIELD_TYPE_NEW_DECIMAL: {
+                int intg = int(m0) - int(m1), frac = m1;
+                width = intg / 9 * 4 + dig2bytes[intg % 9] + frac / 9 * 4 + dig2bytes[frac % 9];
+                break;
+            }
+            case sq::light::FIELD_TYPE_VARCHAR: case sq::light::FIELD_TYPE_VAR_STRING: case sq::light::FIELD_TYPE_STRING:
+            case sq::light::FIELD_TYPE_BLOB: case sq::light::FIELD_TYPE_GEOMETRY: case TYPE_JSON: {
+                // length prefix, then the bytes as they are
+                unsigned prefix = type == sq::light::FIELD_TYPE_STRING
+                    ? ( ( ( ( m0 & 0x30 ) ^ 0x30 ) << 4 | m1 ) > 255 ? 2 : 1 )
+                    : type == sq::light::FIELD_TYPE_BLOB || type == sq::light::FIELD_TYPE_GEOMETRY || type == TYPE_JSON ? m0
+                    : meta > 255 ? 2 : 1;
+                if( p + prefix > end ) return bad;
+                size_t len = (size_t)le( p, prefix );
+                p += prefix;
+                if( p + len > end ) return bad;
+                text = (const char *)p, p += len;
+                return len;
+            }
+        }
+        if( p + width > end ) return bad;
+
+        const unsigned char *v = p;
+        p += width;
+        switch( type ) {
+            default:
+            case sq::light::FIELD_TYPE_TINY: case sq::light::FIELD_TYPE_SHORT: case sq::light::FIELD_TYPE_INT24:
+            case sq::light::FIELD_TYPE_LONG: case sq::light::FIELD_TYPE_LONGLONG: {
+                unsigned long long u = le( v, (int)width );
+                if( !sign ) return sprintf( scratch, "%llu", u );
+                int shift = 64 - 8 * (int)width; // sign extend
+                return sprintf( scratch, "%lld", shift ? (long long)( u << shift ) >> shift : (long long)u );
+            }
+            case sq::light::FIELD_TYPE_ENUM: case sq::light::FIELD_TYPE_SET: case sq::light::FIELD_TYPE_BIT:
+                return sprintf( scratch, "%llu", type == sq::light::FIELD_TYPE_BIT ? be( v, (int)width ) : le( v, (int)width ) );
+            case sq::light::FIELD_TYPE_FLOAT: {
+                float f; memcpy( &f, v, 4 );
+                return sprintf( scratch, "%.7g", f );
+            }
+            case sq::light::FIELD_TYPE_DOUBLE: {
+                double d; memcpy( &d, v, 8 );
+                shortest( scratch, d );
+                return strlen( scratch );
+            }
+            case sq::light::FIELD_TYPE_YEAR:
+                return sprintf( scratch, "%04u", v[0] ? 1900 + v[0] : 0 );
+            case sq::light::FIELD_TYPE_DATE: {
+                unsigned d = (unsigned)le( v, 3 );
+                return sprintf( scratch, "%04u-%02u-%02u", d >> 9, ( d >> 5 ) & 15, d & 31 );
+            }
+            case sq::light::FIELD_TYPE_TIME: {
+                unsigned t = (unsigned)le( v, 3 );
+                return sprintf( scratch, "%02u:%02u:%02u", t / 10000, t / 100 % 100, t % 100 );
+            }
+            case sq::light::FIELD_TYPE_DATETIME: {
+                unsigned long long t = le( v, 8 ), d = t / 1000000, s = t % 1000000;
+                return sprintf( scratch, "%04u-%02u-%02u %02u:%02u:%02u", unsigned(d / 10000), unsigned(d / 100 % 100), unsigned(d % 100),
+                    unsigned(s / 10000), unsigned(s / 100 % 100), unsigned(s % 100) );
+            }
+            case sq::light::FIELD_TYPE_TIMESTAMP: case TYPE_TIMESTAMP2: {
+                // seconds since epoch, UTC
+                time_t t = type == TYPE_TIMESTAMP2 ? (time_t)be( v, 4 ) : (time_t)le( v, 4 );
+                const unsigned char *f = v + 4;
+                unsigned micro = type == TYPE_TIMESTAMP2 ? fraction( f, m0 ) : 0;
+                struct tm utc;
+                $windows( gmtime_s( &utc, &t ) ) $welse( gmtime_r( &t, &utc ) );
+                size_t len = strftime( scratch, 32, "%Y-%m-%d %H:%M:%S", &utc );
+                len += micros( scratch + len, micro, type == TYPE_TIMESTAMP2 ? m0 : 0 );
+                type = sq::light::FIELD_TYPE_TIMESTAMP;
+                return len;
+            }
+            case TYPE_DATETIME2: {
+                // sign(1) year*13+month(17) day(5) hour(5) minute(6) second(6)
+                unsigned long long d = be( v, 5 ) - 0x8000000000ULL;
+                const unsigned char *f = v + 5;
+                unsigned micro = fraction( f, m0 ), ym = unsigned( d >> 22 & 0x1ffff );
+                size_t len = sprintf( scratch, "%04u-%02u-%02u %02u:%02u:%02u", ym / 13, ym % 13, unsigned( d >> 17 & 31 ),
+                    unsigned( d >> 12 & 31 ), unsigned( d >> 6 & 63 ), unsigned( d & 63 ) );
+                type = sq::light::FIELD_TYPE_DATETIME;
+                return len + micros( scratch + len, micro, m0 );
+            }
+            case TYPE_TIME2: {
+                // sign(1) unused(1) hour(10) minute(6) second(6), then fraction; negative values are stored offset
+                long long packed;
+                if( m0 >= 5 ) packed = (long long)be( v, 6 ) - 0x800000000000LL;
+                else {
+                    long long intpart = (long long)be( v, 3 ) - 0x800000LL, frac = 0;
+                    if( m0 >= 3 ) { frac = (short)be( v + 3, 2 ); if( intpart < 0 && frac ) ++intpart, frac -= 0x10000; frac *= 100; }
+                    else if( m0 >= 1 ) { frac = (signed char)v[3]; if( intpart < 0 && frac ) ++intpart, frac -= 0x100; frac *= 10000; }
+                    packed = intpart * ( 1LL << 24 ) + frac;
+                }
+                bool negative = packed < 0;
+                unsigned long long a = negative ? 0ULL - (unsigned long long)packed : (unsigned long long)packed, i = a >> 24;
+                size_t len = sprintf( scratch, "%s%02u:%02u:%02u", negative ? "-" : "", unsigned( i >> 12 & 0x3ff ), unsigned( i >> 6 & 63 ), unsigned( i & 63 ) );
+                type = sq::light::FIELD_TYPE_TIME;
+                return len + micros( scratch + len, unsigned( a % ( 1 << 24 ) ), m0 );
+            }
+            case sq::light::FIELD_TYPE_NEW_DECIMAL: {
+                // groups of 9 digits in 4 big-endian bytes, leftovers in fewer; sign bit flipped, negatives one's complemented
+                int intg = int(m0) - int(m1), frac = m1;
+                unsigned char bytes[64];
+                if( width > sizeof(bytes) ) return (size_t)-1;
+                memcpy( bytes, v, width );
+                unsigned mask = ( bytes[0] & 0x80 ) ? 0 : ~0u;
+                bytes[0] ^= 0x80;
+                const unsigned char *b = bytes;
+                auto group = [&]( int digits ) {
+                    int n = dig2bytes[digits];
+                    unsigned x = ( (unsigned)be( b, n ) ^ mask ) & ( n == 4 ? ~0u : ( 1u << ( 8 * n ) ) - 1 );
+                    b += n;
+                    return x;
+                };
+                char *t = scratch + ( mask ? 1 : 0 ), *digits = t;
+                scratch[0] = '-';
+                if( intg % 9 ) t += sprintf( t, "%0*u", intg % 9, group( intg % 9 ) );
+                for( int g = 0; g < intg / 9; ++g ) t += sprintf( t, "%09u", group( 9 ) );
+                char *first = digits;
+                while( first < t && *first == '0' ) ++first;
+                memmove( digits, first, t - first ), t -= first - digits;
+                if( t == digits ) *t++ = '0';
+                bool zero = t == digits + 1 && *digits == '0';
+                if( frac ) {
+                    *t++ = '.';
+                    char *fraction = t;
+                    for( int g = 0; g < frac / 9; ++g ) t += sprintf( t, "%09u", group( 9 ) );
+                    if( frac % 9 ) t += sprintf( t, "%0*u", frac % 9, group( frac % 9 ) );
+                    zero = zero && strspn( fraction, "0" ) == size_t( t - fraction );
+                }
+                if( mask && zero ) // no negative zero
+                    memmove( scratch, scratch + 1, t - scratch - 1 ), --t;
+                *t = 0;
+                return t - scratch;
+            }
+        }
+    }
+
+    // "uuid:1-5:7,uuid2:1-3" into its intervals (inclusive)
+    void parse_gtids( const std::string &text, std::map< std::string, std::vector< std::pair<unsigned long long, unsigned long long> > > &set ) {
+        set.clear();
+        for( auto &item : tokenize( text, "," ) ) {
+            auto parts = tokenize( item, ":" );
+            if( parts.size() < 2 ) continue;
+            std::string sid;
+            for( char ch : parts[0] )
+                if( isxdigit( (unsigned char)ch ) ) sid += (char)tolower( (unsigned char)ch );
+            for( size_t i = 1; i < parts.size(); ++i ) {
+                unsigned long long lo = strtoull( parts[i].c_str(), 0, 10 ), hi = lo;
+                size_t dash = parts[i].find( '-' );
+                if( dash != std::string::npos ) hi = strtoull( parts[i].c_str() + dash + 1, 0, 10 );
+                set[ sid ].push_back( std::make_pair( lo, hi ) );
+            }
+        }
+    }
+
+    std::string format_gtids( const std::map< std::string, std::vector< std::pair<unsigned long long, unsigned long long> > > &set ) {
+        std::string text;
+        for( auto &it : set ) {
+            const std::string &s = it.first;
+            if( !text.empty() ) text += ",";
+            text += s.substr( 0, 8 ) + "-" + s.substr( 8, 4 ) + "-" + s.substr( 12, 4 ) + "-" + s.substr( 16, 4 ) + "-" + s.substr( 20 );
+            for( auto &range : it.second ) {
+                char buf[48];
+                sprintf( buf, range.first == range.second ? ":%llu" : ":%llu-%llu", range.first, range.second );
+                text += buf;
+            }
+        }
+        return text;
+    }
+
+    void OnFirstRowCb( void *userdata, int w, int h, const char **map ) {
+        std::vector< std::string > &row = *((std::vector< std::string > *)userdata);
+        if( h > 1 ) row.assign( map + w, map + 2 * w );
+    }
+}
+
+sq::binlog::binlog( sq::light &conn, unsigned server_id ) : conn( conn ), server( server_id ), checksum( 0 ), opened( false ) {
+    if( !server )
+        server = 0x40000000 | std::random_device()() % 0x3fffffff; // away from the small ids people give real replicas
+}
+
+sq::binlog::~binlog() {
+    close();
+}
+
+bool sq::binlog::open( const position &from, double timeout ) {
+    close();
+    at = from;
+    gtid.clear();
+    tables.clear();
+    parse_gtids( at.gtids, executed );
+
+    // no position: start from the current end of the binlog
+    if( at.file.empty() && executed.empty() ) {
+        std::vector< std::string > row;
+        if( !conn.exec( "SHOW BINARY LOG STATUS", OnFirstRowCb, &row, timeout ) || row.size() < 2 )
+            if( !conn.exec( "SHOW MASTER STATUS", OnFirstRowCb, &row, timeout ) || row.size() < 2 )
+                return false;
+        at.file = row[0];
+        at.offset = strtoull( row[1].c_str(), 0, 10 );
+    }
+
+    // events carry a CRC32 trailer only if we tell the server we know about it
+    std::vector< std::string > row;
+    if( !conn.exec( "SELECT @@global.binlog_checksum", OnFirstRowCb, &row, timeout ) )
+        return false;
+    checksum = !row.empty() && row[0] != "NONE" ? 4 : 0;
+    if( checksum && !conn.test( "SET @master_binlog_checksum = @@global.binlog_checksum, @source_binlog_checksum = @@global.binlog_checksum", timeout ) )
+        return false;
+
+    sq::light::hold lock( conn );
+    if( !conn.connected )
+        return false;
+
+    // COM_REGISTER_SLAVE: shows up in SHOW REPLICAS. server id, then empty host, user, password, port, rank, master id
+    std::string payload( (const char *)&server, 4 );
+    payload.append( 3 + 2 + 4 + 4, '\0' );
+    conn.arm( timeout > 0 ? timeout : conn.limits.send );
+    if( !conn.open() || !conn.sends( payload, 0x15 ) )
+        return broken();
+    if( timeout <= 0 )
+        conn.arm( conn.limits.recv );
+    unsigned len;
+    const char *p = conn.packet( len );
+    if( !p )
+        return broken();
+    if( (unsigned char)p[0] == 0xff )
+        return conn.fails( p, len );
+
+    // COM_BINLOG_DUMP: position(4) flags(2) server id(4) file. COM_BINLOG_DUMP_GTID: flags(2) server id(4) file length(4) file
+    // position(8) then the executed set: sids(8), and per sid its uuid(16), intervals(8) and [start, end) pairs(16 each)
+    // [ref] https://dev.mysql.com/doc/dev/mysql-server/latest/page_protocol_com_binlog_dump_gtid.html
+    if( executed.empty() ) {
+        unsigned offset = (unsigned)at.offset;
+        payload.assign( (const char *)&offset, 4 );
+        payload.append( 2, '\0' );
+        payload.append( (const char *)&server, 4 );
+        payload += at.file;
+    } else {
+        std::string set;
+        unsigned long long n = executed.size();
+        set.append( (const char *)&n, 8 );
+        for( auto &it : executed ) {
+            for( size_t i = 0; i + 1 < it.first.size() && i < 32; i += 2 )
+                set += (char)strtoul( it.first.substr( i, 2 ).c_str(), 0, 16 );
+            n = it.second.size();
+            set.append( (const char *)&n, 8 );
+            for( auto &range : it.second ) {
+                unsigned long long end = range.second + 1;
+                set.append( (const char *)&range.first, 8 );
+                set.append( (const char *)&end, 8 );
+            }
+        }
+        unsigned short flags = 4; // BINLOG_THROUGH_GTID
+        unsigned size = (unsigned)set.size(), named = 0;
+        unsigned long long offset = 4;
+        payload.assign( (const char *)&flags, 2 );
+        payload.append( (const char *)&server, 4 );
+        payload.append( (const char *)&named, 4 );
+        payload.append( (const char *)&offset, 8 );
+        payload.append( (const char *)&size, 4 );
+        payload += set;
+    }
+    conn.arm( timeout > 0 ? timeout : conn.limits.send );
+    if( !conn.sends( payload, executed.empty() ? 0x12 : 0x1e ) )
+        return broken();
+
+    return opened = true;
+}
+
+bool sq::binlog::poll( callback cb, void *userdata, double timeout ) {
+    if( !opened )
+        return false;
+
+    sq::light::hold lock( conn );
+
+    // wait for the first delivered event, then take whatever else is at hand without waiting.
+    // an event cut short by the deadline stays in the read-ahead buffer until the next call.
+    conn.arm( timeout > 0 ? timeout : conn.limits.recv );
+    for( bool delivered = false;; ) {
+        if( delivered )
+            conn.arm( 1e-6 );
+        unsigned len;
+        const char *p = conn.packet( len );
+        if( !p )
+            return conn.expired ? true : broken();
+
+        if( (unsigned char)p[0] == 0xff )
+            return conn.fails( p, len ), broken();
+        if( (unsigned char)p[0] == 0xfe && len < 9 )
+            return opened = false, true; // server closed the stream (ie, non blocking dump reached the end)
+
+        // OK byte, then the event: timestamp(4) type(1) server id(4) size(4) next position(4) flags(2), body, checksum
+        if( len < 1 + 19 + checksum )
+            continue;
+        const unsigned char *e = (const unsigned char *)p + 1, *body = e + 19, *end = e + len - 1 - checksum;
+        unsigned timestamp = (unsigned)le( e, 4 ), next = (unsigned)le( e + 13, 4 );
+        int type = e[4];
+
+        switch( type ) {
+            default:
+                break;
+
+            case ROTATE_EVENT:
+                if( end - body >= 8 ) {
+                    at.offset = le( body, 8 );
+                    at.file.assign( (const char *)body + 8, (const char *)end );
+                }
+                break;
+
+            case GTID_EVENT:
+                // flags(1) sid(16) gno(8). only tracked when streaming by GTID: a partial set would replay everything else
+                if( end - body >= 25 && !executed.empty() ) {
+                    static const char hex[] = "0123456789abcdef";
+                    char sid[33];
+                    for( int i = 0; i < 16; ++i )
+                        sid[2*i] = hex[ body[1+i] >> 4 ], sid[2*i+1] = hex[ body[1+i] & 15 ];
+                    sid[32] = 0;
+                    char gno[24];
+                    sprintf( gno, ":%llu", le( body + 17, 8 ) );
+                    gtid = std::string( sid ) + gno;
+                }
+                break;
+
+            case TABLE_MAP_EVENT:
+                if( !maps( (const char *)body, (const char *)end ) )
+                    return conn.fail( "malformed table map event" ), broken();
+                break;
+
+            case WRITE_ROWS_EVENTv1: case UPDATE_ROWS_EVENTv1: case DELETE_ROWS_EVENTv1:
+            case WRITE_ROWS_EVENTv2: case UPDATE_ROWS_EVENTv2: case DELETE_ROWS_EVENTv2: {
+                bool v2 = type >= WRITE_ROWS_EVENTv2;
+                int base = v2 ? WRITE_ROWS_EVENTv2 : WRITE_ROWS_EVENTv1;
+                if( !rows( (const char *)body, (const char *)end, sq::binlog::INSERT + type - base, v2, type - base == 1, timestamp, cb, userdata ) )
+                    return conn.fail( "malformed rows event" ), broken();
+                delivered = true;
+                break;
+            }
+
+            case XID_EVENT: {
+                event ev = event();
+                ev.type = COMMIT, ev.timestamp = timestamp;
+                if( cb ) (*cb)( userdata, ev );
+                commit( next );
+                delivered = true;
+                break;
+            }
+
+            case QUERY_EVENT: {
+                // thread id(4) exec time(4) db length(1) error(2) status vars length(2), status vars, db, NUL, statement
+                if( end - body < 13 ) break;
+                size_t dblen = body[8], vars = (size_t)le( body + 11, 2 );
+                const unsigned char *db = body + 13 + vars, *stmt = db + dblen + 1;
+                if( stmt > end ) break;
+                event ev = event();
+                ev.query.assign( (const char *)stmt, (const char *)end );
+                if( ev.query == "BEGIN" )
+                    break;
+                ev.type = ev.query == "COMMIT" ? COMMIT : QUERY; // COMMIT: non transactional engines
+                ev.timestamp = timestamp;
+                ev.db.assign( (const char *)db, dblen );
+                if( cb ) (*cb)( userdata, ev );
+                commit( next ); // DDL commits implicitly
+                delivered = true;
+                break;
+            }
+        }
+    }
+}
+
+bool sq::binlog::maps( const char *p, const char *end ) {
+    // table id(6) flags(2), db, table, columns, types, metadata, nullability, then optional metadata.
+    // every length is checked against end before use; the map is only kept once it parsed whole
+    const unsigned char *q = (const unsigned char *)p, *e = (const unsigned char *)end;
+    if( e - q < 8 + 2 ) return false;
+    unsigned long long id = le( q, 6 );
+    q += 8;
+
+    table t;
+    size_t n = *q++;
+    if( size_t(e - q) < n + 1 ) return false;
+    t.db.assign( (const char *)q, n ); q += n + 1;
+    if( q >= e || size_t(e - q - 1) < size_t(*q) + 1 ) return false;
+    n = *q++;
+    t.name.assign( (const char *)q, n ); q += n + 1;
+
+    size_t cols, meta_len;
+    if( !lenenc( q, e, cols ) ) return false;
+    t.types.assign( q, q + cols ); q += cols;
+    if( !lenenc( q, e, meta_len ) || size_t(e - q) - meta_len < ( cols + 7 ) / 8 ) return false;
+    const unsigned char *m = q, *mend = q + meta_len;
+    t.metas.assign( cols, 0 );
+    for( size_t c = 0; c < cols; ++c ) {
+        int size = meta_size( t.types[c] );
+        if( mend - m < size ) return false;
+        t.metas[c] = unsigned( le( m, size ) ); // 2 bytes are (low, high), ie, (precision, scale) or (real type, length)
+        m += size;
+    }
+    q += meta_len + ( cols + 7 ) / 8; // metadata, nullability
+
+    t.unsigneds.assign( cols, false );
+    while( q + 1 < e ) { // binlog_row_metadata: type(1) length(lenenc) value
+        int kind = *q++;
+        size_t size;
+        if( !lenenc( q, e, size ) ) return false;
+        const unsigned char *v = q, *vend = q + size;
+        if( kind == 1 ) // SIGNEDNESS: one bit per numeric column, most significant first
+            for( size_t c = 0, bit = 0; c < cols; ++c )
+                if( numeric( t.types[c] ) ) {
+                    t.unsigneds[c] = v + bit / 8 < vend && ( v[ bit / 8 ] & ( 0x80 >> bit % 8 ) );
+                    ++bit;
+                }
+        if( kind == 4 ) // COLUMN_NAME
+            while( v < vend ) {
+                if( !lenenc( v, vend, n ) ) return false;
+                t.names.push_back( std::string( (const char *)v, n ) );
+                v += n;
+            }
+        q += size;
+    }
+
+    tables[ id ] = std::move( t );
+    return true;
+}
+
+bool sq::binlog::rows( const char *p, const char *end, int type, bool v2, bool update, unsigned timestamp, callback cb, void *userdata ) {
+    // table id(6) flags(2) [extra data length(2), extra data] columns, present bitmap(s), then row images:
+    // null bitmap of the present columns and their non-null values
+    const unsigned char *q = (const unsigned char *)p, *e = (const unsigned char *)end;
+    if( e - q < 8 ) return false;
+    auto found = tables.find( le( q, 6 ) );
+    if( found == tables.end() ) return true; // table map we never saw (ie, started mid transaction)
+    const table &t = found->second;
+    q += 8;
+    if( v2 ) {
+        if( e - q < 2 ) return false;
+        q += le( q, 2 );
+    }
+    if( q >= e ) return false;
+
+    size_t cols = lenenc( q ), bytes = ( cols + 7 ) / 8;
+    if( cols > t.types.size() || q + bytes * ( update ? 2 : 1 ) > e ) return false;
+    const unsigned char *present[2] = { q, update ? q + bytes : q };
+    q += bytes * ( update ? 2 : 1 );
+
+    arena.clear(), offsets.clear(), lens.clear(), types.assign( cols, 0 ), names.resize( cols );
+    std::vector< std::string > fallback; // "@1".."@n" when the server logs no names
+    if( t.names.size() < cols )
+        for( size_t c = 0; c < cols; ++c )
+            fallback.push_back( "@" + std::to_string( c + 1 ) );
+    for( size_t c = 0; c < cols; ++c )
+        names[c] = t.names.size() >= cols ? t.names[c].c_str() : fallback[c].c_str();
+
+    char scratch[96];
+    const size_t none = (size_t)-1;
+    int h = 0;
+    while( q < e ) {
+        for( int image = 0; image < ( update ? 2 : 1 ); ++image, ++h ) {
+            const unsigned char *bits = present[image], *nulls = q;
+            size_t shown = 0;
+            for( size_t c = 0; c < cols; ++c ) shown += ( bits[c/8] >> c % 8 ) & 1;
+            q += ( shown + 7 ) / 8;
+            if( q > e ) return false;
+            for( size_t c = 0, i = 0; c < cols; ++c ) {
+                bool logged = ( bits[c/8] >> c % 8 ) & 1, null = logged && ( ( nulls[i/8] >> i % 8 ) & 1 );
+                i += logged;
+                if( !logged || null ) {
+                    offsets.push_back( none ), lens.push_back( 0 );
+                    continue;
+                }
+                const char *text;
+                int kind = t.types[c];
+                size_t len = binlog_value( q, e, kind, t.metas[c], !t.unsigneds[c], scratch, text );
+                if( len == none ) return false;
+                types[c] = kind;
+                offsets.push_back( arena.size() ), lens.push_back( len );
+                arena.insert( arena.end(), text, text + len );
+                arena.push_back( '\0' );
+            }
+        }
+    }
+
+    // arena may have moved while growing: pointers only now
+    cells.resize( offsets.size() );
+    for( size_t n = 0; n < offsets.size(); ++n )
+        cells[n] = offsets[n] == none ? 0 : arena.data() + offsets[n];
+    for( size_t c = 0; c < cols; ++c ) // columns never logged: their type as declared
+        if( !types[c] )
+            types[c] = t.types[c] == TYPE_TIMESTAMP2 ? int(sq::light::FIELD_TYPE_TIMESTAMP) : t.types[c] == TYPE_DATETIME2 ? int(sq::light::FIELD_TYPE_DATETIME)
+                     : t.types[c] == TYPE_TIME2 ? int(sq::light::FIELD_TYPE_TIME) : int(t.types[c]);
+
+    event ev = event();
+    ev.type = type, ev.timestamp = timestamp;
+    ev.db = t.db, ev.table = t.name;
+    ev.w = (int)cols, ev.h = h;
+    ev.cells = cells.data(), ev.lens = lens.data(), ev.types = types.data(), ev.names = names.data();
+    if( cb ) (*cb)( userdata, ev );
+    return true;
+}
+
+void sq::binlog::commit( unsigned long long offset ) {
+    // checkpoint: resuming from here replays nothing already delivered
+    if( offset ) at.offset = offset;
+    if( gtid.empty() ) return;
+    size_t colon = gtid.find( ':' );
+    unsigned long long gno = strtoull( gtid.c_str() + colon + 1, 0, 10 );
+    auto &ranges = executed[ gtid.substr( 0, colon ) ];
+    if( !ranges.empty() && ranges.back().second + 1 == gno ) ranges.back().second = gno; // usual case: next in sequence
+    else {
+        ranges.push_back( std::make_pair( gno, gno ) );
+        std::sort( ranges.begin(), ranges.end() );
+        size_t kept = 0;
+        for( size_t i = 1; i < ranges.size(); ++i )
+            if( ranges[i].first <= ranges[kept].second + 1 ) ranges[kept].second = std::max( ranges[kept].second, ranges[i].second );
+            else ranges[++kept] = ranges[i];
+        ranges.resize( kept + 1 );
+    }
+    at.gtids = format_gtids( executed );
+    gtid.clear();
+}
+
+const sq::binlog::position &sq::binlog::where() const {
+    return at;
+}
+
+void sq::binlog::close() {
+    // a dump never ends by itself: dropping the connection is the only way out
+    sq::light::hold lock( conn );
+    if( opened )
+        conn.disconnects();
+    opened = false;
+}
+
+bool sq::binlog::broken() {
+    conn.disconnects();
+    opened = false;
+    return false;
+}
+
+sq::router::router() : max_lag(0), lag_interval(1), next(0), transaction(false), stopping(false), rush(true) {
+}
+
+sq::router::~router() {
+    if( prober.joinable() ) {
+        {
+            std::lock_guard<std::mutex> lock( probe_mutex );
+            stopping = true;
+        }
+        probe_cv.notify_all();
+        prober.join();
+    }
+}
+
+bool sq::router::primary( const std::string &host, const std::string &port, const std::string &user, const std::string &password ) {
+    return writer.connect( host, port, user, password );
+}
+
+bool sq::router::replica( const std::string &host, const std::string &port, const std::string &user, const std::string &password ) {
+    // a dead replica must not stall reads: one attempt per probe, its breaker does the rest
+    std::unique_ptr<sq::light> conn( new sq::light );
+    sq::light::backoff once;
+    once.attempts = 1;
+    conn->set_backoff( once );
+    bool ok = conn->connect( host, port, user, password );
+    {
+        std::lock_guard<std::mutex> lock( probe_mutex );
+        readers.push_back( std::move(conn) );
+        lags.push_back( ok ? 0 : HUGE_VAL );
+    }
+    if( !prober.joinable() )
+        prober = std::thread( [this]() { probes(); } );
+    return ok;
+}
+
+void sq::router::set_lag_check( const std::string &query, double max_lag, double interval ) {
+    {
+        std::lock_guard<std::mutex> lock( probe_mutex );
+        lag_query = query;
+        this->max_lag = max_lag;
+        lag_interval = interval;
+        rush = true;
+    }
+    probe_cv.notify_all(); // sample right away with the new settings
+}
+
+bool sq::router::is_read( const std::string &query ) {
+    int hint = 0;
+    const char *p = skip_comments( query.c_str(), hint );
+    if( hint )
+        return hint < 0;
+
+    // literals, quoted names and comments are gone from q, so an email or a quoted "INTO" cannot misroute
+    std::string q = lex( p );
+
+    // more statements after the first one: whole batch goes to primary
+    std::string::size_type semi = q.find( " ; " );
+    if( semi != std::string::npos ) {
+        if( q.find_first_not_of( " ;", semi ) != std::string::npos )
+            return false;
+        q.resize( semi + 1 );
+    }
+
+    std::string verb = q.substr( 1, q.find( ' ', 1 ) - 1 );
+    if( verb == "SHOW" || verb == "DESCRIBE" || verb == "DESC" || verb == "EXPLAIN" )
+        return true;
+    if( verb != "SELECT" && verb != "WITH" && verb != "(" )
+        return false;
+
+    // locking reads, session state and SELECT ... INTO need the primary session
+    const char *primary_only[] = { " FOR UPDATE ", " FOR SHARE ", " LOCK IN SHARE MODE ", " INTO ",
+        " LAST_INSERT_ID ", " FOUND_ROWS ", " ROW_COUNT ", " GET_LOCK ", " RELEASE_LOCK ", " IS_USED_LOCK ", " IS_FREE_LOCK ", " @ " };
+    for( auto &word : primary_only )
+        if( q.find( word ) != std::string::npos )
+            return false;
+
+    return true;
+}
+
+sq::light &sq::router::route( const std::string &query ) {
+    // transactions pin to the primary from BEGIN to COMMIT/ROLLBACK, whatever the hints say
+    int hint = 0;
+    std::string q = upper( skip_comments( query.c_str(), hint ) );
+    int autocommit = -1;
+    std::string::size_type at = q.compare(0, 3, "SET") ? std::string::npos : q.find("AUTOCOMMIT");
+    if( at != std::string::npos ) {
+        at = q.find_first_not_of(" \t:=", at + 10);
+        if( at != std::string::npos )
+            autocommit = q[at] == '1' || !q.compare(at, 2, "ON") || !q.compare(at, 4, "TRUE");
+    }
+    bool opens = !q.compare(0, 5, "BEGIN") || !q.compare(0, 17, "START TRANSACTION") || !q.compare(0, 8, "XA START") || autocommit == 0;
+    bool closes = !q.compare(0, 6, "COMMIT") || ( !q.compare(0, 8, "ROLLBACK") && q.find(" TO ") == std::string::npos ) || autocommit == 1;
+
+    if( opens || transaction ) {
+        transaction = opens || !closes;
+        return writer;
+    }
+    if( readers.empty() || !is_read( query ) )
+        return writer;
+
+    // round robin over healthy replicas that keep up; none left means the primary serves reads too.
+    // health is whatever the prober saw last: nothing here waits on a replica
+    std::lock_guard<std::mutex> lock( probe_mutex );
+    for( size_t n = 0; n < readers.size(); ++n ) {
+        size_t i = next++ % readers.size();
+        if( lags[i] <= max_lag && readers[i]->is_connected() )
+            return *readers[i];
+    }
+    return writer;
+}
+
+void sq::router::probes() {
+    // every interval: reconnect dead replicas, then sample their lag. replicas are probed unlocked,
+    // so route() never queues behind a reconnect; new ones may be added meanwhile and wait for the next round
+    std::unique_lock<std::mutex> wait( probe_mutex );
+    for( ;; ) {
+        auto period = std::chrono::duration_cast<std::chrono::steady_clock::duration>( std::chrono::duration<double>( std::max( lag_interval, 0.01 ) ) );
+        probe_cv.wait_for( wait, period, [this]{ return stopping || rush; } );
+        if( stopping )
+            return;
+        rush = false;
+
+        std::vector< sq::light * > conns;
+        for( auto &r : readers )
+            conns.push_back( r.get() );
+        std::string query = lag_query;
+        wait.unlock();
+
+        std::vector< double > sampled( conns.size(), 0 );
+        for( size_t i = 0; i < conns.size(); ++i ) {
+            if( !conns[i]->is_connected() && !conns[i]->reconnect() )
+                sampled[i] = HUGE_VAL;
+            else if( !query.empty() && !conns[i]->exec( query, OnLagCb, (void *)&sampled[i] ) )
+                sampled[i] = HUGE_VAL;
+        }
+
+        wait.lock();
+        for( size_t i = 0; i < sampled.size(); ++i )
+            lags[i] = sampled[i];
+    }
+}
+
+bool sq::router::test( const std::string &query, double timeout ) {
+    sq::light &conn = route( query );
+    bool ok = conn.test( query, timeout );
+    // reads are retried on the primary when the replica connection itself died
+    if( !ok && &conn != &writer && !conn.is_connected() )
+        ok = writer.test( query, timeout );
+    return ok;
+}
 
-        while( rc < no && (i=RECV(s,b+rc, no-rc ,0)) > 0  ) rc+=i;
+bool sq::router::exec( const std::string &query, sq::light::callback3 cb, void *userdata, double timeout ) {
+    sq::light &conn = route( query );
+    bool ok = conn.exec( query, cb, userdata, timeout );
+    if( !ok && &conn != &writer && !conn.is_connected() )
+        ok = writer.exec( query, cb, userdata, timeout );
+    return ok;
+}
 
-        if(i<1) return fail("connection lost"); // Connection lost
+bool sq::router::json( const std::string &query, std::string &result, double timeout ) {
+    sq::light &conn = route( query );
+    bool ok = conn.json( query, result, timeout );
+    if( !ok && &conn != &writer && !conn.is_connected() )
+        ok = writer.json( query, result, timeout );
+    return ok;
+}
 
-        // 0. For non query sql commands we get just single success or failure response
-        if(*       b==0x00&&!exit)                                      break;   // success
-        if(*(byte*)b==0xff&&!exit)  { b[*(short*)(b+1)+3]=0; return fail(b+3); } // failure: show server error text
+std::string sq::router::json( const std::string &query, double timeout ) {
+    std::string result;
+    return json(query,result,timeout) ? result : std::string();
+}
 
-        // 1. first thing we receive is number of fields
-        if(!fields ) { memcpy(&fields,b,no); field=fields; continue; }
+namespace {
 
-        // 3. 5. after receiving last field info or row we get this EOF marker or more results exist
-        if (*(byte*)b==0xfe && no < 9)
-        {
-            if( no == 5 )
-            {
-                int status = ( b4 << 8 ) | b3;
-                if( status & 0x0008 ) { // SERVER_MORE_RESULTS_EXISTS
-                    typedef void (*TOnSep)(void *);  if(onsep) ((TOnSep)onsep)(userdata);
-                    continue;
-                }
-            }
+    // cells compare as numbers when both are numeric, as text otherwise
+    int compare_cells( const char *a, const char *b ) {
+        char *ea, *eb;
+        double x = strtod( a, &ea ), y = strtod( b, &eb );
+        if( *a && *b && !*ea && !*eb )
+            return x < y ? -1 : x > y;
+        int c = strcmp( a, b );
+        return c < 0 ? -1 : c > 0;
+    }
 
-            if(exit++) break; else continue;        // EOF
+    // NULL cells never take part: they neither count nor win MIN/MAX. an empty string is a value like any other
+    void aggregate( int mode, std::string &acc, char &acc_null, const std::string &cell, bool null ) {
+        if( null )
+            return;
+        if( acc_null ) {
+            acc = cell, acc_null = 0;
+            return;
         }
+        if( mode == sq::fanout::MIN || mode == sq::fanout::MAX ) {
+            int c = compare_cells( cell.c_str(), acc.c_str() );
+            if( mode == sq::fanout::MIN ? c < 0 : c > 0 )
+                acc = cell;
+            return;
+        }
+        // COUNT and SUM: shard counts add up
+        char *ea, *eb;
+        long long i = strtoll( acc.c_str(), &ea, 10 ), j = strtoll( cell.c_str(), &eb, 10 );
+        if( !*ea && !*eb ) {
+            acc = std::to_string( i + j );
+            return;
+        }
+        double x = strtod( acc.c_str(), &ea ), y = strtod( cell.c_str(), &eb );
+        if( !*ea && !*eb ) {
+            char text[32];
+            sprintf( text, "%.17g", x + y );
+            acc = text;
+        }
+    }
 
-        // 4. after receiving all field infos we receive row field values. One row per Receive/Packet
-        while( value  ) {
-            *txt=0; i=fields-value; size_t len=1; byte g=*(byte*)p;
-
-            // ~net_field_length() @ libmysql.c {
-                switch(g) {
-                    case 0:
-                    case 251: g=0;      break; // NULL_LENGTH
-                    default:
-                    case   1: g=1;      break;
-                    case 252: g=2, ++p; break;
-                    case 253: g=3, ++p; break;
-                    case 254: g=8, ++p; break;
-                }
-                // @todo: beware little/big endianess here!
-                memcpy(&len,p,g); p+=g;
-            //}
+    // one shard result, taken as it streams in (first result set only, as exec() grids do).
+    // listing modes keep the cells NUL terminated back to back in one arena, no allocation per cell.
+    // folding modes (COUNT..MAX) fold every row into its group as soon as it is complete, so memory
+    // grows with the groups, not with the rows
+    struct gather : sq::writer {
+        const sq::fanout::merge &how;
+        int key;
+        unsigned sets;
+        std::vector< std::string > header;
+        std::vector< char > arena;
+        std::vector< size_t > offsets;
+        std::map< std::string, size_t > groups;     // group -> folded row
+        std::vector< std::string > folded, cells;           // cells: the row in progress
+        std::vector< char > nulls, cell_nulls;
+
+        explicit gather( const sq::fanout::merge &how ) : how(how), key(-1), sets(0) {}
+
+        bool folds() const {
+            return how.mode != sq::fanout::CONCAT && how.mode != sq::fanout::ORDERED;
+        }
+        int w() const {
+            return (int)header.size();
+        }
+        size_t h() const {
+            return folds() ? folded.size() / header.size() : offsets.size() / header.size();
+        }
+        const char *cell( size_t r, int c ) const {
+            return folds() ? folded[r * w() + c].c_str() : arena.data() + offsets[r * w() + c];
+        }
+        void clear() {
+            key = -1, sets = 0;
+            header.clear(), arena.clear(), offsets.clear();
+            groups.clear(), folded.clear(), nulls.clear();
+        }
 
-            auto &type = typ[i];
-            switch( type )
-            {
-                case FIELD_TYPE_BIT:
-                case FIELD_TYPE_BLOB:
-                case FIELD_TYPE_DATE:
-                case FIELD_TYPE_DATETIME:
-                case FIELD_TYPE_DECIMAL:
-                case FIELD_TYPE_DOUBLE:
-                case FIELD_TYPE_ENUM:
-                case FIELD_TYPE_FLOAT:
-                case FIELD_TYPE_GEOMETRY:
-                case FIELD_TYPE_INT24:
-                case FIELD_TYPE_LONG:
-                case FIELD_TYPE_LONG_BLOB:
-                case FIELD_TYPE_LONGLONG:
-                case FIELD_TYPE_MEDIUM_BLOB:
-                case FIELD_TYPE_NEW_DECIMAL:
-                case FIELD_TYPE_NEWDATE:
-                case FIELD_TYPE_NULL:
-                case FIELD_TYPE_SET:
-                case FIELD_TYPE_SHORT:
-                case FIELD_TYPE_STRING:
-                case FIELD_TYPE_TIME:
-                case FIELD_TYPE_TIMESTAMP:
-                case FIELD_TYPE_TINY:
-                case FIELD_TYPE_TINY_BLOB:
-                case FIELD_TYPE_VAR_STRING:
-                case FIELD_TYPE_VARCHAR:
-                case FIELD_TYPE_YEAR:
-                default: {
-                    // @todo: beware little/big endianess here!
-                    if(g) memcpy(txt,p,len); txt[len]=0;
-                    typedef long (*TOnValue)(void *,char*,int,int,int);  if(onvalue) ret=((TOnValue)onvalue)(userdata,txt,row,i,type);
-                    break;
-                }
+        void field( int col, const char *name, int /*type*/, int /*charset*/ ) {
+            if( sets ) return;
+            header.push_back( name );
+            if( !how.key.empty() && how.key == name )
+                key = col;
+            cells.resize( header.size() ), cell_nulls.resize( header.size() );
+        }
+        void value( int col, const char *data, size_t len, int /*type*/ ) {
+            if( sets ) return;
+            if( folds() ) {
+                cells[col].assign( data ? data : "", data ? len : 0 );
+                cell_nulls[col] = !data;
+                return;
             }
+            offsets.push_back( arena.size() );
+            arena.insert( arena.end(), data, data + ( data ? len : 0 ) );
+            arena.push_back( '\0' );
+        }
+        void fold() {
+            auto found = groups.insert( std::make_pair( key < 0 ? std::string() : cells[key], folded.size() / header.size() ) );
+            if( found.second ) {
+                folded.insert( folded.end(), cells.begin(), cells.end() );
+                nulls.insert( nulls.end(), cell_nulls.begin(), cell_nulls.end() );
+                return;
+            }
+            size_t at = found.first->second * header.size();
+            for( int c = 0; c < w(); ++c )
+                if( c != key )
+                    aggregate( how.mode, folded[at + c], nulls[at + c], cells[c], cell_nulls[c] != 0 );
+        }
+        void row() {
+            if( !sets && folds() )
+                fold();
+        }
+        void next() {
+            sets++;
+        }
+    };
 
-            p+=len;
-            if(!--value) { row++; value=fields; p=b; break; }
+    // shard queries run on a few threads shared by every fanout in the process, instead of a new one per shard
+    // per call. the crew grows to the most shards ever queried at once and then only idles. tasks never outlive
+    // the exec() that queued them, so exit finds every worker idle and joins them right away
+    class crew {
+        std::mutex mutex;
+        std::condition_variable cv;
+        std::deque< std::function<void()> > tasks;
+        std::vector< std::thread > team;
+        size_t idle;
+        bool stopping;
+
+        crew() : idle(0), stopping(false) {}
+
+        void work() {
+            std::unique_lock<std::mutex> lock( mutex );
+            for( ;; ) {
+                ++idle;
+                cv.wait( lock, [&]{ return stopping || !tasks.empty(); } );
+                --idle;
+                if( tasks.empty() )
+                    return;
+                std::function<void()> task = std::move( tasks.front() );
+                tasks.pop_front();
+                lock.unlock();
+                task();
+                lock.lock();
+            }
         }
 
-        // 2. Second info we get are field infos like name type etc. One field per Receive/Packet
-        if( field  ) {
-                  i        = fields - field;
-            char* cat      =          p; p+=1+*p; *   cat ++=0;
-            char* db       =          p; p+=1+*p; *    db ++=0;
-            char* table    =          p; p+=1+*p; * table ++=0;
-            char* table_   =          p; p+=1+*p; * table_++=0;
-            char* name     =          p; p+=1+*p; *  name ++=0;
-            char* name_    =          p; p+=1+*p; *  name_++=0; *p++=0;
-            short charset  = *(short*)p; p+=2;
-            long  length   = * (long*)p; p+=4;
-                  typ[i]   = * (byte*)p; p+=1;
-            short flags    = *(short*)p; p+=2;
-            byte  digits   = * (byte*)p; p+=3;
-            char* Default  =          p;
-
-            auto &type = typ[i];
-            switch( type )
+    public:
+        ~crew() {
             {
-                case FIELD_TYPE_STRING:
-                case FIELD_TYPE_VAR_STRING:
-                case FIELD_TYPE_LONG:
-                case FIELD_TYPE_LONGLONG:
-                case FIELD_TYPE_DATETIME:
-                case FIELD_TYPE_DATE:
-                case FIELD_TYPE_FLOAT:
-                case FIELD_TYPE_TINY:
-                case FIELD_TYPE_BLOB:
-                case FIELD_TYPE_NEW_DECIMAL:
-                    break;
-                default:
-                std::cerr << "Warning: unsupported type " << int(type) << " in column: " << name << std::endl;
+                std::lock_guard<std::mutex> lock( mutex );
+                stopping = true;
             }
+            cv.notify_all();
+            for( auto &t : team )
+                t.join();
+        }
 
-            if(!--field) value = fields; p=b; length=std::max(length*3,60L); length=std::min(length,200L);
-            typedef long (*TOnField)(void *,char*,int,int,int);  if(onfield) ((TOnField)onfield)(userdata,name,row,i,length);
+        static crew &get() {
+            static crew instance;
+            return instance;
         }
-    }
 
-    return true;
+        std::future<bool> run( std::function<bool()> fn ) {
+            auto task = std::make_shared< std::packaged_task<bool()> >( fn );
+            std::future<bool> result = task->get_future();
+            std::lock_guard<std::mutex> lock( mutex );
+            tasks.push_back( [task]{ (*task)(); } );
+            if( tasks.size() > idle )
+                team.push_back( std::thread( [this]{ work(); } ) );
+            else
+                cv.notify_one();
+            return result;
+        }
+    };
 }
 
-namespace
-{
-    struct local {
-        int x, y;
-        std::vector< char * > data;
-        std::vector< char * > head;
+sq::fanout::fanout() {
+}
 
-        local() : x(0),y(0) {
-        }
+void sq::fanout::add( sq::light &shard ) {
+    shards.push_back( &shard );
+}
 
-        ~local() {
-            for( unsigned i = 0, end = data.size(); i < end; ++i )
-                if( data[i] ) free( data[i] ), data[i] = 0;
-            for( unsigned i = 0, end = head.size(); i < end; ++i )
-                if( head[i] ) free( head[i] ), head[i] = 0;
+size_t sq::fanout::size() const {
+    return shards.size();
+}
+
+bool sq::fanout::exec( const std::string &query, const merge &how, sq::light::callback3 cb, void *userdata, double timeout ) {
+    return exec( std::vector<std::string>( shards.size(), query ), how, cb, userdata, timeout );
+}
+
+bool sq::fanout::exec( const std::vector<std::string> &queries, const merge &how, sq::light::callback3 cb, void *userdata, double timeout ) {
+    if( shards.empty() || queries.size() != shards.size() )
+        return false;
+
+    // every shard runs concurrently on its own connection (calling thread takes the first one),
+    // so the whole call takes as long as the slowest shard. rows are merged into each shard's gather as they arrive
+    std::vector< gather > gathers( shards.size(), gather( how ) );
+    auto run = [&]( size_t i ) -> bool {
+        sq::metrics metrics( "shard#" + std::to_string(i) );
+        sq::light &conn = *shards[i];
+        bool ok = conn.connected;
+        if( ok ) {
+            sq::light::hold lock( conn );
+            for( unsigned attempt = 1; ok && !conn.execs( queries[i], &gathers[i], timeout ); ++attempt ) { // retried as exec() grids are
+                ok = conn.retries( queries[i], attempt );
+                gathers[i].clear();
+            }
         }
+        if( !ok )
+            metrics.cancel();
+        return ok;
     };
 
-    void GetText2f( void *userdata, char* txt ) {
-        local *l = (local *)userdata;
-        l->head.push_back( txt ? strdup(txt) : strdup("") );
-    }
-    void GetText2v( void *userdata, char* txt ) {
-        local *l = (local *)userdata;
-        l->data.push_back( txt ? strdup(txt) : strdup("") );
+    std::vector< std::future<bool> > jobs;
+    for( size_t i = 1; i < shards.size(); ++i )
+        jobs.push_back( crew::get().run( std::bind( run, i ) ) );
+    bool ok = run( 0 );
+    for( auto &job : jobs )
+        ok &= job.get();
+
+    // a partial merge would be silently wrong, specially for aggregations
+    if( !ok )
+        return false;
+
+    int w = 0;
+    const gather *first = 0;
+    for( auto &g : gathers ) {
+        if( !g.w() )
+            continue;
+        if( w && g.w() != w )
+            return false;
+        w = g.w();
+        if( !first ) first = &g;
     }
+    if( !first )
+        return true; // no result set at all (ie, DML on every shard)
+
+    int key = first->key;
+    if( !how.key.empty() && key < 0 )
+        return false;
 
-    void GetText3f( void *userdata, char* txt ) {
-        local *l = (local *)userdata;
-        l->x++;
-        l->y++;
-        l->data.push_back( txt ? strdup(txt) : strdup("") );
+    std::vector< const char * > map;
+    for( int c = 0; c < w; ++c )
+        map.push_back( first->header[c].c_str() );
+    auto push = [&]( const gather &g, size_t r ) {
+        for( int c = 0; c < w; ++c )
+            map.push_back( g.cell( r, c ) );
+    };
+
+    std::map< std::string, size_t > groups;
+    std::vector< std::string > folded;
+    std::vector< char > nulls;
+
+    if( how.mode == CONCAT || ( how.mode == ORDERED && key < 0 ) ) {
+        for( auto &g : gathers )
+            for( size_t r = 0, h = g.w() ? g.h() : 0; r < h; ++r )
+                push( g, r );
+    }
+    else if( how.mode == ORDERED ) {
+        // k-way merge: every shard result is already sorted by key
+        std::vector< size_t > at( gathers.size(), 0 );
+        for( ;; ) {
+            int pick = -1;
+            for( size_t i = 0; i < gathers.size(); ++i ) {
+                if( !gathers[i].w() || at[i] >= gathers[i].h() )
+                    continue;
+                if( pick < 0 ) {
+                    pick = (int)i;
+                    continue;
+                }
+                int c = compare_cells( gathers[i].cell( at[i], key ), gathers[pick].cell( at[pick], key ) );
+                if( how.descending ? c > 0 : c < 0 )
+                    pick = (int)i;
+            }
+            if( pick < 0 )
+                break;
+            push( gathers[pick], at[pick]++ );
+        }
     }
-    void GetText3v( void *userdata, char* txt ) {
-        local *l = (local *)userdata;
-        l->y++;
-        l->data.push_back( txt ? strdup(txt) : strdup("") );
+    else {
+        // COUNT/SUM/MIN/MAX: every shard already folded its own rows, so only their groups fold here
+        for( auto &g : gathers )
+            for( size_t r = 0, h = g.w() ? g.h() : 0; r < h; ++r ) {
+                const std::string *row = &g.folded[r * w];
+                const char *row_nulls = &g.nulls[r * w];
+                auto found = groups.insert( std::make_pair( key < 0 ? std::string() : row[key], folded.size() / w ) );
+                if( found.second ) {
+                    folded.insert( folded.end(), row, row + w );
+                    nulls.insert( nulls.end(), row_nulls, row_nulls + w );
+                    continue;
+                }
+                size_t at = found.first->second * w;
+                for( int c = 0; c < w; ++c )
+                    if( c != key )
+                        aggregate( how.mode, folded[at + c], nulls[at + c], row[c], row_nulls[c] != 0 );
+            }
+        for( auto &cell : folded )
+            map.push_back( cell.c_str() );
     }
+
+    (*cb)( userdata, w, int( map.size() / w ), map.data() );
+    return true;
 }
 
-bool sq::light::test( const std::string &query )
-{
-    if( !connected )
-        return false;
+bool sq::fanout::json( const std::vector<std::string> &queries, std::string &result, const merge &how, double timeout ) {
+    result = std::string();
+    bool ok = exec(queries,how,OnJSONCb,(void *)&result,timeout);
+    if( !ok )
+        result = std::string();
+    return ok;
+}
 
-    std::lock_guard<std::mutex> lock(mutex);
+bool sq::fanout::json( const std::string &query, std::string &result, const merge &how, double timeout ) {
+    return json( std::vector<std::string>( shards.size(), query ), result, how, timeout );
+}
 
-    no = 20;
-    ret = 0;
+std::string sq::fanout::json( const std::string &query, const merge &how, double timeout ) {
+    std::string result;
+    return json(query,result,how,timeout) ? result : std::string();
+}
 
-    if( !query.empty() )
-        if( open() ) // setup
-            if( sends(query) ) // send
-                if( recvs(0, 0, 0, 0) ) // recv and parse
-                    return true;
+sq::fd_sink::fd_sink( int fd ) : fd(fd) {
+}
 
-    return false;
+bool sq::fd_sink::write( const char *data, size_t len ) {
+    while( len ) {
+        auto sent = WRITE( fd, data, (unsigned)len );
+        if( sent < 0 && errno == EINTR )
+            continue;
+        if( sent <= 0 )
+            return false;
+        data += sent, len -= sent;
+    }
+    return true;
 }
 
-bool sq::light::exec( const std::string &query, sq::light::callback3 cb3, void *userdata )
-{
-    if( !connected )
-        return false;
+sq::buffer_sink::buffer_sink( std::string &buffer ) : buffer(buffer) {
+}
 
-    auto create_index = []( const std::string &sqlcode ) {
-        auto tokens = tokenize(sqlcode," (");
-        return tokens.size() > 1 ? tokens.at(1) : std::string();
-    };
+bool sq::buffer_sink::write( const char *data, size_t len ) {
+    buffer.append( data, len );
+    return true;
+}
+
+size_t sq::schema::size() const {
+    return columns.size();
+}
 
-    std::lock_guard<std::mutex> lock(mutex);
+const sq::schema::column &sq::schema::operator[]( size_t col ) const {
+    return columns[col];
+}
 
-    sq::metrics metrics(create_index(query));
+int sq::schema::find( const std::string &name ) const {
+    if( slots.empty() )
+        return -1;
+    int col = slots[ fnv( name.data(), name.size(), seed ) & ( slots.size() - 1 ) ];
+    return col >= 0 && columns[col].name == name ? col : -1;
+}
 
-        local l;
+void sq::schema::index() {
+    // perfect hash: power of two table at least twice the columns, then search a seed without collisions.
+    // hopeless seeds (very unlikely past a few tries) double the table instead.
+    size_t size = 2;
+    while( size < columns.size() * 2 ) size <<= 1;
+
+    for( unsigned tries = 0;; ++tries ) {
+        if( tries && !( tries % 64 ) ) size <<= 1;
+        seed = 14695981039346656037ULL ^ ( tries * 0x9E3779B97F4A7C15ULL );
+        slots.assign( size, -1 );
+        bool clash = false;
+        for( size_t col = 0; col < columns.size() && !clash; ++col ) {
+            int &slot = slots[ fnv( columns[col].name.data(), columns[col].name.size(), seed ) & ( size - 1 ) ];
+            if( slot < 0 ) slot = int(col);
+            else clash = columns[slot].name != columns[col].name; // duplicated names keep the first column
+        }
+        if( !clash )
+            return;
+    }
+}
 
-        no = 20;
-        ret = 0;
+std::shared_ptr<const sq::schema> sq::light::schema() {
+    hold lock( *this );
+    return shape;
+}
 
-        if( !query.empty() )
-            if( open() ) // setup
-                if( sends(query) ) // send
-                    if( recvs( (void *)&l /*userdata*/, (void *)GetText3v, (void *)GetText3f, 0 /*onsep*/) ) { // recv and parse
-                        if( l.x > 0 )
-                            (*cb3)( userdata, l.x, l.y / l.x, (const char **)l.data.data() );
-                        return true;
-                    }
+sq::encoder::encoder( sink &out, size_t chunk ) : out(out), chunk(chunk), failed(false) {
+    pending.reserve( chunk + 64 );
+}
 
-    metrics.cancel();
-    return false;
+sq::encoder::~encoder() {
+    flush();
+}
+
+bool sq::encoder::good() const {
+    return !failed;
+}
+
+void sq::encoder::field( int col, const char *name, int type, int charset ) {
+    if( !col )
+        names.clear(), types.clear(), charsets.clear();
+    names.push_back( name );
+    types.push_back( type );
+    charsets.push_back( charset );
+}
+
+void sq::encoder::done() {
+    flush();
+}
+
+void sq::encoder::put( const char *data, size_t len ) {
+    pending.append( data, len );
+    if( pending.size() >= chunk )
+        flush();
+}
+
+void sq::encoder::put( const std::string &text ) {
+    put( text.data(), text.size() );
+}
+
+void sq::encoder::put( char ch ) {
+    pending += ch;
+    if( pending.size() >= chunk )
+        flush();
+}
+
+void sq::encoder::flush() {
+    // once the sink fails, the rest of the result is still drained from the socket but dropped
+    if( !failed && !pending.empty() && !out.write( pending.data(), pending.size() ) )
+        failed = true;
+    pending.clear();
+}
+
+bool sq::encoder::numeric( int col ) const {
+    switch( col < (int)types.size() ? types[col] : -1 ) {
+        case sq::light::FIELD_TYPE_TINY:
+        case sq::light::FIELD_TYPE_SHORT:
+        case sq::light::FIELD_TYPE_LONG:
+        case sq::light::FIELD_TYPE_INT24:
+        case sq::light::FIELD_TYPE_LONGLONG:
+        case sq::light::FIELD_TYPE_YEAR:
+        case sq::light::FIELD_TYPE_FLOAT:
+        case sq::light::FIELD_TYPE_DOUBLE:
+        case sq::light::FIELD_TYPE_DECIMAL:
+        case sq::light::FIELD_TYPE_NEW_DECIMAL:
+            return true;
+        default:
+            return false;
+    }
+}
+
+bool sq::encoder::binary( int col ) const {
+    // charset 63 is 'binary': BLOB/BINARY/VARBINARY columns, as opposed to TEXT/CHAR/VARCHAR
+    int type = col < (int)types.size() ? types[col] : -1, charset = col < (int)charsets.size() ? charsets[col] : -1;
+    return type == sq::light::FIELD_TYPE_BIT || type == sq::light::FIELD_TYPE_GEOMETRY || ( charset == 63 && !numeric(col) &&
+        ( type == sq::light::FIELD_TYPE_BLOB || type == sq::light::FIELD_TYPE_TINY_BLOB || type == sq::light::FIELD_TYPE_MEDIUM_BLOB || type == sq::light::FIELD_TYPE_LONG_BLOB ||
+          type == sq::light::FIELD_TYPE_STRING || type == sq::light::FIELD_TYPE_VAR_STRING || type == sq::light::FIELD_TYPE_VARCHAR ) );
 }
 
 namespace {
-    std::string escape( const std::string &text )  {
-        std::string out;
-        for( auto &it : text ) {
-            /**/ if( it == '\\' ) out += "\\\\";
-            else if( it == '\r' ) out += "\\r";
-            else if( it == '\n' ) out += "\\n";
-            else if( it == '\t' ) out += "\\t";
-            else if( it == '\f' ) out += "\\f";
-            else if( it == '\b' ) out += "\\b";
-            else if( it == '\v' ) out += "\\v";
-            else if( it ==  '"' ) out += "\\\"";
-            else                  out += it;
+    void put_base64( std::string &out, const char *data, size_t len ) {
+        static const char table[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        const unsigned char *in = (const unsigned char *)data;
+        for( size_t n = 0; n < len; n += 3 ) {
+            unsigned v = in[n] << 16 | ( n+1 < len ? in[n+1] << 8 : 0 ) | ( n+2 < len ? in[n+2] : 0 );
+            out += table[v >> 18];
+            out += table[(v >> 12) & 63];
+            out += n+1 < len ? table[(v >> 6) & 63] : '=';
+            out += n+2 < len ? table[v & 63] : '=';
         }
-        return out;
     }
-    void OnJSONCb( void *userdata, int w, int h, const char **map ) {
-        std::string &array = *((std::string*)userdata);
-        const char **field = &map[0];
-        const char **value = &map[w];
-        for( int y = 1; y < h; ++y ) {
-            array += "{\n";
-            for( int x = 0; x < w; ++x ) {
-                array += "\"" + escape(std::string(*field++)) + "\": ";
-                array += "\"" + escape(std::string(*value++)) + "\",\n";
-            }
-            if( w > 0 ) array[array.size()-2] = ' ';
-            array += "},\n";
 
-            field = map;
+    void put_json_string( std::string &out, const char *data, size_t len ) {
+        static const char hex[] = "0123456789abcdef";
+        out += '"';
+        for( size_t n = 0; n < len; ++n ) {
+            unsigned char ch = (unsigned char)data[n];
+            /**/ if( ch == '"' )  out += "\\\"";
+            else if( ch == '\\' ) out += "\\\\";
+            else if( ch == '\n' ) out += "\\n";
+            else if( ch == '\r' ) out += "\\r";
+            else if( ch == '\t' ) out += "\\t";
+            else if( ch < 0x20 ) out += "\\u00", out += hex[ch >> 4], out += hex[ch & 15];
+            else                  out += (char)ch;
         }
-        if( h > 0 && array.size() >= 2 ) array[array.size()-2] = ' ';
-        array = "[\n" + array + "]\n";
+        out += '"';
+    }
+
+    // JSON numbers have no leading zeros: ZEROFILL columns (0042) and YEAR 0000 go out as strings instead
+    bool json_number( const char *data, size_t len ) {
+        if( len && *data == '-' ) ++data, --len;
+        return len && !( len > 1 && data[0] == '0' && isdigit((unsigned char)data[1]) );
     }
 }
 
-bool sq::light::json( const std::string &query, std::string &result ) {
-    result = std::string();
-    bool ok = exec(query,OnJSONCb,(void *)&result);
-    if( !ok )
-        result = std::string();
-    return ok;
+sq::csv_writer::csv_writer( sink &out ) : encoder( out ), header( true ) {
 }
 
-std::string sq::light::json( const std::string &query ) {
-    std::string result;
-    return json(query,result) ? result : std::string();
+void sq::csv_writer::line() {
+    // header is written lazily, so result sets without rows still get one
+    header = false;
+    for( size_t col = 0; col < names.size(); ++col ) {
+        if( col ) put( ',' );
+        put( '"' );
+        for( auto &ch : names[col] ) {
+            if( ch == '"' ) put( '"' );
+            put( ch );
+        }
+        put( '"' );
+    }
+    put( "\r\n", 2 );
+}
+
+void sq::csv_writer::value( int col, const char *data, size_t len, int /*type*/ ) {
+    if( header )
+        line();
+    if( col )
+        put( ',' );
+    if( !data )
+        return;
+    bool quote = !len || std::find_if( data, data + len, []( char ch ) { return ch == ',' || ch == '"' || ch == '\r' || ch == '\n'; } ) != data + len;
+    if( !quote )
+        return put( data, len );
+    put( '"' );
+    for( size_t n = 0; n < len; ++n ) {
+        if( data[n] == '"' ) put( '"' );
+        put( data[n] );
+    }
+    put( '"' );
+}
+
+void sq::csv_writer::row() {
+    put( "\r\n", 2 );
+}
+
+void sq::csv_writer::next() {
+    if( header )
+        line();
+    put( "\r\n", 2 ); // blank line between result sets
+    header = true;
+}
+
+void sq::csv_writer::done() {
+    if( header && !names.empty() )
+        line();
+    encoder::done();
+}
+
+sq::ndjson_writer::ndjson_writer( sink &out ) : encoder( out ) {
+}
+
+void sq::ndjson_writer::value( int col, const char *data, size_t len, int /*type*/ ) {
+    std::string &out = pending;
+    out += col ? ',' : '{';
+    put_json_string( out, names[col].data(), names[col].size() );
+    out += ':';
+    if( !data )
+        out += "null";
+    else if( numeric(col) && json_number( data, len ) )
+        out.append( data, len );
+    else if( binary(col) )
+        out += '"', put_base64( out, data, len ), out += '"';
+    else
+        put_json_string( out, data, len );
+    if( pending.size() >= chunk )
+        flush();
+}
+
+void sq::ndjson_writer::row() {
+    put( "}\n", 2 );
+}
+
+sq::json_writer::json_writer( sink &out, const sq::light::json_options &options ) : encoder( out ), options( options ), rows( 0 ), results( 0 ), open( false ) {
+}
+
+void sq::json_writer::field( int col, const char *name, int type, int charset ) {
+    // the output stays one JSON document whatever the result sets: rows of later ones join the same array,
+    // or (options.sets) every result set gets its own array inside an outer one
+    encoder::field( col, name, type, charset );
+    if( col || open )
+        return;
+    if( options.sets ) {
+        put( results++ ? ',' : '[' );
+        if( !options.compact ) put( '\n' );
+    }
+    else if( results++ )
+        return;
+    put( '[' );
+    open = true;
+    rows = 0;
+}
+
+void sq::json_writer::value( int col, const char *data, size_t len, int /*type*/ ) {
+    std::string &out = pending;
+    const char *nl = options.compact ? "" : "\n";
+    if( !col )
+        out += rows++ ? "," : "", out += nl, out += '{', out += nl;
+    else
+        out += ',', out += nl;
+    put_json_string( out, names[col].data(), names[col].size() );
+    out += options.compact ? ":" : ": ";
+    if( !data )
+        out += options.nulls ? "null" : "\"\"";
+    else if( options.typed && numeric(col) && json_number( data, len ) )
+        out.append( data, len );
+    else if( options.base64 && binary(col) )
+        out += '"', put_base64( out, data, len ), out += '"';
+    else
+        put_json_string( out, data, len );
+    if( pending.size() >= chunk )
+        flush();
+}
+
+void sq::json_writer::row() {
+    if( !options.compact ) put( '\n' );
+    put( '}' );
+}
+
+void sq::json_writer::next() {
+    if( !open || !options.sets )
+        return;
+    if( !options.compact ) put( '\n' );
+    put( ']' );
+    open = false;
+}
+
+void sq::json_writer::done() {
+    if( open ) {
+        if( !options.compact ) put( '\n' );
+        put( ']' );
+    }
+    if( results && options.sets ) {
+        if( !options.compact ) put( '\n' );
+        put( ']' );
+    }
+    if( results )
+        put( '\n' );
+    open = false;
+    encoder::done();
+}
+
+sq::msgpack_writer::msgpack_writer( sink &out ) : encoder( out ) {
+}
+
+void sq::msgpack_writer::be( unsigned long long v, int bytes ) {
+    while( bytes-- )
+        put( char( v >> ( bytes * 8 ) ) );
+}
+
+void sq::msgpack_writer::value( int col, const char *data, size_t len, int type ) {
+    // [ref] https://github.com/msgpack/msgpack/blob/master/spec.md
+    auto str = [&]( const char *text, size_t len, bool bin ) {
+        /**/ if( !bin && len < 32 )  put( char(0xa0 | len) );
+        else if( len < 256 )          put( char(bin ? 0xc4 : 0xd9) ), be( len, 1 );
+        else if( len < 65536 )        put( char(bin ? 0xc5 : 0xda) ), be( len, 2 );
+        else                          put( char(bin ? 0xc6 : 0xdb) ), be( len, 4 );
+        put( text, len );
+    };
+
+    if( !col ) {
+        size_t n = names.size();
+        /**/ if( n < 16 )    put( char(0x80 | n) );
+        else if( n < 65536 ) put( char(0xde) ), be( n, 2 );
+        else                 put( char(0xdf) ), be( n, 4 );
+    }
+    str( names[col].data(), names[col].size(), false );
+
+    if( !data )
+        return put( char(0xc0) );
+
+    if( type == sq::light::FIELD_TYPE_FLOAT || type == sq::light::FIELD_TYPE_DOUBLE ) {
+        double f = strtod( data, 0 );
+        unsigned long long bits;
+        memcpy( &bits, &f, 8 );
+        put( char(0xcb) ), be( bits, 8 );
+        return;
+    }
+
+    if( numeric(col) && type != sq::light::FIELD_TYPE_DECIMAL && type != sq::light::FIELD_TYPE_NEW_DECIMAL ) {
+        if( data[0] != '-' ) {
+            unsigned long long u = strtoull( data, 0, 10 );
+            /**/ if( u < 128 )           put( char(u) );
+            else if( u < 256 )           put( char(0xcc) ), be( u, 1 );
+            else if( u < 65536 )         put( char(0xcd) ), be( u, 2 );
+            else if( u < 4294967296ull ) put( char(0xce) ), be( u, 4 );
+            else                         put( char(0xcf) ), be( u, 8 );
+        } else {
+            long long i = strtoll( data, 0, 10 );
+            /**/ if( i >= -32 )          put( char(i) );
+            else if( i >= -128 )         put( char(0xd0) ), be( (unsigned long long)i, 1 );
+            else if( i >= -32768 )       put( char(0xd1) ), be( (unsigned long long)i, 2 );
+            else if( i >= -2147483648ll )put( char(0xd2) ), be( (unsigned long long)i, 4 );
+            else                         put( char(0xd3) ), be( (unsigned long long)i, 8 );
+        }
+        return;
+    }
+
+    // decimals stay text, so no precision is lost
+    str( data, len, binary(col) );
 }
 
 namespace {
 
     struct stats
     {
+        // per index: exact count, sum and extremes, plus a uniform reservoir of hits for percentiles and histograms,
+        // so memory stays bounded however long it runs. the reservoir is sorted lazily, at most once per report
+        enum { reservoir = 1 << 16 };
+
+        struct series {
+            double lo, hi;
+            long double sum;
+            size_t hits;
+            std::vector<double> samples;
+            bool sorted;
+            series() : lo(0), hi(0), sum(0), hits(0), sorted(true) {}
+        };
+
         stats()
         {}
 
-        void hit( const std::string &idx, double taken ) {
-            map[idx].push_back( taken );
+        void hit( const std::string &idx, double taken, unsigned long syscalls ) {
+            std::lock_guard<std::mutex> lock(mutex);
+            series &s = map[idx];
+            s.lo = s.hits && s.lo < taken ? s.lo : taken;
+            s.hi = s.hits && s.hi > taken ? s.hi : taken;
+            s.sum += taken;
+            ++s.hits;
+            if( s.samples.size() < reservoir )
+                s.samples.push_back( taken );
+            else {
+                // algorithm R: the n-th hit replaces a random sample with probability reservoir/n
+                size_t k = size_t( rng() % s.hits );
+                if( k < reservoir ) s.samples[k] = taken;
+            }
+            s.sorted = false;
+            sys[idx] += syscalls;
         }
 
         std::vector<std::string> list() const {
@@ -925,20 +4533,15 @@ namespace {
         }
 
         double mini( const std::string &idx ) const {
-            const auto &vec = map[idx];
-            return *std::min_element(vec.begin(), vec.end());
+            return map[idx].lo;
         }
 
         double maxi( const std::string &idx ) const {
-            const auto &vec = map[idx];
-            return *std::max_element(vec.begin(), vec.end());
+            return map[idx].hi;
         }
 
         double total( const std::string &idx, double div = 1 ) const {
-            long double t = 0;
-            for( auto &in : map[idx] )
-                t += in;
-            return t / div;
+            return map[idx].sum / div;
         }
 
         double avg( const std::string &idx ) const {
@@ -946,12 +4549,64 @@ namespace {
         }
 
         size_t hits( const std::string &idx ) const {
-            return map[idx].size();
+            return map[idx].hits;
+        }
+
+        double syscalls( const std::string &idx ) const {
+            return sys[idx] / double( hits(idx) ? hits(idx) : 1 );
+        }
+
+        double pct( const std::string &idx, double q ) const {
+            series &s = map[idx];
+            if( s.samples.empty() ) return 0;
+            if( !s.sorted )
+                std::sort( s.samples.begin(), s.samples.end() ), s.sorted = true;
+            size_t rank = size_t( std::ceil( q * s.samples.size() ) );
+            return s.samples[ rank ? rank - 1 : 0 ];
+        }
+
+        void reset() {
+            std::lock_guard<std::mutex> lock(mutex);
+            map.clear();
+            sys.clear();
+        }
+
+        std::vector<std::string> histogram( const std::string &idx, unsigned buckets ) const {
+            std::lock_guard<std::mutex> lock(mutex);
+            std::vector<std::string> out;
+            auto found = map.find( idx );
+            if( found == map.end() || found->second.samples.empty() || !buckets )
+                return out;
+
+            // geometric buckets between fastest and slowest hit, since latencies spread over decades.
+            // past the reservoir size, counts are those of the sampled hits
+            const auto &vec = found->second.samples;
+            double lo = mini(idx), hi = maxi(idx);
+            bool geometric = lo > 0 && hi > lo * 2;
+            double step = geometric ? std::pow( hi / lo, 1.0 / buckets ) : ( hi - lo ) / buckets;
+            std::vector<size_t> count( buckets );
+            for( auto &in : vec ) {
+                size_t b = !( hi > lo ) ? 0 : geometric ? size_t( std::log( in / lo ) / std::log( step ) ) : size_t( ( in - lo ) / step );
+                count[ b < buckets ? b : buckets - 1 ]++;
+            }
+
+            size_t top = *std::max_element( count.begin(), count.end() );
+            double from = lo;
+            for( unsigned b = 0; b < buckets; ++b ) {
+                double to = b + 1 == buckets ? hi : geometric ? from * step : from + step;
+                std::stringstream ss;
+                ss << std::fixed << std::setprecision(6) << std::setw(10) << from << " .. " << std::setw(10) << to << " ";
+                ss << std::setw(9) << count[b] << " " << std::string( top ? count[b] * 40 / top : 0, '#' );
+                out.push_back( ss.str() );
+                from = to;
+            }
+            return out;
         }
 
         std::vector<std::string> report( const std::string &_fmt123456, const std::string &sort_key, bool reversed ) const {
+            std::lock_guard<std::mutex> lock(mutex);
 
-            auto format = []( const std::string &fmt123456, const std::string &a, double b, double c, double d, double e, size_t f ){
+            auto format = [&]( const std::string &fmt123456, const std::string &a, double b, double c, double d, double e, size_t f, double g ){
                 std::stringstream ss;
                 for( auto &ch : fmt123456 ) {
                     /**/ if( ch == '\1' ) ss << a;
@@ -960,6 +4615,12 @@ namespace {
                     else if( ch == '\4' ) ss << d;
                     else if( ch == '\5' ) ss << e;
                     else if( ch == '\6' ) ss << f;
+                    else if( ch == '\7' ) ss << g;
+                    // percentiles are only sorted out when asked for
+                    else if( ch == '\16' ) ss << pct(a, 0.50);
+                    else if( ch == '\17' ) ss << pct(a, 0.90);
+                    else if( ch == '\20' ) ss << pct(a, 0.99);
+                    else if( ch == '\21' ) ss << pct(a, 0.999);
                     else                  ss << ch;
                 }
                 return ss.str();
@@ -982,6 +4643,11 @@ namespace {
             fmt123456 = replace( fmt123456, "{total}", "\4" );
             fmt123456 = replace( fmt123456,   "{avg}", "\5" );
             fmt123456 = replace( fmt123456,  "{hits}", "\6" );
+            fmt123456 = replace( fmt123456,   "{sys}", "\7" );
+            fmt123456 = replace( fmt123456,   "{p50}", "\16" );
+            fmt123456 = replace( fmt123456,   "{p90}", "\17" );
+            fmt123456 = replace( fmt123456,   "{p99}", "\20" );
+            fmt123456 = replace( fmt123456,  "{p999}", "\21" );
 
             std::string sort_by;
             /**/ if( sort_key ==   "{idx}" ) sort_by = "\1";
@@ -990,20 +4656,25 @@ namespace {
             else if( sort_key == "{total}" ) sort_by = "\4";
             else if( sort_key ==   "{avg}" ) sort_by = "\5";
             else if( sort_key ==  "{hits}" ) sort_by = "\6";
+            else if( sort_key ==   "{sys}" ) sort_by = "\7";
+            else if( sort_key ==   "{p50}" ) sort_by = "\16";
+            else if( sort_key ==   "{p90}" ) sort_by = "\17";
+            else if( sort_key ==   "{p99}" ) sort_by = "\20";
+            else if( sort_key ==  "{p999}" ) sort_by = "\21";
             else                             sort_by = "\1";
 
             std::map<double,std::vector<std::string>> sort;
             if( sort_by == "\1" ) {
                 for( auto &m : map ) {
                     const std::string &idx = m.first;
-                    std::string fmt = format( fmt123456, idx, mini(idx),maxi(idx),total(idx),avg(idx),hits(idx) );
+                    std::string fmt = format( fmt123456, idx, mini(idx),maxi(idx),total(idx),avg(idx),hits(idx),syscalls(idx) );
                     sort[ sort.size() ].push_back( fmt );
                 }
             } else {
                 for( auto &m : map ) {
                     const std::string &idx = m.first;
-                    std::string res = format( sort_by, idx, mini(idx),maxi(idx),total(idx),avg(idx),hits(idx) );
-                    std::string fmt = format( fmt123456, idx, mini(idx),maxi(idx),total(idx),avg(idx),hits(idx) );
+                    std::string res = format( sort_by, idx, mini(idx),maxi(idx),total(idx),avg(idx),hits(idx),syscalls(idx) );
+                    std::string fmt = format( fmt123456, idx, mini(idx),maxi(idx),total(idx),avg(idx),hits(idx),syscalls(idx) );
 
                     double as_double;
                     std::stringstream ss;
@@ -1029,13 +4700,16 @@ namespace {
             return out;
         }
 
-        mutable std::map< std::string /*call*/, std::vector<double> /*hits*/ > map;
+        mutable std::map< std::string /*call*/, series > map;
+        mutable std::map< std::string /*call*/, unsigned long long /*syscalls*/ > sys;
+        mutable std::mutex mutex;
+        std::mt19937_64 rng;
     } allstats;
 }
 
 
 sq::metrics::metrics( const std::string &index )
-    : cancelled(false), then(std::chrono::steady_clock::now()), idx(index) {
+    : cancelled(false), idx(index), then(std::chrono::steady_clock::now()), sys(0) {
 }
 
 sq::metrics::~metrics() {
@@ -1046,7 +4720,7 @@ void sq::metrics::done() {
     if( !cancelled ) {
         using namespace std::chrono;
         double taken = duration_cast<duration<double,std::ratio<1>>>(steady_clock::now() - then).count();
-        allstats.hit(idx, taken);
+        allstats.hit(idx, taken, sys);
     }
     cancel();
 }
@@ -1055,13 +4729,32 @@ void sq::metrics::cancel() {
     cancelled = true;
 }
 
+void sq::metrics::syscalls( unsigned long count ) {
+    sys = count;
+}
+
 std::vector<std::string> sq::metrics::report( const std::string &_fmt123456, const std::string &sort_key, bool reversed ) {
     return allstats.report( _fmt123456, sort_key, reversed );
 }
 
+std::vector<std::string> sq::metrics::histogram( const std::string &index, unsigned buckets ) {
+    return allstats.histogram( index, buckets );
+}
+
+void sq::metrics::record( const std::string &index, double seconds, unsigned long syscalls ) {
+    allstats.hit( index, seconds, syscalls );
+}
+
+void sq::metrics::reset() {
+    allstats.reset();
+}
+
 #undef $welse
 #undef $windows
 
+#undef SQLIGHT_SHA_NI
+#undef SQLIGHT_TARGET_SHA
+
 #undef INIT
 
 #undef ACCEPT
@@ -1069,7 +4762,7 @@ std::vector<std::string> sq::metrics::report( const std::string &_fmt123456, con
 #undef CLOSE
 #undef READ
 #undef RECV
-#undef SELECT
+#undef POLL
 #undef SEND
 #undef WRITE
 #undef GETSOCKOPT
@@ -1081,6 +4774,11 @@ std::vector<std::string> sq::metrics::report( const std::string &_fmt123456, con
 #undef SHUTDOWN_R
 #undef SHUTDOWN_W
 
+#undef AGAIN
+#undef INTR
+
+#undef TRACE
+
 #ifdef _MSC_VER
 #   pragma warning( pop )
 #endif
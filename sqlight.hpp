@@ -3,18 +3,49 @@
 
 #pragma once
 
+#include <atomic>
 #include <chrono>
+#include <condition_variable>
+#include <future>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
+#include <type_traits>
 #include <vector>
 
 #define SQLIGHT_VERSION "1.0.0" // (2015/09/10) Initial semantic versioning adherence
 
+// compile-time check of a literal exec() format against its arguments, ie, SQLIGHT_CHECK("select ? + ?", a, b);
+#define SQLIGHT_CHECK(format, ...) \
+    static_assert( sq::placeholders(format) == sizeof( sq::arity(__VA_ARGS__) ) - 1, "placeholder count mismatch: " format )
+
 namespace sq
 {
+    class writer;
+    class cursor;
+    class schema;
+    class binlog;
+
+    // '?' placeholders in a query, ignoring those inside quotes. constexpr, so literal formats can be checked at compile time.
+    // it recurses once per character: meant for SQLIGHT_CHECK on literals, not for long formats at runtime
+    constexpr unsigned placeholders( const char *format, char quote = 0 ) {
+        return !*format ? 0
+            : quote ? ( *format == '\\' && format[1] ? placeholders( format + 2, quote ) : placeholders( format + 1, *format == quote ? 0 : quote ) )
+            : *format == '\'' || *format == '"' || *format == '`' ? placeholders( format + 1, *format )
+            : ( *format == '?' ) + placeholders( format + 1 );
+    }
+
+    template<typename... A>
+    char (&arity( const A &... ))[ sizeof...(A) + 1 ];
+
     class light
     {
+        friend class cursor;
+        friend class binlog;
+        friend class fanout;
+
     public:
         enum : unsigned {
             CLIENT_LONG_PASSWORD = 1,           /* New more secure passwords */
@@ -34,7 +65,9 @@ namespace sq
             CLIENT_RESERVED = 16384,            /* Old flag for 4.1 protocol */
             CLIENT_SECURE_CONNECTION = 32768,   /* New 4.1 authentication */
             CLIENT_MULTI_STATEMENTS = 65536,    /* Enable/disable multi-stmt support */
-            CLIENT_MULTI_RESULTS = 131072       /* Enable/disable multi-results */
+            CLIENT_MULTI_RESULTS = 131072,      /* Enable/disable multi-results */
+            CLIENT_PLUGIN_AUTH = 524288,        /* Client supports plugin authentication */
+            CLIENT_SESSION_TRACK = 8388608      /* Capable of handling server state change information */
         //  CLIENT_REMEMBER_OPTIONS = (((ulong) 1) << 31)
         };
 
@@ -68,44 +101,644 @@ namespace sq
             FIELD_TYPE_YEAR = 13
         };
 
+        // client-side error codes, as libmysql reports them
+        enum : unsigned {
+            CR_UNKNOWN_ERROR = 2000,
+            CR_CONNECTION_ERROR = 2002,
+            CR_CONN_HOST_ERROR = 2003,
+            CR_UNKNOWN_HOST = 2005,
+            CR_SERVER_GONE_ERROR = 2006,
+            CR_SERVER_LOST = 2013,
+            CR_MALFORMED_PACKET = 2027
+        };
+
         typedef unsigned char  byte;
         typedef unsigned short dword;
 
+        struct backoff {
+            unsigned attempts;          // handshake attempts per reconnect()
+            double base, cap;           // attempt n sleeps rand(0, min(cap, base * 2^n)) seconds
+            unsigned trip;              // consecutive failures per endpoint that open the circuit breaker
+            double cooldown;            // seconds the breaker stays open before a single probe is let through
+            backoff() : attempts(4), base(0.025), cap(1.0), trip(8), cooldown(2.0) {}
+        };
+
+        struct timeouts {
+            double connect;             // seconds to establish the tcp connection
+            double handshake;           // seconds to authenticate once connected
+            double send, recv;          // seconds to send a command and to receive its whole response
+            timeouts() : connect(10), handshake(10), send(30), recv(30) {} // 0 waits forever
+        };
+
+        // i/o counters, per connection or for every connection in the process. they are bumped with relaxed atomics,
+        // so reading them from any thread is cheap, but fields are not a consistent snapshot of each other
+        struct counters {
+            unsigned long long bytes_sent, bytes_received;
+            unsigned long long packets_sent, packets_received;
+            unsigned long long queries, results, rows;
+            unsigned long long connects, reconnects;   // connects: connect() calls that went through; reconnects: every later one
+            unsigned long long errors;                 // errors: every failed call, client or server side
+            std::map<unsigned, unsigned long long> codes; // errors by MySQL error code: server (ie, 1064, 1213) and client (CR_*)
+            counters() : bytes_sent(0), bytes_received(0), packets_sent(0), packets_received(0), queries(0), results(0), rows(0), connects(0), reconnects(0), errors(0) {}
+        };
+
+#ifdef SQLIGHT_TRACE
+        // tracing hooks. they only exist when SQLIGHT_TRACE is defined for the whole project, so they cost nothing otherwise.
+        // data is the query text for TRACE_QUERY, TRACE_DONE and TRACE_FAILED, and the raw bytes for TRACE_SENT and TRACE_RECEIVED
+        // (whole packets, headers included, as written; payloads only, as parsed). called from whichever thread runs the query.
+        enum { TRACE_QUERY, TRACE_DONE, TRACE_FAILED, TRACE_SENT, TRACE_RECEIVED };
+        typedef void (*tracer) (void *userdata, const sq::light &conn, int event, const char *data, size_t len );
+#endif
+
+        // why the last call failed: server errors come from the error packet, client ones (CR_*) carry sqlstate HY000
+        struct error {
+            unsigned code;              // 0 once a call succeeds
+            char sqlstate[6];           // ie, "40001"
+            std::string message;
+            bool timeout;               // deadline expired: not retried, since the query got killed
+            error() : code(0), sqlstate(), timeout(false) {}
+            void clear() { code = 0, sqlstate[0] = 0, message.clear(), timeout = false; }
+            bool retryable() const;     // transient, worth another try: deadlocks, lock wait timeouts, lost connections...
+        };
+
+        // automatic retries for idempotent reads (see sq::router::is_read) through test(), exec(callback) and json(),
+        // after a retryable error and only outside transactions. lost connections are reconnected first.
+        struct retry {
+            unsigned attempts;          // tries per call, first one included (1: never retry)
+            double base, cap;           // try n sleeps rand(0, min(cap, base * 2^n)) seconds
+            retry() : attempts(1), base(0.01), cap(0.5) {}
+        };
+
+        struct json_options {
+            bool typed;                 // numeric columns unquoted
+            bool nulls;                 // SQL NULL as null rather than ""
+            bool base64;                // binary columns base64 encoded
+            bool compact;               // no newlines
+            bool sets;                  // one array per result set, inside an outer array. off: rows of every result set in one array
+            json_options() : typed(true), nulls(true), base64(true), compact(true), sets(false) {}
+        };
+
          light();
         ~light();
 
-        bool connect( const std::string &host = "localhost", const std::string &port = "3306", const std::string &user = "root", const std::string &password = "root" );
+        bool connect( const std::string &host = "localhost", const std::string &port = "3306", const std::string &user = "root", const std::string &password = "root", const std::string &db = std::string() );
         bool reconnect();
         void disconnect();
-        bool is_connected();
+        bool is_connected( bool roundtrip = false );
+
+        bool ping();
+        void prewarm();
+        void set_backoff( const backoff &policy );
+        void set_timeouts( const timeouts &defaults );
+        void set_dns_ttl( double seconds );
+        void set_spill( size_t bytes );                 // exec() grids past this size go to mapped temp files (0: never; ignored on windows)
+        void set_retry( const retry &policy );
+
+        // session state. db (see connect()) and variables set here are restored on every reconnect, in one round trip at most.
+        // schema and variables are tracked from the server (CLIENT_SESSION_TRACK), so USE and SET statements that would
+        // change nothing (plain literal values only) are answered locally, without a round trip, pipelined ones included.
+        // servers without session tracking get every USE and SET sent as is.
+        // value is SQL, ie, "'UTC'" or "1". when connected, the SET runs first and nothing is kept if the server rejects it.
+        // before connect() it is only recorded, unchecked: connect() then fails if the server rejects it.
+        bool set_session( const std::string &variable, const std::string &value );
+        std::string database();
+        std::map<std::string, std::string> session();
+
+        bool tcp_keepalive( int idle, int interval, int count );
+        void keepalive( double idle );
+
+        counters stats();
+        static counters totals();
+        error last_error();                             // submit() batches: the last failed query of the batch
+#ifdef SQLIGHT_TRACE
+        void trace( tracer fn, void *userdata = (void*)0 );
+#endif
 
         typedef void (*callback3) (void *userdata, int w, int h, const char **map );
+        typedef void (*callback4) (void *userdata, int w, int h, const char **map, const size_t *lens ); // binary safe
 
-        bool test( const std::string &query );
-        bool exec( const std::string &query, sq::light::callback3 cb, void *userdata = (void*)0 );
+        // a positive timeout is the deadline in seconds for the whole call, overriding set_timeouts().
+        // when it expires the query gets killed server-side and the connection is dropped.
+        bool test( const std::string &query, double timeout = 0 );
+        bool exec( const std::string &query, sq::light::callback3 cb, void *userdata = (void*)0, double timeout = 0 );
+        bool exec( const std::string &query, sq::light::callback4 cb, void *userdata = (void*)0, double timeout = 0 );
+        bool exec( const std::string &query, sq::writer &out, double timeout = 0 ); // rows streamed into out as they arrive
 
-        std::string json( const std::string &query );
-        bool json( const std::string &query, std::string &result );
+        // first column of every row, raw bytes back to back, straight from the socket into fd (spliced on linux).
+        // values are never buffered whole, so blobs of any size take constant memory. NULLs write nothing.
+        bool blob( const std::string &query, int fd, double timeout = 0 );
+
+        // callers from any thread queue up lock-free, then wait for the connection: the first one through sends the whole
+        // queue in one pipelined batch, and the rest get their futures answered from it. so out (if any) is fed from one
+        // of the submitting threads, not necessarily this one. writers must not call back into the same connection.
+        // queries are counted and timed in sq::metrics as exec() does, and retried like test() is (set_retry(), never with a
+        // writer, since rows already fed cannot be taken back). a retried read goes again after the rest of its batch.
+        std::future<bool> submit( const std::string &query, sq::writer *out = (sq::writer*)0, double timeout = 0 );
+        // all of queries queued at once, in order, so they go out in the same batch. one future per query
+        std::vector< std::future<bool> > submit( const std::vector<std::string> &queries, sq::writer *out = (sq::writer*)0, double timeout = 0 );
+
+        // client-side binding: every '?' in format is replaced by the next argument, formatted and escaped straight
+        // into the send buffer. strings are quoted (a char is a one letter string), numbers are not, nullptr (or a null char pointer) becomes NULL.
+        template<typename... A>
+        bool exec( sq::writer &out, const char *format, const A &... args ) {
+            if( !connected )
+                return false;
+            hold lock( *this );
+            if( marks( format ) != sizeof...(A) )
+                return fail( "placeholder count mismatch" );
+            frame();
+            binds( format, args... );
+            return execs( format, &out, 0, d - b - 4 );
+        }
+
+        std::string json( const std::string &query, double timeout = 0 );
+        bool json( const std::string &query, std::string &result, double timeout = 0 );
+        std::string json( const std::string &query, const json_options &options, double timeout = 0 );
+        bool json( const std::string &query, std::string &result, const json_options &options, double timeout = 0 );
+
+        // columns of the last result set (0 if the last query returned none). shared with later runs of the same query shape
+        std::shared_ptr<const sq::schema> schema();
 
     protected:
-        bool connected;
-        std::string host, port, user;
-        std::vector<unsigned char> pass;
+        struct job {
+            std::string query;
+            sq::writer *out;
+            double timeout;
+            std::promise<bool> done;
+            job *next;
+            error failure;                              // of a failed query worth a retry once the batch is read
+        };
+
+        struct hold {
+            light &self;
+            explicit hold( light &self ) : self(self) { self.mutex.lock(); }
+            ~hold() { self.mutex.unlock(); }
+        };
+
+        struct tally {
+            std::atomic<unsigned long long> bytes_sent, bytes_received;
+            std::atomic<unsigned long long> packets_sent, packets_received;
+            std::atomic<unsigned long long> queries, results, rows;
+            std::atomic<unsigned long long> connects, reconnects, errors;
+            std::mutex mutex;                           // codes only: errors are rare
+            std::map<unsigned, unsigned long long> codes;
+            tally();
+            counters snapshot();
+        };
+
+        std::atomic<bool> connected;
+        std::atomic<job *> inbox;
+        std::vector< std::pair<std::string,std::string> > hosts;
+        std::string host, port, user;                   // host and port of the current endpoint
+        double ttl;
+        std::vector<unsigned char> pass, pass2;         // SHA1(password), SHA1(SHA1(password))
+        std::vector<unsigned char> pass256, pass2562;   // SHA256(password), SHA256(SHA256(password))
+        std::string secret;                             // cleartext password, only ever sent over unix sockets
 
         int s, i;
-        unsigned ret, no;
+        unsigned ret, no, tid, status;                 // status: server flags of the last OK/EOF
+        byte seq;
+        unsigned long syscalls;
 
-        std::vector<char> buf;
+        std::vector<char> buf, rx;
         char *b, *d;
+        size_t head, tail;
+
+        std::vector<char> arena;                        // exec() result cells, reused across queries
+        std::vector<size_t> offsets;
+        std::vector<const char *> cells;
+        std::vector<size_t> lengths;
+
+        unsigned long long print;                       // fingerprint of the query in flight, keys the schema cache
+        std::shared_ptr<sq::schema> shape;
+        std::map< unsigned long long, std::shared_ptr<sq::schema> > schemas;
 
         std::mutex mutex;
 
+        backoff policy;
+        bool warming;
+        std::shared_ptr<light> standby;
+        std::future<bool> spare;                        // from a promise, not std::async: dropping it never waits for the handshake
+
+        timeouts limits;
+        bool expired;
+        std::chrono::steady_clock::time_point until;
+
+        int keepidle, keepintvl, keepcnt;
+        double idle;
+        bool stopping;
+        std::chrono::steady_clock::time_point last;
+        std::thread keeper;
+        std::mutex keeper_mutex;
+        std::condition_variable keeper_cv;
+
+        size_t spill;
+        bool tracking;                                  // server reports session state changes
+        std::string db, used;                           // database asked for, database in use
+        std::vector< std::pair<std::string,std::string> > presets;
+        std::map<std::string, std::string> vars;        // session variables as last reported
+
+        error failure;
+        retry again;
+
+        tally io;
+        static tally &all;                              // never destroyed: detached helpers may still count during exit
+#ifdef SQLIGHT_TRACE
+        tracer tracing;
+        void *traced;
+#endif
+
         bool open();
-        bool sends( const std::string &command );
-        bool recvs( void *userdata, void* onvalue, void* onfield, void *onsep );
-        bool fail( const char *error = 0, const char *title = 0 );
-        bool acquire();
+        bool reconnects( bool first = false );
+        void disconnects();
+        void prewarms();
+        std::future<bool> enqueue( const std::string &query, sq::writer *out, double timeout );
+        void drain();
+        void pipeline( job *fifo );
+        bool unix_domain() const;
+        unsigned scramble( const std::string &plugin, const byte *salt, byte *out );
+        bool sends( const std::string &query, byte command = 0x03 );
+        void frame();
+        char *room( size_t count );
+        const char *spans( const char *format );
+        static unsigned marks( const char *format );    // placeholders() at runtime, in a loop: formats can be long
+        void binds( const char *format ) { spans( format ); }
+        template<typename T, typename... A>
+        void binds( const char *format, const T &arg, const A &... args ) {
+            format = spans( format );
+            put( arg );
+            binds( format + 1, args... );
+        }
+        template<typename T>
+        void put( const T &number ) {
+            static_assert( std::is_arithmetic<T>::value, "sq::light: unsupported parameter type" );
+            static_assert( !std::is_same<T, signed char>::value && !std::is_same<T, unsigned char>::value,
+                "sq::light: (u)int8_t is ambiguous: cast it to int for a number, or pass a char or a string for text" );
+            static_assert( !std::is_same<T, wchar_t>::value && !std::is_same<T, char16_t>::value && !std::is_same<T, char32_t>::value,
+                "sq::light: wide characters are not supported: pass an utf8 string" );
+            std::is_floating_point<T>::value ? put( double(number) )
+                : std::is_signed<T>::value ? put( (long long)number ) : put( (unsigned long long)number );
+        }
+        void put( long long number );
+        void put( unsigned long long number );
+        void put( double number );
+        void put( bool flag );
+        void put( std::nullptr_t );
+        void put( const char *text );
+        void put( char *text ) { put( (const char *)text ); }
+        void put( char letter ) { quote( &letter, 1 ); }  // a character is text, not its code
+        void put( const std::string &text );
+        void quote( const char *text, size_t len );
+        bool pings();
+        bool tune();
+        void arm( double seconds );
+        bool wait( bool writable );
+        bool sendall( const void *buffer, size_t count );
+        bool fill( size_t need );
+        char *packet( unsigned &len );
+        void kill();
+        void inherit( const light &from );
+        bool recvs( sq::writer *out );
+        bool execs( const std::string &query, sq::writer *out, double timeout, size_t framed = 0 );
+        bool grids( const std::string &query, callback3 cb3, callback4 cb4, void *userdata, double timeout );
+        bool blobs( int fd );
+        bool drains( int fd, size_t count, bool &written );
+        bool fail( const char *error = 0, const char *title = 0, unsigned code = CR_UNKNOWN_ERROR );
+        bool fails( const char *packet, unsigned len, const char *title = 0 );
+        bool retries( const std::string &query, unsigned attempt );
+        bool tests( const std::string &query, double timeout );
+        bool restores();
+        void tracks( const char *ok, const char *end );
+        bool redundant( const std::string &query );
+        void remember( const std::string &query );
+        void count( std::atomic<unsigned long long> tally::*counter, unsigned long long n = 1 );
+        bool acquire( size_t capacity = 1 << 18 );
         void release();
+        bool adopt();
+    };
+
+    // result stream consumer, fed straight from the protocol parser while rows arrive.
+    // data points into the read buffer: it is NUL terminated, but only valid during the call. NULL comes as 0.
+    class writer
+    {
+    public:
+        virtual ~writer() {}
+
+        virtual void field( int /*col*/, const char * /*name*/, int /*type*/, int /*charset*/ ) {}
+        virtual void columns( const sq::schema & /*cols*/ ) {}  // after the last field() of every result set
+        virtual void value( int /*col*/, const char * /*data*/, size_t /*len*/, int /*type*/ ) {}
+        virtual void row() {}                               // after the last value of every row
+        virtual void next() {}                              // another result set follows
+        virtual void done() {}                              // after the last result set
+    };
+
+    // result set columns, with everything the server tells about them. built once per query shape
+    // and shared by later executions, as long as the server keeps sending the same column definitions.
+    class schema
+    {
+    public:
+        enum : unsigned {
+            NOT_NULL_FLAG = 1,
+            PRI_KEY_FLAG = 2,
+            UNIQUE_KEY_FLAG = 4,
+            MULTIPLE_KEY_FLAG = 8,
+            BLOB_FLAG = 16,
+            UNSIGNED_FLAG = 32,
+            ZEROFILL_FLAG = 64,
+            BINARY_FLAG = 128,
+            ENUM_FLAG = 256,
+            AUTO_INCREMENT_FLAG = 512,
+            TIMESTAMP_FLAG = 1024,
+            SET_FLAG = 2048
+        };
+
+        struct column {
+            std::string name, table, db;
+            std::string org_name, org_table;                // before aliasing
+            int type, charset, decimals;
+            unsigned length, flags;
+        };
+
+        size_t size() const;
+        const column &operator[]( size_t col ) const;
+        int find( const std::string &name ) const;          // index of a column, -1 if missing. first one wins on duplicates
+
+    protected:
+        friend class light;
+        friend class cursor;
+        std::vector< column > columns;
+        std::vector< unsigned long long > digests;          // hash of every raw column definition, to validate reuse
+        std::vector< int > slots;                           // perfect hash of names: column index, -1 if empty
+        unsigned long long seed;
+
+        void index();
+    };
+
+    class sink
+    {
+    public:
+        virtual ~sink() {}
+        virtual bool write( const char *data, size_t len ) = 0;
+    };
+
+    class fd_sink : public sink
+    {
+    public:
+        explicit fd_sink( int fd );
+        bool write( const char *data, size_t len );
+    protected:
+        int fd;
+    };
+
+    class buffer_sink : public sink
+    {
+    public:
+        explicit buffer_sink( std::string &buffer );
+        bool write( const char *data, size_t len );
+    protected:
+        std::string &buffer;
+    };
+
+    // encoders batch output in chunks before handing it to the sink, so memory stays bounded whatever the result size
+    class encoder : public writer
+    {
+    public:
+        explicit encoder( sink &out, size_t chunk = 1 << 16 );
+        ~encoder();
+
+        bool good() const;                                  // false once the sink failed
+        void field( int col, const char *name, int type, int charset );
+        void done();
+
+    protected:
+        sink &out;
+        size_t chunk;
+        bool failed;
+        std::string pending;
+        std::vector< std::string > names;
+        std::vector< int > types, charsets;
+
+        void put( const char *data, size_t len );
+        void put( const std::string &text );
+        void put( char ch );
+        void flush();
+        bool numeric( int col ) const;
+        bool binary( int col ) const;
+    };
+
+    class csv_writer : public encoder                      // RFC 4180. header line per result set, NULL is an empty unquoted cell
+    {
+    public:
+        explicit csv_writer( sink &out );
+        void value( int col, const char *data, size_t len, int type );
+        void row();
+        void next();
+        void done();
+    protected:
+        bool header;
+        void line();
+    };
+
+    class ndjson_writer : public encoder                   // one JSON object per row and line; numbers unquoted, NULL as null, binary as base64
+    {
+    public:
+        explicit ndjson_writer( sink &out );
+        void value( int col, const char *data, size_t len, int type );
+        void row();
+    };
+
+    class json_writer : public encoder                     // one JSON array of objects, or an array of them per result set (see json_options)
+    {
+    public:
+        explicit json_writer( sink &out, const sq::light::json_options &options = sq::light::json_options() );
+        void field( int col, const char *name, int type, int charset );
+        void value( int col, const char *data, size_t len, int type );
+        void row();
+        void next();
+        void done();
+    protected:
+        sq::light::json_options options;
+        size_t rows, results;
+        bool open;
+    };
+
+    class msgpack_writer : public encoder                  // one map per row: nil, int, float64, bin or str values
+    {
+    public:
+        explicit msgpack_writer( sink &out );
+        void value( int col, const char *data, size_t len, int type );
+    protected:
+        void be( unsigned long long v, int bytes );
+    };
+
+    // server-side cursor: COM_STMT_PREPARE, COM_STMT_EXECUTE with CURSOR_TYPE_READ_ONLY, then COM_STMT_FETCH n rows at a time.
+    // the server keeps the result set, so client memory stays bounded by one chunk. rows reach the writer as one result set.
+    class cursor
+    {
+    public:
+        explicit cursor( sq::light &conn, unsigned rows = 1000 );
+        ~cursor();
+
+        bool open( const std::string &query, double timeout = 0 );     // queries without placeholders
+        bool fetch( sq::writer &out, double timeout = 0 );             // next chunk of rows
+        bool eof() const;                                               // every row was fetched
+        void close();
+
+    protected:
+        cursor( const cursor &other );
+        cursor &operator=( const cursor &other );
+
+        sq::light &conn;
+        unsigned rows, stmt;
+        bool opened, exhausted, streaming, described;
+        sq::schema shape;                               // of the result set, as EXECUTE describes it
+
+        void closes();
+        bool broken();
+    };
+
+    // change data capture: row-based binlog events streamed from a primary, the way a replica gets them.
+    // needs binlog_format=ROW and REPLICATION SLAVE/CLIENT grants. the connection is dedicated to the stream once opened.
+    class binlog
+    {
+    public:
+        enum : int { INSERT = 1, UPDATE, DELETE, QUERY, COMMIT };
+
+        struct position {
+            std::string file;                               // empty: from the current end of the binlog
+            unsigned long long offset;
+            std::string gtids;                              // executed GTID set ("uuid:1-100,..."). when set, file/offset are not used
+            position() : offset(4) {}
+        };
+
+        struct event {
+            int type;
+            unsigned timestamp;
+            std::string db, table, query;                   // query: statement of a QUERY event (ie, DDL)
+            int w, h;                                       // columns and rows. UPDATE rows come in pairs: before, then after
+            const char **cells;                             // w*h values as text, row by row. NULL (or not logged) is 0
+            const size_t *lens;
+            const int *types;                               // w column types, FIELD_TYPE_* like
+            const char **names;                             // w column names (binlog_row_metadata=FULL), "@1".."@w" otherwise
+        };
+
+        typedef void (*callback)( void *userdata, const event &ev );
+
+        explicit binlog( sq::light &conn, unsigned server_id = 0 );    // id must be unique among replicas: 0 picks a random one
+        ~binlog();
+
+        bool open( const position &from = position(), double timeout = 0 );
+        bool poll( callback cb, void *userdata = (void*)0, double timeout = 0 ); // events at hand, waiting timeout for the first
+        const position &where() const;                                  // checkpoint: every event up to here was delivered
+        void close();
+
+    protected:
+        binlog( const binlog &other );
+        binlog &operator=( const binlog &other );
+
+        struct table {
+            std::string db, name;
+            std::vector< unsigned char > types;
+            std::vector< unsigned > metas;
+            std::vector< bool > unsigneds;
+            std::vector< std::string > names;
+        };
+
+        sq::light &conn;
+        unsigned server;
+        unsigned checksum;                                  // trailer bytes of every event
+        bool opened;
+        position at;
+        std::map< unsigned long long, table > tables;
+        std::map< std::string, std::vector< std::pair<unsigned long long, unsigned long long> > > executed;
+        std::string gtid;                                   // of the transaction in flight
+        std::vector< char > arena;
+        std::vector< size_t > offsets;
+        std::vector< const char * > cells;
+        std::vector< size_t > lens;
+        std::vector< int > types;
+        std::vector< const char * > names;
+
+        bool broken();
+        bool maps( const char *p, const char *end );
+        bool rows( const char *p, const char *end, int type, bool v2, bool update, unsigned timestamp, callback cb, void *userdata );
+        void commit( unsigned long long offset );
+    };
+
+    // a router belongs to one thread at a time, like the transaction it pins to the primary.
+    // replicas are probed on a background thread of its own, so route() only reads their cached health.
+    class router
+    {
+    public:
+         router();
+        ~router();
+
+        bool primary( const std::string &host, const std::string &port, const std::string &user, const std::string &password );
+        bool replica( const std::string &host, const std::string &port, const std::string &user, const std::string &password );
+
+        // every interval seconds, in background, dead replicas are reconnected and lag is sampled with query (seconds);
+        // replicas lagging more than max_lag (or not replicating) get no reads
+        void set_lag_check( const std::string &query, double max_lag, double interval = 1 );
+
+        // SELECT/SHOW/DESCRIBE/EXPLAIN are reads, unless locking or session-bound. /*primary*/ and /*replica*/ hints override
+        static bool is_read( const std::string &query );
+        sq::light &route( const std::string &query );
+
+        bool test( const std::string &query, double timeout = 0 );
+        bool exec( const std::string &query, sq::light::callback3 cb, void *userdata = (void*)0, double timeout = 0 );
+
+        std::string json( const std::string &query, double timeout = 0 );
+        bool json( const std::string &query, std::string &result, double timeout = 0 );
+
+    protected:
+        router( const router &other );
+        router &operator=( const router &other );
+
+        sq::light writer;
+        std::vector< std::unique_ptr<sq::light> > readers;
+        std::vector< double > lags;             // HUGE_VAL: replica down
+
+        std::string lag_query;
+        double max_lag, lag_interval;
+
+        size_t next;
+        bool transaction;
+
+        bool stopping, rush;                    // readers, lags and lag settings are shared with prober under probe_mutex
+        std::thread prober;
+        std::mutex probe_mutex;
+        std::condition_variable probe_cv;
+
+        void probes();
+    };
+
+    class fanout
+    {
+    public:
+        enum { CONCAT, ORDERED, COUNT, SUM, MIN, MAX };
+
+        struct merge {
+            int mode;
+            std::string key;            // ORDERED: column every shard is sorted by. COUNT..MAX: optional group-by column
+            bool descending;
+            merge( int mode = CONCAT, const std::string &key = std::string(), bool descending = false ) : mode(mode), key(key), descending(descending) {}
+        };
+
+        fanout();
+
+        void add( sq::light &shard );
+        size_t size() const;
+
+        // same query on every shard, or one query per shard. fails as a whole if any shard fails
+        bool exec( const std::string &query, const merge &how, sq::light::callback3 cb, void *userdata = (void*)0, double timeout = 0 );
+        bool exec( const std::vector<std::string> &queries, const merge &how, sq::light::callback3 cb, void *userdata = (void*)0, double timeout = 0 );
+
+        std::string json( const std::string &query, const merge &how = merge(), double timeout = 0 );
+        bool json( const std::string &query, std::string &result, const merge &how = merge(), double timeout = 0 );
+        bool json( const std::vector<std::string> &queries, std::string &result, const merge &how = merge(), double timeout = 0 );
+
+    protected:
+        std::vector< sq::light * > shards;
     };
 
     class metrics
@@ -117,8 +750,12 @@ namespace sq
 
         void done();
         void cancel();
+        void syscalls( unsigned long count );
 
         static std::vector<std::string> report( const std::string &_fmt123456, const std::string &sort_key = "{total}", bool reversed = true );
+        static std::vector<std::string> histogram( const std::string &index, unsigned buckets = 16 );
+        static void record( const std::string &index, double seconds, unsigned long syscalls = 0 );
+        static void reset();
 
     protected:
         metrics();
@@ -128,5 +765,6 @@ namespace sq
         bool cancelled;
         std::string idx;
         std::chrono::steady_clock::time_point then;
+        unsigned long sys;
     };
 }
@@ -0,0 +1,179 @@
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "sqlight.hpp"
+
+// load generator: runs a weighted mix of queries across threads sharing a pool of connections.
+// closed loop by default (every thread sends as fast as it is answered), or open loop at a fixed rate,
+// where latency is measured from the scheduled send time so a stalled server is not hidden.
+
+int main( int argc, const char **argv )
+{
+    std::string host = "localhost", port = "3306", user = "root", pass = "root";
+    unsigned threads = 4, connections = 0, depth = 1, buckets = 16;
+    double seconds = 10, rate = 0;
+    std::vector< std::pair<unsigned, std::string> > mix;
+
+    auto usage = [&]() {
+        std::cerr << "usage: " << argv[0] << " [options]" << std::endl;
+        std::cerr << "  -h host        server, or comma-separated failover list (localhost)" << std::endl;
+        std::cerr << "  -P port        (3306)" << std::endl;
+        std::cerr << "  -u user        (root)" << std::endl;
+        std::cerr << "  -p pass        (root)" << std::endl;
+        std::cerr << "  -t threads     client threads (4)" << std::endl;
+        std::cerr << "  -c conns       pooled connections shared by all threads (one per thread)" << std::endl;
+        std::cerr << "  -d seconds     run length (10)" << std::endl;
+        std::cerr << "  -r rate        queries per second across all threads, open loop (0: closed loop)" << std::endl;
+        std::cerr << "  -k depth       queries pipelined per submission (1)" << std::endl;
+        std::cerr << "  -b buckets     histogram buckets (16)" << std::endl;
+        std::cerr << "  -q weight:sql  add a query to the mix, picked by weight (1:select 1)" << std::endl;
+        return 1;
+    };
+
+    for( int i = 1; i < argc; ++i ) {
+        std::string opt = argv[i];
+        if( opt.size() != 2 || opt[0] != '-' || i + 1 >= argc )
+            return usage();
+        std::string arg = argv[++i];
+        /**/ if( opt == "-h" ) host = arg;
+        else if( opt == "-P" ) port = arg;
+        else if( opt == "-u" ) user = arg;
+        else if( opt == "-p" ) pass = arg;
+        else if( opt == "-t" ) threads = std::stoul(arg);
+        else if( opt == "-c" ) connections = std::stoul(arg);
+        else if( opt == "-d" ) seconds = std::stod(arg);
+        else if( opt == "-r" ) rate = std::stod(arg);
+        else if( opt == "-k" ) depth = std::stoul(arg);
+        else if( opt == "-b" ) buckets = std::stoul(arg);
+        else if( opt == "-q" ) {
+            size_t colon = arg.find(':');
+            if( colon == std::string::npos || colon == 0 || arg.find_first_not_of("0123456789") != colon )
+                return usage();
+            mix.push_back( std::make_pair( unsigned( std::stoul( arg.substr(0, colon) ) ), arg.substr(colon + 1) ) );
+        }
+        else return usage();
+    }
+
+    if( mix.empty() )
+        mix.push_back( std::make_pair( 1u, std::string("select 1") ) );
+    if( !threads || !depth )
+        return usage();
+    if( !connections )
+        connections = threads;
+
+    unsigned weights = 0;
+    for( auto &m : mix )
+        weights += m.first;
+    if( !weights )
+        return usage();
+
+    // connection pool
+
+    std::vector< std::unique_ptr<sq::light> > pool;
+    for( unsigned i = 0; i < connections; ++i ) {
+        pool.push_back( std::unique_ptr<sq::light>( new sq::light ) );
+        if( !pool.back()->connect( host, port, user, pass ) )
+            return std::cerr << "error: connection #" << i << " to database failed" << std::endl, 1;
+    }
+
+    std::cout << "connected " << connections << " connection(s). " << threads << " thread(s), depth " << depth << ", ";
+    if( rate > 0 ) std::cout << rate << " q/s open loop";
+    else           std::cout << "closed loop";
+    std::cout << ", " << seconds << "s" << std::endl;
+
+    // labels in sq::metrics. client-side latency goes under "> query", next to the per-query timings sqlight records itself
+
+    std::vector<std::string> labels;
+    for( auto &m : mix )
+        labels.push_back( "> " + m.second );
+
+    sq::metrics::reset();
+
+    typedef std::chrono::steady_clock clock;
+    std::atomic<unsigned> next(0);
+    std::atomic<unsigned long long> sent(0), failed(0);
+    const clock::time_point start = clock::now(), stop = start + std::chrono::microseconds( (long long)( seconds * 1e6 ) );
+
+    auto worker = [&]( unsigned id ) {
+        std::mt19937 rng( id * 2654435761u + 1 );
+        std::uniform_int_distribution<unsigned> pick( 0, weights - 1 );
+
+        // open loop: each thread owns an even share of the rate, staggered so threads do not fire in lockstep
+        double every = rate > 0 ? threads * depth / rate : 0;
+        clock::time_point due = start + std::chrono::microseconds( (long long)( every * 1e6 * id / threads ) );
+
+        std::vector<size_t> chosen( depth );
+        std::vector<std::string> batch( depth );
+
+        for( ;; ) {
+            if( every > 0 ) {
+                if( due >= stop ) break;
+                std::this_thread::sleep_until( due );
+            }
+            clock::time_point sent_at = every > 0 ? due : clock::now();
+            if( sent_at >= stop ) break;
+
+            sq::light &sql = *pool[ next++ % pool.size() ];
+            for( unsigned q = 0; q < depth; ++q ) {
+                unsigned w = pick( rng ), m = 0;
+                while( w >= mix[m].first ) w -= mix[m++].first;
+                chosen[q] = m;
+                batch[q] = mix[m].second;
+            }
+            std::vector< std::future<bool> > pending = sql.submit( batch );
+            // the batch goes out in one write at sent_at, so each query is timed until its own response is in
+            for( unsigned q = 0; q < depth; ++q ) {
+                bool ok = pending[q].get();
+                double taken = std::chrono::duration_cast< std::chrono::duration<double> >( clock::now() - sent_at ).count();
+                if( ok ) sq::metrics::record( labels[ chosen[q] ], taken );
+                else failed++;
+            }
+            sent += depth;
+
+            if( every > 0 )
+                due += std::chrono::microseconds( (long long)( every * 1e6 ) );
+        }
+    };
+
+    std::vector<std::thread> team;
+    for( unsigned i = 0; i < threads; ++i )
+        team.push_back( std::thread( worker, i ) );
+    for( auto &t : team )
+        t.join();
+
+    double elapsed = std::chrono::duration_cast< std::chrono::duration<double> >( clock::now() - start ).count();
+
+    // throughput, latency percentiles and histograms
+
+    std::cout << "sent " << sent << " queries in " << elapsed << "s: " << ( sent - failed ) / elapsed << " q/s, " << failed << " failed" << std::endl;
+
+    sq::light::counters io = sq::light::totals();
+    std::cout << "sent " << io.bytes_sent << " bytes in " << io.packets_sent << " packets, received " << io.bytes_received << " bytes in "
+              << io.packets_received << " packets, " << io.rows << " rows" << std::endl;
+    for( auto &e : io.codes )
+        std::cout << "server error " << e.first << " (x" << e.second << ")" << std::endl;
+
+    std::string format = "{idx} (x{hits}) avg:{avg} p50:{p50} p90:{p90} p99:{p99} p99.9:{p999} max:{max}";
+    for( auto &line : sq::metrics::report( format, "{hits}", true ) ) {
+        if( line.compare( 0, 2, "> " ) == 0 )
+            std::cout << line << std::endl;
+    }
+
+    for( auto &label : labels ) {
+        auto histogram = sq::metrics::histogram( label, buckets );
+        if( histogram.empty() )
+            continue;
+        std::cout << std::endl << label << std::endl;
+        for( auto &line : histogram )
+            std::cout << line << std::endl;
+    }
+
+    return failed ? 2 : 0;
+}
@@ -0,0 +1,87 @@
+#include <chrono>
+#include <ctime>
+#include <iostream>
+#include <string>
+
+#include "sqlight.hpp"
+
+// transport microbenchmark: the same round trips over loopback tcp and over a unix domain socket, against one
+// co-located server. both paths run the same protocol stack, so any difference is the kernel transport itself.
+// client cpu per query includes the syscalls, which is where the unix socket saves most.
+
+int main( int argc, const char **argv )
+{
+    std::string host = "127.0.0.1", port = "3306", path = "/var/run/mysqld/mysqld.sock", user = "root", pass = "root", query = "select 1";
+    unsigned count = 10000, connects = 100;
+
+    auto usage = [&]() {
+        std::cerr << "usage: " << argv[0] << " [options]" << std::endl;
+        std::cerr << "  -h host        tcp server (127.0.0.1)" << std::endl;
+        std::cerr << "  -P port        (3306)" << std::endl;
+        std::cerr << "  -s path        unix socket of the same server (/var/run/mysqld/mysqld.sock)" << std::endl;
+        std::cerr << "  -u user        (root)" << std::endl;
+        std::cerr << "  -p pass        (root)" << std::endl;
+        std::cerr << "  -n count       round trips per transport (10000)" << std::endl;
+        std::cerr << "  -c connects    handshakes per transport (100)" << std::endl;
+        std::cerr << "  -q sql         query to round trip (select 1)" << std::endl;
+        return 1;
+    };
+
+    for( int i = 1; i < argc; ++i ) {
+        std::string opt = argv[i];
+        if( opt.size() != 2 || opt[0] != '-' || i + 1 >= argc )
+            return usage();
+        std::string arg = argv[++i];
+        /**/ if( opt == "-h" ) host = arg;
+        else if( opt == "-P" ) port = arg;
+        else if( opt == "-s" ) path = arg;
+        else if( opt == "-u" ) user = arg;
+        else if( opt == "-p" ) pass = arg;
+        else if( opt == "-n" ) count = std::stoul(arg);
+        else if( opt == "-c" ) connects = std::stoul(arg);
+        else if( opt == "-q" ) query = arg;
+        else return usage();
+    }
+    if( !count || path.empty() || path[0] != '/' )
+        return usage();
+
+    sq::metrics::reset();
+
+    typedef std::chrono::steady_clock clock;
+    unsigned failed = 0;
+    const std::string names[] = { "tcp", "unix" }, hosts[] = { host, path };
+
+    for( int t = 0; t < 2; ++t ) {
+        for( unsigned n = 0; n < connects; ++n ) {
+            sq::light sql;
+            sq::metrics m( names[t] + " connect" );
+            if( !sql.connect( hosts[t], port, user, pass ) )
+                m.cancel(), failed++;
+        }
+
+        sq::light sql;
+        if( !sql.connect( hosts[t], port, user, pass ) )
+            return std::cerr << "error: " << names[t] << " connection to database failed" << std::endl, 1;
+
+        std::string label = names[t] + " query";
+        std::clock_t cpu = std::clock();
+        clock::time_point start = clock::now();
+        for( unsigned n = 0; n < count; ++n ) {
+            sq::metrics m( label );
+            if( !sql.test( query ) )
+                m.cancel(), failed++;
+        }
+        double elapsed = std::chrono::duration_cast< std::chrono::duration<double> >( clock::now() - start ).count();
+        std::cout << names[t] << ": " << count / elapsed << " q/s, cpu:" << double( std::clock() - cpu ) / CLOCKS_PER_SEC / count << " per query" << std::endl;
+    }
+
+    std::string format = "{idx} (x{hits}) avg:{avg} p50:{p50} p99:{p99} max:{max}";
+    for( auto &line : sq::metrics::report( format, "{idx}", false ) ) {
+        if( line.compare( 0, 4, "tcp " ) == 0 || line.compare( 0, 5, "unix " ) == 0 )
+            std::cout << line << std::endl;
+    }
+    if( failed )
+        std::cout << failed << " call(s) failed" << std::endl;
+
+    return failed ? 2 : 0;
+}